@@ -0,0 +1,262 @@
+/**
+ * Compares ThreadPool against the single-queue pool it replaced, by fanning
+ * out many short jobs the way BlockCache::getBlocks does for a large read,
+ * and waiting for each fan-out to finish.
+ *
+ * Usage: threadpool-bench [jobs [threads [fanout [work]]]]
+ *   jobs     total jobs to run (default 200000)
+ *   threads  workers, zero for one per CPU (default 0)
+ *   fanout   jobs queued together before waiting (default 32)
+ *   work     iterations of busy work in each job (default 200)
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+#include <signal.h>
+
+#include "Stats.h"
+#include "ThreadPool.h"
+
+namespace {
+
+/**
+ * The old pool: one queue behind one lock, a signal per job, and each job
+ * allocated and deleted.
+ */
+class QueuePool
+{
+public:
+    struct Job
+    {
+        virtual void operator()() = 0;
+
+        virtual ~Job() { }
+    };
+
+protected:
+    std::vector<pthread_t> mThreads;
+    ConditionVariable mCond;
+    std::queue<Job*> mJobs;
+    bool mCancelling;
+
+    static void * threadFunc( void *val )
+    {
+        sigset_t allsig;
+        sigfillset( &allsig );
+        pthread_sigmask( SIG_BLOCK, &allsig, NULL );
+
+        QueuePool *pool = reinterpret_cast<QueuePool*>( val );
+        while ( Job *job = pool->nextJob() ) {
+            ( *job )();
+            delete job;
+        }
+        return 0;
+    }
+
+    Job * nextJob()
+    {
+        Lock lock( mCond );
+        while ( mJobs.empty() ) {
+            mCond.wait();
+        }
+        Job *job = mJobs.front();
+        mJobs.pop();
+        return job;
+    }
+
+public:
+    QueuePool( size_t threads ) :
+        mThreads( threads ),
+        mCancelling( false )
+    {
+        for ( size_t i = 0; i < threads; ++i ) {
+            pthread_create( &mThreads[i], 0, &threadFunc, this );
+        }
+    }
+
+    ~QueuePool()
+    {
+        {
+            Lock lock( mCond );
+            mCancelling = true;
+            for ( size_t i = 0; i < mThreads.size(); ++i ) {
+                mJobs.push( 0 );        // request cancellation
+            }
+            mCond.broadcast();
+        }
+        for ( size_t i = 0; i < mThreads.size(); ++i ) {
+            pthread_join( mThreads[i], 0 );
+        }
+    }
+
+    void enqueue( Job* job )
+    {
+        Lock lock( mCond );
+        if ( mCancelling ) {
+            throw std::runtime_error( "Can't add jobs while cancelling" );
+        }
+        mJobs.push( job );
+        mCond.signal();
+    }
+};
+
+// Counts down the jobs in a fan-out
+struct Latch
+{
+    ConditionVariable cond;
+    size_t remain;
+
+    Latch() :
+        remain( 0 ) { }
+
+    void done()
+    {
+        Lock lock( cond );
+        if ( --remain == 0 ) {
+            cond.signal();
+        }
+    }
+
+    void wait()
+    {
+        Lock lock( cond );
+        while ( remain ) {
+            cond.wait();
+        }
+    }
+};
+
+std::atomic<uint64_t> gSink( 0 );
+
+void work( size_t iterations )
+{
+    uint64_t x = iterations;
+    for ( size_t i = 0; i < iterations; ++i ) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    gSink += x;
+}
+
+struct OldJob : public QueuePool::Job
+{
+    Latch& latch;
+    size_t iterations;
+
+    OldJob( Latch& l,
+            size_t i ) :
+        latch( l ),
+        iterations( i ) { }
+
+    void operator()() override
+    {
+        work( iterations );
+        latch.done();
+    }
+};
+
+// Owned by the benchmark and reused, like BlockCache's pooled jobs
+struct NewJob : public ThreadPool::Job
+{
+    Latch *latch;
+    size_t iterations;
+
+    NewJob() :
+        latch( 0 ),
+        iterations( 0 ) { }
+
+    void operator()() override
+    {
+        work( iterations );
+        latch->done();
+    }
+
+    void release() override { }
+};
+
+double runOld( size_t threads,
+               size_t jobs,
+               size_t fanout,
+               size_t iterations )
+{
+    QueuePool pool( threads );
+    Latch latch;
+    const uint64_t start = Stats::now();
+    for ( size_t done = 0; done < jobs; done += fanout ) {
+        const size_t n = std::min( fanout, jobs - done );
+        latch.remain = n;
+        for ( size_t i = 0; i < n; ++i ) {
+            pool.enqueue( new OldJob( latch, iterations ) );
+        }
+        latch.wait();
+    }
+    return ( Stats::now() - start ) / 1e9;
+}
+
+double runNew( size_t threads,
+               size_t jobs,
+               size_t fanout,
+               size_t iterations,
+               bool   batched )
+{
+    ThreadPool pool( threads );
+    Latch latch;
+    std::vector<NewJob> pooled( fanout );
+    std::vector<ThreadPool::Job*> ptrs( fanout );
+    for ( size_t i = 0; i < fanout; ++i ) {
+        pooled[i].latch = &latch;
+        pooled[i].iterations = iterations;
+        ptrs[i] = &pooled[i];
+    }
+
+    const uint64_t start = Stats::now();
+    for ( size_t done = 0; done < jobs; done += fanout ) {
+        const size_t n = std::min( fanout, jobs - done );
+        latch.remain = n;
+        if ( batched ) {
+            pool.enqueue( &ptrs[0], n );
+        } else {
+            for ( size_t i = 0; i < n; ++i ) {
+                pool.enqueue( ptrs[i] );
+            }
+        }
+        latch.wait();
+    }
+    return ( Stats::now() - start ) / 1e9;
+}
+
+void report( const char* name,
+             size_t      jobs,
+             double      secs )
+{
+    printf( "%-24s %10.0f jobs/s  (%.3f s)\n", name, jobs / secs, secs );
+}
+
+}
+
+int main( int    argc,
+          char **argv )
+{
+    const size_t jobs = argc > 1 ? strtoul( argv[1], 0, 10 ) : 200000;
+    size_t threads = argc > 2 ? strtoul( argv[2], 0, 10 ) : 0;
+    const size_t fanout = argc > 3 ? strtoul( argv[3], 0, 10 ) : 32;
+    const size_t iterations = argc > 4 ? strtoul( argv[4], 0, 10 ) : 200;
+    if ( !jobs || !fanout ) {
+        fprintf( stderr, "jobs and fanout must be positive\n" );
+        return 2;
+    }
+    if ( !threads ) {
+        threads = ThreadPool::systemCPUs();
+    }
+
+    printf( "%zu jobs, %zu threads, fan-out of %zu, %zu iterations each\n",
+            jobs, threads, fanout, iterations );
+    report( "single queue", jobs, runOld( threads, jobs, fanout, iterations ) );
+    report( "work-stealing", jobs, runNew( threads, jobs, fanout, iterations, false ) );
+    report( "work-stealing, batched", jobs, runNew( threads, jobs, fanout, iterations, true ) );
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include "BackgroundIndexedFile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+BackgroundIndexedFile::BackgroundIndexedFile( IndexedCompFile* file ) :
+    CompressedFile( file->path() ),
+    mFile( file ),
+    mCurrent(),
+    mSizeHint( file->sizeHint() ),
+    mJob( *this ),
+    mPool( 0 ),
+    mIndexed( 0 ),
+    mWanted( 0 ),
+    mStarted( false ),
+    mDone( false ),
+    mFailed( false ),
+    mCancelled( false ) { }
+
+BackgroundIndexedFile::~BackgroundIndexedFile()
+{
+    // The job refers to us. If it hasn't started, hurry it along so it can
+    // see it's cancelled.
+    Lock lock( mCond );
+    mCancelled = true;
+    if ( mPool && !mStarted ) {
+        mPool->promote( &mJob, ThreadPool::Demand );
+    }
+    while ( mPool && !mDone ) {
+        mCond.wait();
+    }
+}
+
+void BackgroundIndexedFile::index( ThreadPool& pool )
+{
+    {
+        Lock lock( mCond );
+        mPool = &pool;
+    }
+    if ( !pool.enqueue( &mJob, ThreadPool::Background ) ) {
+        released();
+    }
+}
+
+BackgroundIndexedFile::Snapshot BackgroundIndexedFile::current() const
+{
+    Snapshot file = std::atomic_load( &mCurrent );
+    if ( !file ) {
+        throw std::runtime_error( "nothing indexed yet" );
+    }
+    return file;
+}
+
+CompressedFile::BlockIterator BackgroundIndexedFile::findBlock( off_t off ) const
+{
+    Snapshot file = current();
+    BlockIterator iter = file->findBlock( off );
+    iter.own( file );
+    return iter;
+}
+
+bool BackgroundIndexedFile::indexing() const
+{
+    Lock lock( mCond );
+    return !mDone && !mFailed;
+}
+
+size_t BackgroundIndexedFile::indexSize() const
+{
+    // Older snapshots go once nobody's using them, so only count the latest
+    Snapshot file = std::atomic_load( &mCurrent );
+    Lock lock( mCond );
+    size_t size = file && file.get() != mFile.get() ? file->indexSize() : 0;
+    return mDone ? size + mFile->indexSize() : size;
+}
+
+off_t BackgroundIndexedFile::uncompressedSize() const
+{
+    Snapshot file = std::atomic_load( &mCurrent );
+    return file ? file->uncompressedSize() : 0;
+}
+
+off_t BackgroundIndexedFile::apparentSize() const
+{
+    const off_t size = uncompressedSize();
+    return indexing() ? std::max( size, mSizeHint ) : size;
+}
+
+void BackgroundIndexedFile::waitForIndex( off_t end ) const
+{
+    Lock lock( mCond );
+    if ( mIndexed >= end || mDone ) {
+        return;
+    }
+
+    mWanted = std::max( mWanted, end );
+    if ( mPool && !mStarted ) {
+        mPool->promote( &mJob, ThreadPool::Demand );
+    }
+    while ( mIndexed < end && !mDone ) {
+        mCond.wait();
+    }
+}
+
+void BackgroundIndexedFile::indexed( const IndexedCompFile& file )
+{
+    // Called from the builder, so its index is ours to read
+    const off_t size = file.uncompressedSize();
+    {
+        Lock lock( mCond );
+        if ( mCancelled ) {
+            throw Cancelled();
+        }
+        const bool wanted = mWanted > mIndexed && size >= mWanted;
+        if ( size == 0 || ( size < 2 * mIndexed && !wanted ) ) {
+            return;
+        }
+    }
+
+    // Copying may take a while, so readers carry on with the old one
+    Snapshot snap( file.snapshot() );
+    Lock lock( mCond );
+    std::atomic_store( &mCurrent, snap );
+    mIndexed = size;
+    mCond.broadcast();
+}
+
+void BackgroundIndexedFile::build()
+{
+    {
+        Lock lock( mCond );
+        mStarted = true;
+        if ( mCancelled ) {
+            return;
+        }
+    }
+
+    try {
+        mFile->buildPendingIndex( this );
+        Lock lock( mCond );
+        std::atomic_store( &mCurrent, Snapshot( Snapshot(), mFile.get() ) );    // we own it
+        mIndexed = mFile->uncompressedSize();
+    } catch ( Cancelled& ) {
+        // nobody wants it any more
+    } catch ( std::exception& e ) {
+        Lock lock( mCond );
+        mFailed = true;                 // what we have is all there'll be
+        fprintf( stderr, "Error indexing %s, only serving its first %lld bytes: %s\n",
+                 path().c_str(), (long long) mIndexed, e.what() );
+    }
+}
+
+void BackgroundIndexedFile::released()
+{
+    Lock lock( mCond );
+    mStarted = true;
+    mDone = true;
+    mCond.broadcast();
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "CompressedFile.h"
+#include "ThreadPool.h"
+
+#include <memory>
+
+
+/**
+ * A file whose index is built in the background, after we've mounted.
+ *
+ * As the index grows, copies of it are published for readers to use. That
+ * happens each time it doubles, or sooner if someone is waiting for the part
+ * just indexed. Reads past what's published wait for it, and hurry the
+ * build along. Readers and their block iterators share each copy, and it's
+ * freed once the last of them is done with it.
+ *
+ * If the build fails, we stop there, serving only what was indexed.
+ */
+class BackgroundIndexedFile : public CompressedFile,
+                              protected IndexedCompFile::Progress
+{
+protected:
+    struct Job : public ThreadPool::Job
+    {
+        BackgroundIndexedFile& file;
+
+        Job( BackgroundIndexedFile& f ) :
+            file( f ) { }
+
+        void operator()() override { file.build(); }
+
+        void release() override { file.released(); }
+    };
+
+    struct Cancelled { };       // thrown through the builder to stop it
+
+    typedef std::shared_ptr<const CompressedFile> Snapshot;
+
+    std::unique_ptr<IndexedCompFile> mFile;     // building the index
+    Snapshot mCurrent;                  // what readers use, loaded and stored atomically
+    off_t mSizeHint;
+    mutable Job mJob;
+
+    mutable ConditionVariable mCond;    // guards everything below
+    ThreadPool *mPool;                  // once we've started
+    off_t mIndexed;                     // size of the current index
+    mutable off_t mWanted;              // what waiting readers need indexed
+    bool mStarted, mDone, mFailed, mCancelled;
+
+    // The index to use, throws if there's none yet
+    Snapshot current() const;
+
+    void indexed( const IndexedCompFile& file ) override;
+
+    void build();
+
+    void released();
+
+public:
+    // Takes ownership of file, which must have its index pending
+    BackgroundIndexedFile( IndexedCompFile* file );
+
+    ~BackgroundIndexedFile();
+
+    // Start building the index on pool
+    void index( ThreadPool& pool );
+
+    const std::string& path() const override { return mFile->path(); }
+
+    std::string destName() const override { return mFile->destName(); }
+
+    const char * format() const override { return mFile->format(); }
+
+    size_t indexSize() const override;
+
+    BlockIterator findBlock( off_t off ) const override;
+
+    void decompressBlock( const FileHandle& fh,
+                          const Block&      b,
+                          uint8_t*          ubuf ) const override
+    { current()->decompressBlock( fh, b, ubuf ); }
+
+    Decoder * decoder( const FileHandle& fh,
+                       const Block&      b ) const override
+    { return current()->decoder( fh, b ); }
+
+    off_t uncompressedSize() const override;
+
+    off_t apparentSize() const override;
+
+    // Until the build is over, whether or not it worked
+    bool indexing() const override;
+
+    void waitForIndex( off_t end ) const override;
+};
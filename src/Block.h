@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -7,15 +8,16 @@ struct Block
 {
     uint32_t usize, csize;
     uint64_t uoff, coff;
+    uint64_t index;             // position in the file, for per-format data
 
     Block( uint32_t us = 0,
            uint32_t cs = 0,
            uint64_t uo = 0,
-           uint64_t co = 0 ) :
+           uint64_t co = 0,
+           uint64_t idx = 0 ) :
         usize( us ),
         csize( cs ),
         uoff( uo ),
-        coff( co ) { }
-
-    virtual ~Block() { }
+        coff( co ),
+        index( idx ) { }
 };
@@ -1,87 +1,567 @@
 #include "BlockCache.h"
 
+#include <algorithm>
 #include <cstdio>
 
+#include <fcntl.h>
 #include <inttypes.h>
+#include <unistd.h>
 
-void BlockCache::dump()
+const size_t BlockCache::MaxShards = 16;
+const size_t BlockCache::MinShardWeight = 4 * 1024 * 1024;
+const size_t BlockCache::MaxFreeJobs = 64;
+const size_t BlockCache::EnqueueBatch = 32;
+
+size_t BlockCache::gSegmentSize = 1024 * 1024;
+size_t BlockCache::gMaxStreams = 4;
+
+BlockCache::Shard::~Shard()
+{
+    for ( size_t i = 0; i < freeJobs.size(); ++i ) {
+        delete freeJobs[i];
+    }
+}
+
+BlockCache::BlockCache( ThreadPool& pool,
+                        size_t      maxSize,
+                        size_t      shards ) :
+    mShards( 0 ),
+    mShardCount( shards ? shards : shardsFor( maxSize ) ),
+    mJobs( 0 ),
+    mDecoding( 0 ),
+    mSegmentAbove( 0 ),
+    mDisk( 0 ),
+    mPool( pool ),
+    mStreamTick( 0 )
+{
+    mShards = new Shard[mShardCount];
+    this->maxSize( maxSize );
+}
+
+BlockCache::~BlockCache()
+{
+    // Jobs touch their shard after their last waiter is done, so wait for
+    // them all to come back
+    while ( true ) {
+        size_t idle = 0;
+        for ( size_t i = 0; i < mShardCount; ++i ) {
+            Lock lock( mShards[i].mutex );
+            idle += mShards[i].freeJobs.size();
+        }
+        if ( idle == mJobs ) {
+            break;
+        }
+        usleep( 1000 );
+    }
+    if ( mDisk ) {
+        mDisk->flush();     // writes hold our buffers
+    }
+    for ( StreamMap::iterator i = mStreams.begin(); i != mStreams.end(); ++i ) {
+        delete i->second;
+    }
+    delete[] mShards;
+}
+
+size_t BlockCache::shardsFor( size_t maxSize )
+{
+    size_t shards = 1;
+    while ( shards < MaxShards && maxSize / ( shards * 2 ) >= MinShardWeight ) {
+        shards *= 2;
+    }
+    return shards;
+}
+
+void BlockCache::maxSize( size_t s )
+{
+    mBuffers.maxIdle( s / 8 );
+    for ( size_t i = 0; i < mShardCount; ++i ) {
+        Lock lock( mShards[i].mutex );
+        mShards[i].map.maxWeight( s / mShardCount );
+    }
+
+    // Anything taking up more than half a shard would churn it
+    mSegmentAbove = s / mShardCount / 2;
+}
+
+size_t BlockCache::size() const
+{
+    size_t weight = 0;
+    for ( size_t i = 0; i < mShardCount; ++i ) {
+        Lock lock( mShards[i].mutex );
+        weight += mShards[i].map.weight();
+    }
+    return weight;
+}
+
+size_t BlockCache::maxSize() const
+{
+    size_t weight = 0;
+    for ( size_t i = 0; i < mShardCount; ++i ) {
+        Lock lock( mShards[i].mutex );
+        weight += mShards[i].map.maxWeight();
+    }
+    return weight;
+}
+
+size_t BlockCache::inFlight() const
 {
-    Map::Iterator iter;
-    size_t blocks = 0;
+    size_t jobs = 0;
+    for ( size_t i = 0; i < mShardCount; ++i ) {
+        Lock lock( mShards[i].mutex );
+        jobs += mShards[i].inFlight.size();
+    }
+    return jobs;
+}
 
-    for ( iter = mMap.begin(); iter != mMap.end(); ++iter ) {
-        ++blocks;
+void BlockCache::policy( LRUMapBase::Policy p )
+{
+    for ( size_t i = 0; i < mShardCount; ++i ) {
+        Lock lock( mShards[i].mutex );
+        mShards[i].map.policy( p );
+    }
+}
+
+size_t BlockCache::maxBlockSize() const
+{
+    return mShards[0].map.maxWeight();
+}
+
+bool BlockCache::segmented( const BlockIterator& it ) const
+{
+    return it->usize > mSegmentAbove
+           && it.index() < ( uint64_t( 1 ) << SegmentIndexBits )
+           && ( it->usize - 1 ) / gSegmentSize < ( uint64_t( 1 ) << SegmentBits );
+}
+
+Block BlockCache::segment( const Block& b,
+                           uint64_t     seg )
+{
+    uint64_t off = seg * gSegmentSize;
+    return Block( std::min( uint64_t( gSegmentSize ), b.usize - off ), 0,
+                  b.uoff + off, b.coff, b.index );
+}
+
+BlockCache::Shard& BlockCache::shard( Key k ) const
+{
+    // The hash's low bits are weak, so use the high ones
+    uint64_t h = KeyHasher() ( k );
+    return mShards[( h >> 32 ) % mShardCount];
+}
+
+BlockCache::Job* BlockCache::newJob( Shard&                    sh,
+                                     const OpenCompressedFile& file,
+                                     const BlockIterator&      it,
+                                     Key                       k )
+{
+    if ( sh.freeJobs.empty() ) {
+        ++mJobs;
+        Job *job = new Job( *this, file, it, k );
+        job->queued = Stats::now();
+        return job;
+    }
+
+    Job *job = sh.freeJobs.back();
+    sh.freeJobs.pop_back();
+    job->file = &file;
+    job->biter = it;
+    job->key = k;
+    job->queued = Stats::now();
+    return job;
+}
+
+bool BlockCache::recycle( Shard& sh,
+                          Job*   job )
+{
+    if ( sh.freeJobs.size() < MaxFreeJobs ) {
+        job->biter = BlockIterator();   // don't keep its index alive
+        sh.freeJobs.push_back( job );
+        return true;
+    }
+    --mJobs;
+    return false;
+}
+
+void BlockCache::dump()
+{
+    size_t blocks = 0, weight = 0;
+    for ( size_t i = 0; i < mShardCount; ++i ) {
+        Lock lock( mShards[i].mutex );
+        Map& map = mShards[i].map;
+        for ( Map::Iterator iter = map.begin(); iter != map.end(); ++iter ) {
+            ++blocks;
+        }
+        weight += map.weight();
     }
     fprintf( stderr, "\nCache: %3zu blocks, %5.2f MB\n",
-             blocks, mMap.weight() / 1024.0 / 1024 );
+             blocks, weight / 1024.0 / 1024 );
 
-    for ( iter = mMap.begin(); iter != mMap.end(); ++iter ) {
-        fprintf( stderr, "  %9" PRIu64 " %s\n", uint64_t( iter->key.offset ),
-                 iter->key.id.c_str() );
+    for ( size_t i = 0; i < mShardCount; ++i ) {
+        Lock lock( mShards[i].mutex );
+        Map& map = mShards[i].map;
+        for ( Map::Iterator iter = map.begin(); iter != map.end(); ++iter ) {
+            uint64_t index = iter->key & ( ( uint64_t( 1 ) << KeyIndexBits ) - 1 );
+            uint64_t file = ( iter->key & ~SegmentFlag ) >> KeyIndexBits;
+            if ( iter->key & SegmentFlag ) {
+                fprintf( stderr, "  %9" PRIu64 " segment %5" PRIu64 " file %" PRIu64 "\n",
+                         index >> SegmentBits,
+                         index & ( ( uint64_t( 1 ) << SegmentBits ) - 1 ), file );
+            } else {
+                fprintf( stderr, "  %9" PRIu64 " file %" PRIu64 "\n", index, file );
+            }
+        }
+    }
+}
+
+void BlockCache::JobInfo::wait()
+{
+    Lock lock( cv );
+    ++remain;
+}
+
+void BlockCache::JobInfo::done()
+{
+    Lock lock( cv );
+    if ( --remain == 0 ) {
+        cv.signal();
     }
 }
 
 void BlockCache::Job::operator()()
 {
-    bool done = false;
-    {
-        // We could have acquired the block between queuing and runnnig
-        Lock lock( info.cache.mMutex );
-        BufPtr *buf = info.cache.mMap.find( block.key );
-        if ( buf ) {
-            info.cb( *block.biter, *buf );
-            done = true;
+    Stats::FileCounters& stats = Stats::file( file->file() );
+    stats.wait.add( Stats::now() - queued );
+
+    BufPtr nbuf = cache->mBuffers.get( biter->usize );
+    cache->mDecoding += nbuf->capacity();
+    if ( DiskCache *disk = cache->mDisk ) {
+        DiskCache::Source src( file->handle() );
+        if ( disk->read( src, *biter, nbuf->data() ) ) {
+            stats.diskHits.add();
+        } else {
+            decompress( stats, nbuf->data() );
+            disk->write( src, *biter, nbuf );
         }
+    } else {
+        decompress( stats, nbuf->data() );
     }
 
-    if ( !done ) {
-        BufPtr nbuf( new Buffer() );
-        info.file.decompressBlock( *block.biter, *nbuf );
-        Lock lock( info.cache.mMutex );
+    Waiters waiters;
+    {
+        Shard& sh = cache->shard( key );
+        Lock lock( sh.mutex );
         try {
-            info.cache.mMap.add( block.key, nbuf, nbuf->size() );
+            sh.map.add( key, nbuf, nbuf->capacity() );
         } catch ( Map::OverWeight& e ) {
             // that's ok!
         }
-        info.cb( *block.biter, nbuf );
+        cache->mDecoding -= nbuf->capacity();
+
+        InFlightMap::iterator fiter = sh.inFlight.find( key );
+        waiters.swap( fiter->second.waiters );
+        sh.inFlight.erase( fiter );
     }
 
-    Lock lock( info.cv );
-    if ( --info.remain == 0 ) {
-        info.cv.signal();
+    // The buffer is ours now, so no need to hold the lock while copying
+    for ( Waiters::iterator w = waiters.begin(); w != waiters.end(); ++w ) {
+        ( *w )->cb( *biter, nbuf );
+        ( *w )->done();
     }
 }
 
-void BlockCache::getBlocks( const OpenCompressedFile& file,
-                            BlockIterator&            it,
-                            off_t                     max,
-                            Callback&                 cb )
+void BlockCache::Job::decompress( Stats::FileCounters& stats,
+                                  uint8_t*             buf )
 {
-    std::vector<NeededBlock> need;
+    uint64_t start = Stats::now();
+    file->decompressBlock( *biter, buf );
+    stats.decode.add( Stats::now() - start );
+    stats.blocks.add();
+    stats.bytes.add( biter->usize );
+}
+
+void BlockCache::Job::release()
+{
+    Shard& sh = cache->shard( key );
     {
-        Lock lock( mMutex );
-        for ( ; !it.end() && (off_t)it->uoff < max; ++it ) {
-            Key k( file.id(), it->coff );
-            BufPtr *buf = mMap.find( k );
-            if ( buf ) {
-                cb( *it, *buf );
+        Lock lock( sh.mutex );
+        if ( cache->recycle( sh, this ) ) {
+            return;
+        }
+    }
+    delete this;
+}
+
+void BlockCache::StreamJob::operator()()
+{
+    Stream& st = *stream;
+    Stats::FileCounters& stats = Stats::file( st.file );
+    stats.wait.add( Stats::now() - queued );
+
+    const Block& b = *st.biter;
+    while ( true ) {
+        {
+            Lock lock( cache->mStreamMutex );
+            if ( st.wanted.empty() ) {
+                st.job = 0;
+                st.used = ++cache->mStreamTick;
+                cache->trimStreams();
+                return;
+            }
+            if ( *st.wanted.begin() < st.pos ) {
+                st.decoder.reset();         // have to go back to the start
+                st.pos = 0;
+            }
+        }
+
+        // Only this job touches the decoder while it's running
+        if ( !st.decoder ) {
+            if ( !st.fh.open() ) {
+                st.fh.open( st.file->path(), O_RDONLY );
+            }
+            st.decoder.reset( st.file->decoder( st.fh, b ) );
+        }
+        Block seg = segment( b, st.pos );
+        BufPtr nbuf = cache->mBuffers.get( seg.usize );
+        cache->mDecoding += nbuf->capacity();
+        uint64_t start = Stats::now();
+        st.decoder->read( nbuf->data(), seg.usize );
+        stats.decode.add( Stats::now() - start );
+        stats.blocks.add();
+        stats.bytes.add( seg.usize );
+        if ( seg.uoff + seg.usize == b.uoff + b.usize ) {
+            st.decoder.reset();
+        }
+
+        Waiters waiters;
+        {
+            Key k = segmentKey( st.file->id(), st.biter.index(), st.pos );
+            Shard& sh = cache->shard( k );
+            Lock lock( sh.mutex );
+            try {
+                sh.map.add( k, nbuf, nbuf->capacity() );
+            } catch ( Map::OverWeight& e ) {
+                // that's ok!
+            }
+            cache->mDecoding -= nbuf->capacity();
+
+            InFlightMap::iterator fiter = sh.inFlight.find( k );
+            if ( fiter != sh.inFlight.end() ) {
+                waiters.swap( fiter->second.waiters );
+                sh.inFlight.erase( fiter );
+            }
+
+            Lock slock( cache->mStreamMutex );
+            st.wanted.erase( st.pos++ );
+        }
+
+        for ( Waiters::iterator w = waiters.begin(); w != waiters.end(); ++w ) {
+            ( *w )->cb( seg, nbuf );
+            ( *w )->done();
+        }
+    }
+}
+
+void BlockCache::StreamJob::release()
+{
+    BlockCache *c = cache;
+    delete this;
+    --c->mJobs;
+}
+
+void BlockCache::trimStreams()
+{
+    size_t idle = 0;
+    for ( StreamMap::iterator i = mStreams.begin(); i != mStreams.end(); ++i ) {
+        idle += !i->second->job;
+    }
+    for ( ; idle > gMaxStreams; --idle ) {
+        StreamMap::iterator oldest = mStreams.end();
+        for ( StreamMap::iterator i = mStreams.begin(); i != mStreams.end(); ++i ) {
+            if ( !i->second->job && ( oldest == mStreams.end()
+                                      || i->second->used < oldest->second->used ) )
+            {
+                oldest = i;
+            }
+        }
+        delete oldest->second;
+        mStreams.erase( oldest );
+    }
+}
+
+bool BlockCache::wantSegment( const OpenCompressedFile& file,
+                              const BlockIterator&      it,
+                              uint64_t                  seg,
+                              ThreadPool::Priority      pri )
+{
+    Lock lock( mStreamMutex );
+    Stream *&st = mStreams[key( file.id(), it.index() )];
+    if ( !st ) {
+        st = new Stream( file.file(), it );
+    }
+    st->wanted.insert( seg );
+    if ( st->job ) {
+        if ( pri < st->priority ) {
+            mPool.promote( st->job, pri );
+            st->priority = pri;
+        }
+        return true;
+    }
+
+    // The job can't look at the stream until we unlock it
+    ++mJobs;
+    StreamJob *job = new StreamJob( *this, *st );
+    if ( !mPool.enqueue( job, pri ) ) {
+        delete job;
+        --mJobs;
+        st->wanted.erase( seg );
+        return false;
+    }
+    st->job = job;
+    st->priority = pri;
+    return true;
+}
+
+bool BlockCache::fetchSegments( const OpenCompressedFile& file,
+                                const BlockIterator&      it,
+                                off_t                     start,
+                                off_t                     max,
+                                JobInfo&                  info,
+                                ThreadPool::Priority      pri,
+                                Stats::FileCounters&      stats )
+{
+    const Block& b = *it;
+    uint64_t first = ( std::max( start, off_t( b.uoff ) ) - b.uoff ) / gSegmentSize;
+    uint64_t end = std::min( uint64_t( max - b.uoff ), uint64_t( b.usize ) );
+    for ( uint64_t s = first; s * gSegmentSize < end; ++s ) {
+        Key k = segmentKey( file.id(), it.index(), s );
+        BufPtr buf;
+        {
+            Shard& sh = shard( k );
+            Lock lock( sh.mutex );
+            BufPtr *found = sh.map.find( k );
+            InFlightMap::iterator fiter;
+            if ( found ) {
+                buf = *found;
+                stats.hits.add();
+            } else if ( ( fiter = sh.inFlight.find( k ) ) != sh.inFlight.end() ) {
+                // The stream's job is tracked by the stream, so promote it
+                // there
+                InFlight& fl = fiter->second;
+                if ( pri < fl.priority ) {
+                    wantSegment( file, it, s, pri );
+                    fl.priority = pri;
+                }
+                info.wait();
+                fl.waiters.push_back( &info );
+                stats.joins.add();
             } else {
-                need.push_back( NeededBlock( it, k ) );
+                if ( !wantSegment( file, it, s, pri ) ) {
+                    return false;
+                }
+                InFlight& fl = sh.inFlight[k];
+                fl.priority = pri;
+                info.wait();
+                fl.waiters.push_back( &info );
+                stats.misses.add();
             }
         }
+        if ( buf ) {
+            info.cb( segment( b, s ), buf );
+        }
     }
-    if ( need.empty() ) {
-        return;
+    return true;
+}
+
+void BlockCache::fetchBlocks( const OpenCompressedFile& file,
+                              BlockIterator&            it,
+                              off_t                     start,
+                              off_t                     max,
+                              JobInfo&                  info,
+                              ThreadPool::Priority      pri )
+{
+    ThreadPool::Job *batch[EnqueueBatch];
+    size_t queued = 0;
+    Stats::FileCounters& stats = Stats::file( file.file() );
+
+    for ( ; !it.end() && (off_t)it->uoff < max; ++it ) {
+        if ( segmented( it ) ) {
+            if ( queued ) {
+                mPool.enqueue( batch, queued );
+                queued = 0;
+            }
+            if ( !fetchSegments( file, it, start, max, info, pri, stats ) ) {
+                break;
+            }
+            continue;
+        }
+
+        Key k = key( file.id(), it.index() );
+        BufPtr buf;
+        {
+            Shard& sh = shard( k );
+            Lock lock( sh.mutex );
+            BufPtr *found = sh.map.find( k );
+            InFlightMap::iterator fiter;
+            if ( found ) {
+                buf = *found;
+                stats.hits.add();
+            } else if ( ( fiter = sh.inFlight.find( k ) ) != sh.inFlight.end() ) {
+                // Piggyback on it. Speculative jobs are enqueued before the
+                // shard is unlocked, so they can always be promoted.
+                InFlight& fl = fiter->second;
+                if ( pri < fl.priority ) {
+                    mPool.promote( fl.job, pri );
+                    fl.priority = pri;
+                }
+                info.wait();
+                fl.waiters.push_back( &info );
+                stats.joins.add();
+            } else {
+                Job *job = newJob( sh, file, it, k );
+                if ( pri == ThreadPool::Demand ) {
+                    batch[queued++] = job;
+                } else if ( !mPool.enqueue( job, pri ) ) {
+                    if ( !recycle( sh, job ) ) {
+                        delete job;
+                    }
+                    break;          // the pool has enough to do
+                }
+
+                InFlight& fl = sh.inFlight[k];
+                fl.job = job;
+                fl.priority = pri;
+                info.wait();
+                fl.waiters.push_back( &info );
+                stats.misses.add();
+            }
+        }
+
+        // Don't hold up queued jobs while copying
+        if ( queued && ( buf || queued == EnqueueBatch ) ) {
+            mPool.enqueue( batch, queued );
+            queued = 0;
+        }
+        if ( buf ) {
+            info.cb( *it, buf );
+        }
     }
+    if ( queued ) {
+        mPool.enqueue( batch, queued );
+    }
+}
 
+void BlockCache::getBlocks( const OpenCompressedFile& file,
+                            BlockIterator&            it,
+                            off_t                     start,
+                            off_t                     max,
+                            Callback&                 cb )
+{
     ConditionVariable cv;
-    Lock clock( cv );
-    size_t remain = need.size();
-    JobInfo info( *this, file, cb, cv, remain );
-    for ( std::vector<NeededBlock>::iterator nb = need.begin();
-          nb != need.end(); ++nb )
-    {
-        mPool.enqueue( new Job( info, *nb ) );
+    size_t remain = 0;
+    JobInfo info( cb, cv, remain );
+    fetchBlocks( file, it, start, max, info );
+
+    Lock lock( cv );
+    while ( remain ) {
+        cv.wait();
     }
-    cv.wait();
 }
@@ -1,118 +1,303 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
 #include "Block.h"
-#include "Buffer.h"
+#include "BufferPool.h"
+#include "DiskCache.h"
 #include "LRUMap.h"
 #include "OpenCompressedFile.h"
+#include "Stats.h"
 #include "ThreadPool.h"
 
 
 class BlockCache
 {
 public:
-    typedef std::shared_ptr<Buffer> BufPtr;
+    typedef PooledBuffer::Ptr BufPtr;
 
     struct Callback
     {
         virtual void operator()( const Block& block,
                                  BufPtr&      buf ) = 0;
 
+        virtual ~Callback() { }
     };
 
     typedef CompressedFile::BlockIterator BlockIterator;
 
-protected:
-    struct Key
+    struct JobInfo
     {
-        OpenCompressedFile::FileID id;
-        off_t offset;
-
-        Key( OpenCompressedFile::FileID i,
-             off_t                      o ) :
-            id( i ),
-            offset( o ) { }
-        bool operator==( const Key& o ) const
-        {
-            return o.offset == offset && o.id == id;
-        }
+        Callback& cb;
+        ConditionVariable& cv;
+        size_t& remain;
+
+        JobInfo( Callback&          pcb,
+                 ConditionVariable& pcv,
+                 size_t&            r ) :
+            cb( pcb ),
+            cv( pcv ),
+            remain( r ) { }
 
+        // Account for one more block we must wait for
+        void wait();
+
+        // Mark one block as delivered
+        void done();
     };
+
+protected:
+    // A file's ID in the top bits, and the block's index in the rest
+    typedef uint64_t Key;
+    static const unsigned KeyIndexBits = 40;
+
+    static Key key( OpenCompressedFile::FileID id,
+                    uint64_t                   index )
+    { return ( uint64_t( id ) << KeyIndexBits ) | index; }
+
     struct KeyHasher : public std::unary_function<Key, std::size_t>
     {
-        size_t operator()( const Key& k ) const
-        {
-            return std::hash<std::string>() ( k.id ) * 37 + k.offset;
-        }
-
+        size_t operator()( Key k ) const { return k * 0x9E3779B97F4A7C15ULL; }
     };
 
 
-    struct NeededBlock
+    // Jobs are recycled through their shard, rather than allocated for
+    // every block
+    struct Job : public ThreadPool::Job
     {
+        BlockCache *cache;
+        const OpenCompressedFile *file;
         BlockIterator biter;
         Key key;
+        uint64_t queued;        // when, for stats
 
-        NeededBlock( const BlockIterator& bi,
-                     const Key&           k ) :
+        Job( BlockCache&               c,
+             const OpenCompressedFile& f,
+             const BlockIterator&      bi,
+             Key                       k ) :
+            cache( &c ),
+            file( &f ),
             biter( bi ),
-            key( k ) { }
+            key( k ),
+            queued( 0 ) { }
+        void operator()() override;
+
+        void decompress( Stats::FileCounters& stats,
+                         uint8_t*             buf );
+
+        void release() override;
+
     };
+    friend struct Job;
 
-    struct JobInfo
+    // Everyone waiting for a block that's currently being decompressed.
+    // Only the first request for a key queues a Job, later ones just wait,
+    // raising the job's priority if they're more urgent.
+    typedef std::vector<JobInfo*> Waiters;
+    struct InFlight
     {
-        BlockCache& cache;
-        const OpenCompressedFile& file;
-        Callback& cb;
-        ConditionVariable& cv;
-        size_t& remain;
+        Waiters waiters;
+        Job *job;
+        ThreadPool::Priority priority;
+
+        InFlight() :
+            job( 0 ),
+            priority( ThreadPool::Demand ) { }
+    };
+    typedef std::unordered_map<Key, InFlight, KeyHasher> InFlightMap;
+
+    typedef LRUMap<Key, BufPtr, KeyHasher> Map;
+
+    // Blocks too big to cache are split into segments, whose keys have the
+    // top bit set and the segment number below a shorter block index
+    static const unsigned SegmentBits = 16;
+    static const unsigned SegmentIndexBits = KeyIndexBits - SegmentBits;
+    static const Key SegmentFlag = uint64_t( 1 ) << 63;
+
+    static Key segmentKey( OpenCompressedFile::FileID id,
+                           uint64_t                   index,
+                           uint64_t                   seg )
+    { return SegmentFlag | key( id, ( index << SegmentBits ) | seg ); }
+
+    // The part of b covered by a segment
+    static Block segment( const Block& b,
+                          uint64_t     seg );
+
+    // Decodes a segmented block from its start, caching every segment it
+    // passes. Streams stay around once they're out of work, so readers moving
+    // forward through the block don't have to start over.
+    struct Stream
+    {
+        const CompressedFile *file;
+        BlockIterator biter;
+        FileHandle fh;          // our own, the reader's may be closed
+        std::unique_ptr<CompressedFile::Decoder> decoder;
+        uint64_t pos;           // next segment the decoder will produce
+        std::set<uint64_t> wanted;
+        ThreadPool::Job *job;   // set while running
+        ThreadPool::Priority priority;
+        uint64_t used;          // for evicting idle streams
 
-        JobInfo( BlockCache&               c,
-                 const OpenCompressedFile& f,
-                 Callback&                 pcb,
-                 ConditionVariable&        pcv,
-                 size_t&                   r ) :
-            cache( c ),
+        Stream( const CompressedFile *f,
+                const BlockIterator&  bi ) :
             file( f ),
-            cb( pcb ),
-            cv( pcv ),
-            remain( r ) { }
+            biter( bi ),
+            pos( 0 ),
+            job( 0 ),
+            priority( ThreadPool::Demand ),
+            used( 0 ) { }
     };
+    typedef std::unordered_map<Key, Stream*, KeyHasher> StreamMap;
 
-    struct Job : public ThreadPool::Job
+    struct StreamJob : public ThreadPool::Job
     {
-        JobInfo& info;
-        NeededBlock& block;
+        BlockCache *cache;
+        Stream *stream;
+        uint64_t queued;
+
+        StreamJob( BlockCache& c,
+                   Stream&     s ) :
+            cache( &c ),
+            stream( &s ),
+            queued( Stats::now() ) { }
 
-        Job( JobInfo&     i,
-             NeededBlock& b ) :
-            info( i ),
-            block( b ) { }
         void operator()() override;
 
+        void release() override;
     };
-    friend struct Job;
+    friend struct StreamJob;
 
+    // The cache is split into independently locked shards, chosen by key.
+    // Each shard owns an equal slice of the total weight.
+    struct Shard
+    {
+        Mutex mutex;
+        Map map;
+        InFlightMap inFlight;
+        std::vector<Job*> freeJobs;
 
-    typedef LRUMap<Key, BufPtr, KeyHasher> Map;
-    Map mMap;
+        Shard() :
+            map( 0 ) { }
+
+        ~Shard();
+    };
+
+    static const size_t MaxShards;
+    static const size_t MinShardWeight;
+    static const size_t MaxFreeJobs;        // per shard
+    static const size_t EnqueueBatch;
+
+    Shard *mShards;
+    size_t mShardCount;
+    std::atomic<size_t> mJobs;          // allocated and not yet deleted
+    std::atomic<size_t> mDecoding;      // bytes of buffers being filled
+    std::atomic<size_t> mSegmentAbove;  // bigger blocks are segmented
+    BufferPool mBuffers;
+    DiskCache *mDisk;
     ThreadPool& mPool;
-    Mutex mMutex;
+
+    // Locked after any shard
+    Mutex mStreamMutex;
+    StreamMap mStreams;
+    uint64_t mStreamTick;
+
+    Shard& shard( Key k ) const;
+
+    // Get a job for a key, call with the shard locked
+    Job * newJob( Shard&                    sh,
+                  const OpenCompressedFile& file,
+                  const BlockIterator&      it,
+                  Key                       k );
+
+    // Return a job to the shard, call with the shard locked. Returns false
+    // if the job should be deleted instead.
+    bool recycle( Shard& sh,
+                  Job*   job );
+
+    // Fetch the segments of it's block overlapping [start, max). False if a
+    // speculative fetch was refused.
+    bool fetchSegments( const OpenCompressedFile& file,
+                        const BlockIterator&      it,
+                        off_t                     start,
+                        off_t                     max,
+                        JobInfo&                  info,
+                        ThreadPool::Priority      pri,
+                        Stats::FileCounters&      stats );
+
+    // Ask a stream to decode a segment, starting it if needed. Call with the
+    // segment's shard locked. False if a speculative fetch was refused.
+    bool wantSegment( const OpenCompressedFile& file,
+                      const BlockIterator&      it,
+                      uint64_t                  seg,
+                      ThreadPool::Priority      pri );
+
+    // Delete the least recently used idle streams, call with mStreamMutex
+    void trimStreams();
 
 public:
+    // Size of the pieces of a segmented block
+    static size_t gSegmentSize;
+
+    // Most streams to keep once they're idle
+    static size_t gMaxStreams;
+
+    // Zero shards picks a count suitable for maxSize
     BlockCache( ThreadPool& pool,
-                size_t      maxSize = 0 ) :
-        mMap( maxSize ),
-        mPool( pool ) { }
+                size_t      maxSize = 0,
+                size_t      shards = 0 );
+
+    ~BlockCache();
+
+    // How many shards we'd use for a cache of the given size
+    static size_t shardsFor( size_t maxSize );
+
+    void maxSize( size_t s );
 
-    void maxSize( size_t s ) { mMap.maxWeight( s ); }
+    // Bytes of blocks currently cached
+    size_t size() const;
+
+    size_t maxSize() const;
+
+    // Blocks being decompressed, or waiting to be
+    size_t inFlight() const;
+
+    // Bytes of buffers being decompressed, which will soon be cached
+    size_t decoding() const { return mDecoding; }
+
+    void policy( LRUMapBase::Policy p );
+
+    // Check a second tier for blocks we don't have, and save blocks there
+    // once they're decompressed. Must outlive us.
+    void diskCache( DiskCache* d ) { mDisk = d; }
+
+    // Largest block that can be cached
+    size_t maxBlockSize() const;
+
+    // Whether the block at it is cached in segments
+    bool segmented( const BlockIterator& it ) const;
 
     void dump();
 
+    // Start getting the blocks from it covering [start, max), without
+    // waiting. The callback in info is run for each block as it becomes
+    // available, or for each segment of a segmented block. Speculative
+    // fetches stop early if the pool won't take more jobs, with it left at
+    // the first block not completely fetched.
+    void fetchBlocks( const OpenCompressedFile& file,
+                      BlockIterator&            it,
+                      off_t                     start,
+                      off_t                     max,
+                      JobInfo&                  info,
+                      ThreadPool::Priority      pri = ThreadPool::Demand );
+
     void getBlocks( const OpenCompressedFile& file,
                     BlockIterator&            it,
+                    off_t                     start,
                     off_t                     max,
                     Callback&                 cb );
 
@@ -0,0 +1,141 @@
+#include "BlockIndex.h"
+
+#include <stdexcept>
+
+const size_t BlockIndex::GroupSize = 64;
+
+BlockIndex::Iterator::Iterator( const BlockIndex& idx,
+                                size_t            group,
+                                uint64_t          index ) :
+    mIndex( &idx ),
+    mGroup( group )
+{
+    mBlock.index = index;
+    load();
+}
+
+void BlockIndex::Iterator::load()
+{
+    const BlockIndex& idx = *mIndex;
+    const uint64_t i = mBlock.index;
+    if ( i >= idx.size() ) {
+        return;
+    }
+
+    const std::vector<Group>& groups = idx.mGroups;
+    while ( mGroup + 1 < groups.size() && groups[mGroup + 1].first <= i ) {
+        ++mGroup;
+    }
+    const Group& g = groups[mGroup];
+    mBlock.uoff = g.uoff + idx.mUDelta[i];
+    mBlock.coff = g.coff + idx.mCDelta[i];
+    mBlock.csize = idx.mCSize[i];
+
+    // Our size is the distance to the next block
+    uint64_t next;
+    if ( i + 1 == idx.size() ) {
+        next = idx.mEnd;
+    } else if ( mGroup + 1 < groups.size() && groups[mGroup + 1].first == i + 1 ) {
+        next = groups[mGroup + 1].uoff;
+    } else {
+        next = g.uoff + idx.mUDelta[i + 1];
+    }
+    mBlock.usize = next - mBlock.uoff;
+}
+
+void BlockIndex::add( uint32_t usize,
+                      uint64_t coff,
+                      uint32_t csize )
+{
+    const uint64_t uoff = mEnd;
+    if ( mGroups.empty() || size() - mGroups.back().first >= GroupSize
+         || uoff - mGroups.back().uoff > UINT32_MAX
+         || coff < mGroups.back().coff
+         || coff - mGroups.back().coff > UINT32_MAX )
+    {
+        mGroups.push_back( Group( uoff, coff, size() ) );
+    }
+
+    const Group& g = mGroups.back();
+    mUDelta.push_back( uoff - g.uoff );
+    mCDelta.push_back( coff - g.coff );
+    mCSize.push_back( csize );
+    mEnd += usize;
+}
+
+void BlockIndex::resizeLast( uint32_t usize,
+                             uint32_t csize )
+{
+    mEnd = mGroups.back().uoff + mUDelta.back() + usize;
+    mCSize.back() = csize;
+}
+
+Block BlockIndex::back() const
+{
+    const Group& g = mGroups.back();
+    uint64_t uoff = g.uoff + mUDelta.back();
+    return Block( mEnd - uoff, mCSize.back(), uoff, g.coff + mCDelta.back(),
+                  size() - 1 );
+}
+
+size_t BlockIndex::buildTree( size_t i,
+                              size_t k )
+{
+    // An in-order walk of the implicit tree visits the groups in order
+    if ( k < mTree.size() ) {
+        i = buildTree( i, 2 * k );
+        mTree[k] = mGroups[i].uoff;
+        mTreeGroup[k] = i++;
+        i = buildTree( i, 2 * k + 1 );
+    }
+    return i;
+}
+
+void BlockIndex::finish()
+{
+    mGroups.shrink_to_fit();
+    mUDelta.shrink_to_fit();
+    mCDelta.shrink_to_fit();
+    mCSize.shrink_to_fit();
+
+    mTree.assign( mGroups.size() + 1, 0 );
+    mTreeGroup.assign( mGroups.size() + 1, 0 );
+    buildTree( 0, 1 );
+}
+
+BlockIndex::Iterator BlockIndex::find( uint64_t off ) const
+{
+    if ( off >= mEnd ) {
+        throw std::runtime_error( "can't find block" );
+    }
+
+    // Find the first group starting after off. A node's descendants three
+    // levels down share a cache line, so fetch it early.
+    const size_t n = mGroups.size();
+    size_t k = 1;
+    while ( k <= n ) {
+        __builtin_prefetch( mTree.data() + 8 * k );
+        k = 2 * k + ( mTree[k] <= off );
+    }
+    k >>= __builtin_ffsll( ~(long long)k );
+    const size_t group = k ? mTreeGroup[k] - 1 : n - 1;
+
+    // Count the blocks in the group starting at or before off
+    const Group& g = mGroups[group];
+    const uint64_t end = group + 1 < n ? mGroups[group + 1].first : size();
+    const uint64_t rel = off - g.uoff;
+    size_t count = 0;
+    for ( uint64_t i = g.first + 1; i < end; ++i ) {
+        count += mUDelta[i] <= rel;
+    }
+    return Iterator( *this, group, g.first + count );
+}
+
+size_t BlockIndex::memory() const
+{
+    return mGroups.capacity() * sizeof( Group )
+           + ( mUDelta.capacity() + mCDelta.capacity() + mCSize.capacity() )
+           * sizeof( uint32_t )
+           + mTree.capacity() * sizeof( uint64_t )
+           + mTreeGroup.capacity() * sizeof( uint32_t );
+}
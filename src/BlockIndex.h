@@ -0,0 +1,105 @@
+#pragma once
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "Block.h"
+
+// The blocks of a file, packed for size and fast lookup. Blocks are split
+// into groups that hold full offsets, and each block keeps only 32-bit
+// offsets relative to its group. The group starts are also laid out in
+// Eytzinger order, so a search touches few cache lines.
+class BlockIndex
+{
+public:
+    static const size_t GroupSize;      // most blocks in a group
+
+    class Iterator
+    {
+        const BlockIndex *mIndex;
+        size_t mGroup;
+        Block mBlock;
+        std::shared_ptr<const void> mOwner;     // keeps mIndex around, if it may go
+
+        void load();
+
+    public:
+        Iterator() :
+            mIndex( 0 ),
+            mGroup( 0 ) { }
+
+        Iterator( const BlockIndex& idx,
+                  size_t            group,
+                  uint64_t          index );
+
+        Iterator& operator++() { ++mBlock.index; load(); return *this; }
+        const Block *operator->() const { return &mBlock; }
+        const Block& operator*() const { return mBlock; }
+
+        bool end() const { return mBlock.index >= mIndex->size(); }
+
+        // Position of the current block in the file, counting from zero
+        uint64_t index() const { return mBlock.index; }
+
+        // Keep owner, and so our index, for as long as we're around
+        void own( const std::shared_ptr<const void>& owner ) { mOwner = owner; }
+    };
+    friend class Iterator;
+
+protected:
+    struct Group
+    {
+        uint64_t uoff, coff;
+        uint64_t first;         // index of our first block
+
+        Group( uint64_t u,
+               uint64_t c,
+               uint64_t f ) :
+            uoff( u ),
+            coff( c ),
+            first( f ) { }
+    };
+
+    std::vector<Group> mGroups;
+    std::vector<uint32_t> mUDelta, mCDelta, mCSize;     // one per block
+    uint64_t mEnd;                                      // uncompressed size
+
+    // Group starts in Eytzinger order from index one, and where each
+    // came from
+    std::vector<uint64_t> mTree;
+    std::vector<uint32_t> mTreeGroup;
+
+    size_t buildTree( size_t i,
+                      size_t k );
+
+public:
+    BlockIndex() :
+        mEnd( 0 ) { }
+
+    size_t size() const { return mCSize.size(); }
+
+    bool empty() const { return mCSize.empty(); }
+
+    uint64_t uncompressedSize() const { return mEnd; }
+
+    // Add a block following the last one
+    void add( uint32_t usize,
+              uint64_t coff,
+              uint32_t csize );
+
+    void resizeLast( uint32_t usize,
+                     uint32_t csize );
+
+    Block back() const;
+
+    // Prepare for searching, once all blocks are added
+    void finish();
+
+    Iterator begin() const { return Iterator( *this, 0, 0 ); }
+
+    // The block containing off, throws if there is none
+    Iterator find( uint64_t off ) const;
+
+    size_t memory() const;
+};
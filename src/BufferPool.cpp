@@ -0,0 +1,179 @@
+#include "BufferPool.h"
+
+#include <new>
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+bool BufferPool::gHugePages = false;
+size_t BufferPool::gMaxFiles = 0;
+
+PooledBuffer::Ptr::~Ptr()
+{
+    if ( mBuf && --mBuf->mRefs == 0 ) {
+        mBuf->mPool->put( mBuf );
+    }
+}
+
+BufferPool::BufferPool( size_t maxIdle ) :
+    mFiles( 0 ),
+    mIdle( 0 ),
+    mMaxIdle( maxIdle ) { }
+
+BufferPool::~BufferPool()
+{
+    for ( unsigned c = 0; c < Classes; ++c ) {
+        while ( PooledBuffer *buf = mFree[c].head ) {
+            mFree[c].head = buf->mNext;
+            destroy( buf );
+        }
+    }
+}
+
+unsigned BufferPool::sizeClass( size_t size )
+{
+    if ( size <= ( size_t( 1 ) << MinClassBits ) ) {
+        return 0;
+    }
+    if ( size > ( size_t( 1 ) << MaxClassBits ) ) {
+        return Unpooled;
+    }
+
+    // 2^bits < size <= 2^(bits+1), split into steps of 2^bits / ClassSteps
+    unsigned bits = 63 - __builtin_clzll( size - 1 );
+    size_t step = ( ( size - 1 ) - ( size_t( 1 ) << bits ) ) / ( ( size_t( 1 ) << bits ) / ClassSteps );
+    return ( bits - MinClassBits ) * ClassSteps + step + 1;
+}
+
+size_t BufferPool::classCapacity( unsigned cls )
+{
+    size_t base = size_t( 1 ) << ( MinClassBits + cls / ClassSteps );
+    return base + base / ClassSteps * ( cls % ClassSteps );
+}
+
+uint8_t* BufferPool::allocate( size_t capacity,
+                               bool&  mapped )
+{
+    mapped = false;
+#ifdef MADV_HUGEPAGE
+    if ( gHugePages && capacity >= HugePageSize ) {
+        // Over-allocate so we can start on a hugepage boundary
+        size_t len = capacity + HugePageSize;
+        void *map = mmap( 0, len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( map != MAP_FAILED ) {
+            uintptr_t start = reinterpret_cast<uintptr_t>( map );
+            uintptr_t aligned = ( start + HugePageSize - 1 ) & ~( HugePageSize - 1 );
+            if ( aligned > start ) {
+                munmap( map, aligned - start );
+            }
+            munmap( reinterpret_cast<void*>( aligned + capacity ),
+                    start + len - ( aligned + capacity ) );
+            madvise( reinterpret_cast<void*>( aligned ), capacity, MADV_HUGEPAGE );
+            mapped = true;
+            return reinterpret_cast<uint8_t*>( aligned );
+        }
+    }
+#endif
+
+    void *data = malloc( capacity );
+    if ( !data ) {
+        throw std::bad_alloc();
+    }
+    return reinterpret_cast<uint8_t*>( data );
+}
+
+int BufferPool::allocateFile( size_t    capacity,
+                              uint8_t*& data )
+{
+#ifdef SYS_memfd_create
+    int fd = syscall( SYS_memfd_create, "lzopfs-block", 1 /* MFD_CLOEXEC */ );
+    if ( fd == -1 ) {
+        return -1;
+    }
+    if ( ftruncate( fd, capacity ) == 0 ) {
+        void *map = mmap( 0, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+        if ( map != MAP_FAILED ) {
+            data = reinterpret_cast<uint8_t*>( map );
+            return fd;
+        }
+    }
+    close( fd );
+#else
+    (void)capacity;
+    (void)data;
+#endif
+    return -1;
+}
+
+void BufferPool::deallocate( uint8_t *data,
+                             size_t   capacity,
+                             bool     mapped )
+{
+    if ( mapped ) {
+        munmap( data, capacity );
+    } else {
+        free( data );
+    }
+}
+
+PooledBuffer::Ptr BufferPool::get( size_t size )
+{
+    unsigned cls = sizeClass( size );
+    PooledBuffer *buf = 0;
+    if ( cls != Unpooled ) {
+        FreeList& fl = mFree[cls];
+        Lock lock( fl.mutex );
+        if ( ( buf = fl.head ) ) {
+            fl.head = buf->mNext;
+            mIdle -= buf->mCapacity;
+        }
+    }
+
+    if ( !buf ) {
+        size_t capacity = cls == Unpooled ? size : classCapacity( cls );
+        bool mapped = false;
+        uint8_t *data = 0;
+        int fd = -1;
+        const bool huge = gHugePages && capacity >= HugePageSize;
+        if ( cls != Unpooled && !huge && ++mFiles <= gMaxFiles ) {
+            fd = allocateFile( capacity, data );
+            mapped = fd != -1;
+        }
+        if ( fd == -1 ) {
+            if ( cls != Unpooled && !huge ) {
+                --mFiles;
+            }
+            data = allocate( capacity, mapped );
+        }
+        buf = new PooledBuffer( this, data, capacity, cls, mapped, fd );
+    }
+    buf->mSize = size;
+    return PooledBuffer::Ptr( buf );
+}
+
+void BufferPool::put( PooledBuffer *buf )
+{
+    if ( buf->mClass == Unpooled || mIdle + buf->mCapacity > mMaxIdle ) {
+        destroy( buf );
+        return;
+    }
+
+    mIdle += buf->mCapacity;
+    FreeList& fl = mFree[buf->mClass];
+    Lock lock( fl.mutex );
+    buf->mNext = fl.head;
+    fl.head = buf;
+}
+
+void BufferPool::destroy( PooledBuffer *buf )
+{
+    deallocate( buf->mData, buf->mCapacity, buf->mMapped );
+    if ( buf->mFD != -1 ) {
+        close( buf->mFD );
+        --mFiles;
+    }
+    delete buf;
+}
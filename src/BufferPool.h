@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ThreadPool.h"
+
+
+class BufferPool;
+
+
+// Uninitialized storage for a decompressed block. Reference counted, and
+// returned to its pool once the last reference goes away.
+class PooledBuffer
+{
+    friend class BufferPool;
+
+    BufferPool *mPool;
+    uint8_t *mData;
+    size_t mSize, mCapacity;
+    unsigned mClass;
+    bool mMapped;
+    int mFD;                    // memory file backing us, or -1
+    std::atomic<size_t> mRefs;
+    PooledBuffer *mNext;        // in a free list
+
+    PooledBuffer( BufferPool *pool,
+                  uint8_t *   data,
+                  size_t      capacity,
+                  unsigned    cls,
+                  bool        mapped,
+                  int         fd ) :
+        mPool( pool ),
+        mData( data ),
+        mSize( 0 ),
+        mCapacity( capacity ),
+        mClass( cls ),
+        mMapped( mapped ),
+        mFD( fd ),
+        mRefs( 0 ),
+        mNext( 0 ) { }
+
+    PooledBuffer( const PooledBuffer& o ) = delete;
+
+    PooledBuffer& operator=( const PooledBuffer& o ) = delete;
+
+public:
+    class Ptr
+    {
+        PooledBuffer *mBuf;
+
+    public:
+        Ptr( PooledBuffer *b = 0 ) :
+            mBuf( b ) { if ( mBuf ) { ++mBuf->mRefs; } }
+
+        Ptr( const Ptr& o ) :
+            mBuf( o.mBuf ) { if ( mBuf ) { ++mBuf->mRefs; } }
+
+        Ptr& operator=( Ptr o ) { std::swap( mBuf, o.mBuf ); return *this; }
+
+        ~Ptr();
+
+        PooledBuffer& operator*() const { return *mBuf; }
+        PooledBuffer *operator->() const { return mBuf; }
+        PooledBuffer *get() const { return mBuf; }
+        explicit operator bool() const { return mBuf != 0; }
+    };
+
+    uint8_t *data() { return mData; }
+    const uint8_t *data() const { return mData; }
+
+    size_t size() const { return mSize; }
+
+    // Memory actually used, which may be a bit more than size()
+    size_t capacity() const { return mCapacity; }
+
+    // A file holding our contents from offset zero, or -1 if there's none
+    int fd() const { return mFD; }
+
+    uint8_t& operator[]( size_t i ) { return mData[i]; }
+    const uint8_t& operator[]( size_t i ) const { return mData[i]; }
+};
+
+
+/**
+ * Hands out buffers for decompressed blocks, without zeroing them.
+ *
+ * Sizes are rounded up to one of a few classes per power of two, so blocks
+ * of similar size can reuse each other's memory. Released buffers are kept
+ * for reuse up to a limit on idle memory. Very large requests aren't pooled.
+ */
+class BufferPool
+{
+public:
+    // Back large buffers with transparent hugepages, even if they could
+    // have a memory file
+    static bool gHugePages;
+
+    // Most buffers to back with memory files, so they can be passed to the
+    // kernel by descriptor. Zero disables, as it's only worth it if the
+    // kernel will splice from them.
+    static size_t gMaxFiles;
+
+    BufferPool( size_t maxIdle = 0 );
+
+    ~BufferPool();
+
+    // Most memory to keep in released buffers
+    void maxIdle( size_t s ) { mMaxIdle = s; }
+
+    // A buffer with size bytes of undefined contents
+    PooledBuffer::Ptr get( size_t size );
+
+protected:
+    friend class PooledBuffer::Ptr;
+
+    static const unsigned MinClassBits = 16;        // 64 KiB
+    static const unsigned MaxClassBits = 26;        // 64 MiB
+    static const unsigned ClassSteps = 4;           // per power of two
+    static const unsigned Classes = ( MaxClassBits - MinClassBits ) * ClassSteps + 1;
+    static const unsigned Unpooled = Classes;
+    static const size_t HugePageSize = 2 * 1024 * 1024;
+
+    struct FreeList
+    {
+        Mutex mutex;
+        PooledBuffer *head;
+
+        FreeList() :
+            head( 0 ) { }
+    };
+
+    FreeList mFree[Classes];
+    std::atomic<size_t> mFiles;
+    std::atomic<size_t> mIdle;
+    std::atomic<size_t> mMaxIdle;
+
+    static unsigned sizeClass( size_t size );
+
+    static size_t classCapacity( unsigned cls );
+
+    static uint8_t * allocate( size_t capacity,
+                               bool&  mapped );
+
+    static void deallocate( uint8_t* data,
+                            size_t   capacity,
+                            bool     mapped );
+
+    // Map a new memory file, returning its descriptor or -1
+    static int allocateFile( size_t    capacity,
+                             uint8_t*& data );
+
+    // Called when the last reference is dropped
+    void put( PooledBuffer* buf );
+
+    void destroy( PooledBuffer* buf );
+};
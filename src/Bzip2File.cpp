@@ -1,14 +1,21 @@
 #include "Bzip2File.h"
 
 #include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
 
 #include <bzlib.h>
 
 #include "Debug.h"
+#include "MagicScanner.h"
 #include "PathUtils.h"
 
 
 const char Bzip2File::Magic[3] = { 'B', 'Z', 'h' };
+off_t Bzip2File::gChunkSize = 1024 * 1024;
 
 void Bzip2File::checkFileType( FileHandle& fh )
 {
@@ -37,18 +44,22 @@ void Bzip2File::checkFileType( FileHandle& fh )
     }
 }
 
-void Bzip2File::findBlockBoundaryCandidates( FileHandle& fh,
-                                             BoundList & bl )
+void Bzip2File::findBlockBoundaryCandidates( const FileHandle& fh,
+                                             off_t             begin,
+                                             off_t             end,
+                                             BoundList&        bl )
 const
 {
     /* Block boundaries are not byte aligned, but checking each bit is
      * too expensive. So we only look at bytes that may be the first full
-     * byte of a block magic number.
+     * byte of a magic number, followed by the right second byte. The
+     * scanner finds those quickly.
      *
-     * We look up each byte in the table to determine whether it could be
-     * the start of a magic number, and if so how many bits from the
+     * We look up each byte in the table to determine how many bits from the
      * previous byte we require. No first-byte appears twice in the shifted
      * magics, so a single table is fine. */
+    static const uint64_t magics[] = { BlockMagic, EOSMagic };
+    static const MagicScanner scanner( magics, 2, BlockMagicBytes );
     int8_t backBits[256];
     for ( size_t i = 0; i < 256; ++i ) {
         backBits[i] = -1;
@@ -63,55 +74,47 @@ const
         backBits[m] = backBits[e] = i;
     }
 
-    const off_t fsz = fh.size();
-    uint8_t buf[ChunkSize];
-    fh.seek( 0, SEEK_SET );
-    size_t bsz = fh.tryRead( buf, ChunkSize );
-    off_t rpos = bsz;     // next read pos
-    const size_t us = sizeof( uint64_t );
-
-    const size_t ftsz = BlockMagicBytes + sizeof( uint32_t );
-    const size_t lcreset = sizeof( Magic );
-    size_t lcount = lcreset + 1;     // how many more bytes til we can find a level?
-    char level = 0;
-
-    while ( true ) {
-        const uint8_t *blast = buf + bsz - us;
-        for ( uint8_t *i = buf; i < blast; ++i ) {
-            if ( lcount && !--lcount ) {
-                level = *i;
-            }
-
-            const int8_t b = backBits[*i];
-            if ( b == -1 ) {
-                continue;
-            }
+    // After an end of stream magic come its CRC, and the next stream's magic
+    // and level
+    const off_t nextLevel = BlockMagicBytes + sizeof( uint32_t ) + sizeof( Magic );
 
+    // Each position needs the byte before it, and a whole word from it
+    const size_t us = sizeof( uint64_t );
+    const off_t readSize = 1024 * 1024;
+    const off_t fsz = fh.size();
+    end = std::min( end, fsz - off_t( us ) );
+    Buffer buf;
+    while ( begin < end ) {
+        const size_t n = std::min( readSize, end - begin );
+        const size_t back = begin ? 1 : 0;
+        fh.pread( begin - back, buf, back + n + us - 1 );
+
+        const uint8_t *bp = &buf[back];
+        for ( size_t k = scanner.find( bp, 0, n ); k < n;
+              k = scanner.find( bp, k + 1, n ) )
+        {
             // Candidate byte, check if this is a magic
-            uint64_t v = *reinterpret_cast<uint64_t*>( i );
+            const uint8_t *i = bp + k;
+            const int8_t b = backBits[*i];
+            uint64_t v = *reinterpret_cast<const uint64_t*>( i );
             FileHandle::convertBE( v );
-            v >>= 8 * ( sizeof( uint64_t ) - BlockMagicBytes ) + b;
-            const uint64_t u = *( i - 1 );
+            v >>= 8 * ( us - BlockMagicBytes ) + b;
+            const uint64_t u = ( back || k ) ? *( i - 1 ) : 0;
             v |= ( u << ( ( 8 * BlockMagicBytes ) - b ) ) & BlockMagicMask;
 
-            const off_t pos = rpos - ( buf + bsz - i );
+            const off_t pos = begin + k;
             if ( ( v == BlockMagic ) ||( v == EOSMagic ) ) {
+                char level = 0;
+                if ( v == EOSMagic && pos + nextLevel < fsz ) {
+                    fh.pread( pos + nextLevel, &level, sizeof( level ) );
+                }
                 DOUT << ( v == BlockMagic ? "block" : "eos  " ) << " "
-                     << (int)level << " " << pos << " " << b << "\n";
+                     << (int)level << " " << pos << " " << int( b ) << "\n";
 
                 bl.push_back( BlockBoundary( v, level, pos, b ) );
-                if ( v == EOSMagic ) {
-                    lcount = ftsz + lcreset;
-                }
             }
         }
-        if ( fsz == rpos ) {
-            return;
-        }
-        std::copy( buf + bsz - us - 1, buf + bsz, buf );
-        const size_t r = fh.tryRead( buf + us + 1, ChunkSize - us - 1 );
-        bsz = r + us + 1;
-        rpos += r;
+        begin += n;
     }
 }
 
@@ -173,100 +176,502 @@ const
     *ip++ = *ep << ebits;
 }
 
-void Bzip2File::decompress( const Buffer& in,
-                            Buffer&       out ) const
+namespace {
+
+char firstLevel( const FileHandle& fh )
+{
+    char level;
+    fh.pread( sizeof( Bzip2File::Magic ), &level, sizeof( level ) );
+    return level;
+}
+
+// bzip2 can't reset a decompressor, but most of its setup is allocating its
+// state and block buffer. So each thread keeps the last few allocations
+// freed, for the next decompressor to take.
+struct AllocCache
 {
-    bz_stream s;
-    s.bzalloc = NULL;
-    s.bzfree = NULL;
-    s.opaque = NULL;
-    int err = BZ2_bzDecompressInit( &s, 0, 0 );
-    if ( err != BZ_OK ) {
-        throw std::runtime_error( "bzip2 init" );
+    static const size_t MaxIdle = 4;
+    static const size_t Header = 16;        // holds the size, keeps alignment
+
+    std::vector<char*> idle;
+
+    ~AllocCache()
+    {
+        for ( size_t i = 0; i < idle.size(); ++i ) {
+            free( idle[i] );
+        }
+    }
+};
+thread_local AllocCache gAllocCache;
+
+void* cachedAlloc( void*,
+                   int   items,
+                   int   size )
+{
+    const size_t n = size_t( items ) * size;
+    std::vector<char*>& idle = gAllocCache.idle;
+    for ( size_t i = 0; i < idle.size(); ++i ) {
+        if ( *reinterpret_cast<size_t*>( idle[i] ) == n ) {
+            char *mem = idle[i];
+            idle.erase( idle.begin() + i );
+            return mem + AllocCache::Header;
+        }
     }
 
-    s.next_in = const_cast<char*>( reinterpret_cast<const char*>( &in[0] ) );
-    s.avail_in = in.size();
-    if ( !out.empty() ) {
-        s.next_out = reinterpret_cast<char*>( &out[0] );
+    char *mem = static_cast<char*>( malloc( n + AllocCache::Header ) );
+    if ( !mem ) {
+        return 0;
     }
-    s.avail_out = out.size();
+    *reinterpret_cast<size_t*>( mem ) = n;
+    return mem + AllocCache::Header;
+}
 
-    while ( true ) {
-        if ( s.avail_out == 0 ) {
-            out.resize( out.size() + ChunkSize );
-            s.next_out = reinterpret_cast<char*>(
-                &out[out.size() - ChunkSize] );
-            s.avail_out = ChunkSize;
+void cachedFree( void*,
+                 void* p )
+{
+    if ( !p ) {
+        return;
+    }
+    std::vector<char*>& idle = gAllocCache.idle;
+    if ( idle.size() == AllocCache::MaxIdle ) {
+        free( idle.front() );
+        idle.erase( idle.begin() );
+    }
+    idle.push_back( static_cast<char*>( p ) - AllocCache::Header );
+}
+
+// A decompressor that's cleaned up even if we throw
+struct Bzip2Stream : public bz_stream
+{
+    Bzip2Stream( const Buffer& in )
+    {
+        bzalloc = cachedAlloc;
+        bzfree = cachedFree;
+        opaque = NULL;
+        if ( BZ2_bzDecompressInit( this, 0, 0 ) != BZ_OK ) {
+            throw std::runtime_error( "bzip2 init" );
         }
-        err = BZ2_bzDecompress( &s );
+        next_in = const_cast<char*>( reinterpret_cast<const char*>( &in[0] ) );
+        avail_in = in.size();
+    }
+
+    ~Bzip2Stream() { BZ2_bzDecompressEnd( this ); }
+
+    // Returns true at the end of the stream
+    bool step()
+    {
+        unsigned int before = avail_out;
+        int err = BZ2_bzDecompress( this );
         if ( err == BZ_STREAM_END ) {
-            break;
+            return true;
         }
         if ( err != BZ_OK ) {
             throw std::runtime_error( "bzip2 decompress" );
         }
-        if ( ( s.avail_in == 0 ) &&( s.avail_out == out.size() ) ) {
+        if ( ( avail_in == 0 ) && ( avail_out == before ) ) {
             throw std::runtime_error( "bzip2 no progress" );
         }
+        return false;
+    }
+};
+
+class Bzip2Decoder : public CompressedFile::Decoder
+{
+    Buffer mIn;
+    std::unique_ptr<Bzip2Stream> mStream;
+    size_t mRemain;
+
+public:
+    // Takes the contents of in
+    Bzip2Decoder( Buffer& in,
+                  size_t  usize ) :
+        mRemain( usize )
+    {
+        mIn.swap( in );
+        mStream.reset( new Bzip2Stream( mIn ) );
     }
 
-    err = BZ2_bzDecompressEnd( &s );
-    if ( err != BZ_OK ) {
-        throw std::runtime_error( "bzip2 end" );
+    void read( uint8_t* buf,
+               size_t   size ) override
+    {
+        mStream->next_out = reinterpret_cast<char*>( buf );
+        mStream->avail_out = size;
+        while ( mStream->avail_out && !mStream->step() ) { }
+        if ( mStream->avail_out || size > mRemain ) {
+            throw std::runtime_error( "bzip2 block decompresses to wrong size" );
+        }
+        mRemain -= size;
     }
-    out.resize( out.size() - s.avail_out );
+};
+
 }
 
-void Bzip2File::buildIndex( FileHandle& fh )
+size_t Bzip2File::decompressedSize( const Buffer& in ) const
 {
-    BoundList bl;
-    findBlockBoundaryCandidates( fh, bl );
-
-    // Build blocklist from boundaries
-    off_t uoff = 0;
-    Buffer in, out;
-    BoundList::iterator i = bl.begin(), j = bl.begin();
-    char level = i->level;
-    for ( ++j; j != bl.end(); ) {
-        if ( i->magic != EOSMagic ) {
-            if ( level == 0 ) {
-                level = i->level;
+    Bzip2Stream s( in );
+    char sink[16 * 1024];
+    do {
+        s.next_out = sink;
+        s.avail_out = sizeof( sink );
+    } while ( !s.step() );
+    return ( uint64_t( s.total_out_hi32 ) << 32 ) | s.total_out_lo32;
+}
+
+void Bzip2File::decompress( const Buffer& in,
+                            uint8_t*      out,
+                            size_t        size ) const
+{
+    Bzip2Stream s( in );
+    s.next_out = reinterpret_cast<char*>( out );
+    s.avail_out = size;
+
+    // Anything that doesn't fit in out means the block is the wrong size
+    char extra;
+    do {
+        if ( s.avail_out == 0 ) {
+            if ( s.total_out_lo32 > size || s.total_out_hi32 ) {
+                break;
             }
-            createAlignedBlock( fh, in, level, i->coff, i->bits, j->coff,
-                                j->bits );
-            try {
-                decompress( in, out );
-            } catch ( std::runtime_error& e ) {           // Boundary spurious, remove it
-                DOUT << "failed! " << i->coff << " -- " << j->coff << "\n";
-                // FileHandle::writeBuf(in, "block.bz2"); exit(-1);
-                bl.erase( j++ );
-                continue;
+            s.next_out = &extra;
+            s.avail_out = sizeof( extra );
+        }
+    } while ( !s.step() );
+
+    if ( s.total_out_lo32 != size || s.total_out_hi32 ) {
+        throw std::runtime_error( "bzip2 block decompresses to wrong size" );
+    }
+}
+
+/**
+ * Finds and checks boundary candidates with a thread pool, feeding them to a
+ * BlockJoiner in order.
+ *
+ * Each chunk of the file is searched for candidates by its own job. Once the
+ * chunks before it are done we know which stream a candidate is in, so it's
+ * checked against the one before it by another job. The joiner only has to
+ * check candidates itself when one is dropped, or we got the level wrong.
+ */
+class Bzip2File::Indexer
+{
+    // Our jobs belong to us, and tell us when they're done
+    struct Job : public ThreadPool::Job
+    {
+        Indexer *indexer;
+        bool done;
+        std::string error;
+
+        Job( Indexer& idx ) :
+            indexer( &idx ),
+            done( false ) { }
+
+        void operator()() override;
+
+        void release() override;
+
+        virtual void run() = 0;
+    };
+
+    struct ScanJob : public Job
+    {
+        off_t begin, end;
+        BoundList found;
+
+        ScanJob( Indexer& idx,
+                 off_t    b,
+                 off_t    e ) :
+            Job( idx ),
+            begin( b ),
+            end( e ) { }
+
+        void run() override
+        {
+            indexer->mFile.findBlockBoundaryCandidates( indexer->mFH, begin,
+                                                        end, found );
+        }
+    };
+
+    struct CheckJob : public Job
+    {
+        BlockCheck check;
+
+        CheckJob( Indexer&          idx,
+                  const BlockCheck& c ) :
+            Job( idx ),
+            check( c ) { }
+
+        void run() override { indexer->mFile.checkBlock( indexer->mFH, check ); }
+    };
+
+    // A candidate waiting to be joined, and its check if it has one
+    struct Pending
+    {
+        BlockBoundary bound;
+        std::unique_ptr<CheckJob> check;
+
+        Pending( const BlockBoundary& b ) :
+            bound( b ) { }
+    };
+
+    Bzip2File& mFile;
+    const FileHandle& mFH;
+    ThreadPool& mPool;
+    off_t mSize;
+
+    std::deque<std::unique_ptr<ScanJob> > mScans;
+    std::deque<Pending> mPending;
+
+    ConditionVariable mCond;    // guards everything below
+    size_t mRunning;            // jobs queued or running
+    bool mCancelled;
+
+    void enqueue( Job* job );
+
+    void wait( Job& job );
+
+    // Give the oldest pending candidate to the joiner
+    void join( BlockJoiner& joiner );
+
+public:
+    Indexer( Bzip2File&        file,
+             const FileHandle& fh,
+             ThreadPool&       pool ) :
+        mFile( file ),
+        mFH( fh ),
+        mPool( pool ),
+        mSize( fh.size() ),
+        mRunning( 0 ),
+        mCancelled( false ) { }
+
+    ~Indexer();
+
+    void run();
+};
+
+void Bzip2File::Indexer::Job::operator()()
+{
+    {
+        Lock lock( indexer->mCond );
+        if ( indexer->mCancelled ) {
+            return;
+        }
+    }
+
+    try {
+        run();
+    } catch ( std::exception& e ) {
+        error = e.what();
+    }
+}
+
+void Bzip2File::Indexer::Job::release()
+{
+    Lock lock( indexer->mCond );
+    done = true;
+    --indexer->mRunning;
+    indexer->mCond.broadcast();
+}
+
+Bzip2File::Indexer::~Indexer()
+{
+    // Our jobs refer to us, so wait for them to finish
+    Lock lock( mCond );
+    mCancelled = true;
+    while ( mRunning ) {
+        mCond.wait();
+    }
+}
+
+void Bzip2File::Indexer::enqueue( Job* job )
+{
+    {
+        Lock lock( mCond );
+        ++mRunning;
+    }
+    mPool.enqueue( job );
+}
+
+void Bzip2File::Indexer::wait( Job& job )
+{
+    {
+        Lock lock( mCond );
+        while ( !job.done ) {
+            mCond.wait();
+        }
+    }
+    if ( !job.error.empty() ) {
+        throw std::runtime_error( job.error );
+    }
+}
+
+void Bzip2File::Indexer::join( BlockJoiner& joiner )
+{
+    Pending& p = mPending.front();
+    if ( p.check ) {
+        wait( *p.check );
+        joiner.add( p.bound, &p.check->check );
+    } else {
+        joiner.add( p.bound );
+    }
+    mPending.pop_front();
+}
+
+void Bzip2File::Indexer::run()
+{
+    const size_t ahead = 2 * mPool.threads();
+    off_t queued = 0;           // where the next scan starts
+    char level = firstLevel( mFH );
+    BlockJoiner joiner( mFile, mFH, level );
+    BlockBoundary prev;
+    bool first = true;
+
+    while ( queued < mSize || !mScans.empty() ) {
+        while ( mScans.size() < ahead && queued < mSize ) {
+            off_t end = std::min( queued + gChunkSize, mSize );
+            mScans.emplace_back( new ScanJob( *this, queued, end ) );
+            enqueue( mScans.back().get() );
+            queued = end;
+        }
+
+        std::unique_ptr<ScanJob> job( std::move( mScans.front() ) );
+        mScans.pop_front();
+        wait( *job );
+
+        // Check each candidate against the one before, unless that ends a
+        // stream
+        for ( BoundList::const_iterator b = job->found.begin();
+              b != job->found.end(); ++b )
+        {
+            mPending.push_back( Pending( *b ) );
+            if ( !first && prev.magic != EOSMagic ) {
+                CheckJob *check = new CheckJob( *this, BlockCheck( prev, *b, level ) );
+                mPending.back().check.reset( check );
+                enqueue( check );
             }
-            DOUT << "ok! " << i->coff << " -- " << j->coff << "\n";
-            addBlock( new Bzip2Block( *i, *j, uoff, out.size(), level ) );
-            uoff += out.size();
-            if ( j->magic == EOSMagic ) {
-                level = 0;
+            if ( b->magic == EOSMagic ) {
+                level = b->level;
             }
+            prev = *b;
+            first = false;
+        }
+
+        while ( mPending.size() > ahead ) {
+            join( joiner );
         }
-        ++i;
-        ++j;
+    }
+
+    while ( !mPending.empty() ) {
+        join( joiner );
     }
 }
 
+void Bzip2File::buildIndex( FileHandle& fh )
+{
+    // Checking candidates is what takes the time, so use some threads
+    // unless there's only a block or two
+    if ( fh.size() > gChunkSize && gIndexPool && gIndexPool->threads() > 1 ) {
+        buildIndex( fh, *gIndexPool );
+        return;
+    }
+
+    BoundList bl;
+    findBlockBoundaryCandidates( fh, 0, fh.size(), bl );
+
+    BlockJoiner joiner( *this, fh, firstLevel( fh ) );
+    for ( BoundList::const_iterator i = bl.begin(); i != bl.end(); ++i ) {
+        joiner.add( *i );
+    }
+}
+
+void Bzip2File::buildIndex( FileHandle& fh,
+                            ThreadPool& pool )
+{
+    Indexer( *this, fh, pool ).run();
+}
+
+void Bzip2File::checkBlock( const FileHandle& fh,
+                            BlockCheck&       check ) const
+{
+    Buffer in;
+    createAlignedBlock( fh, in, check.level, check.start.coff,
+                        check.start.bits, check.end.coff, check.end.bits );
+    try {
+        check.usize = decompressedSize( in );
+    } catch ( std::runtime_error& e ) {
+        DOUT << "failed! " << check.start.coff << " -- " << check.end.coff << "\n";
+        check.ok = false;
+        return;
+    }
+    DOUT << "ok! " << check.start.coff << " -- " << check.end.coff << "\n";
+    check.ok = true;
+}
+
+void Bzip2File::BlockJoiner::add( const BlockBoundary& b,
+                                  const BlockCheck*    check )
+{
+    if ( !mStarted ) {
+        mStarted = true;
+        mStart = b;
+        return;
+    }
+    if ( mStart.magic == EOSMagic ) {
+        mLevel = mStart.level;
+        mStart = b;
+        return;
+    }
+
+    // A check done ahead of time is no good if we've since dropped its start
+    if ( !check || !( check->start == mStart ) || check->level != mLevel ) {
+        mCheck = BlockCheck( mStart, b, mLevel );
+        mFile.checkBlock( mFH, mCheck );
+        check = &mCheck;
+    }
+    if ( !check->ok ) {         // Boundary spurious, skip it
+        return;
+    }
+    mFile.addBlock( mStart, b, check->usize, mLevel );
+    mStart = b;
+}
+
+void Bzip2File::addBlock( const BlockBoundary& start,
+                          const BlockBoundary& end,
+                          size_t               usize,
+                          char                 level )
+{
+    IndexedCompFile::addBlock( usize, start.coff, end.coff - start.coff );
+    mBits.push_back( ( end.bits << 4 ) + start.bits );
+    mLevels.push_back( level );
+    progress();
+}
+
+void Bzip2File::createAlignedBlock( const FileHandle& fh,
+                                    Buffer&           buf,
+                                    const Block&      b ) const
+{
+    uint8_t bits = mBits[b.index];
+    createAlignedBlock( fh, buf, mLevels[b.index], b.coff, bits & 0xF,
+                        b.coff + b.csize, bits >> 4 );
+}
+
 void Bzip2File::decompressBlock( const FileHandle& fh,
                                  const Block&      b,
-                                 Buffer&           ubuf ) const
+                                 uint8_t*          ubuf ) const
+{
+    static thread_local Buffer in;
+    createAlignedBlock( fh, in, b );
+    decompress( in, ubuf, b.usize );
+}
+
+CompressedFile::Decoder * Bzip2File::decoder( const FileHandle& fh,
+                                              const Block&      b ) const
 {
     Buffer in;
-    const Bzip2Block& bb = dynamic_cast<const Bzip2Block&>( b );
-    createAlignedBlock( fh, in, bb.level, bb.coff, bb.bits,
-                        bb.coff + bb.csize, bb.endbits );
-    decompress( in, ubuf );
-    if ( ubuf.size() != bb.usize ) {
-        throw std::runtime_error( "bzip2 block decompresses to wrong size" );
-    }
+    createAlignedBlock( fh, in, b );
+    return new Bzip2Decoder( in, b.usize );
+}
+
+size_t Bzip2File::indexSize() const
+{
+    return IndexedCompFile::indexSize() + mBits.capacity() + mLevels.capacity();
 }
 
 std::string Bzip2File::destName() const
@@ -282,30 +687,23 @@ std::string Bzip2File::destName() const
     return base;
 }
 
-bool Bzip2File::readBlock( FileHandle& fh,
-                           Block *     b )
+void Bzip2File::clearIndex()
 {
-    if ( !IndexedCompFile::readBlock( fh, b ) ) {
-        return false;
-    }
-
-    Bzip2Block *bb = dynamic_cast<Bzip2Block*>( b );
-    uint8_t bits;
-    fh.readBE( bits );
-    bb->bits = bits & 0xF;
-    bb->endbits = bits >> 4;
-    fh.readBE( bb->level );
-
-    return true;
+    IndexedCompFile::clearIndex();
+    mBits.clear();
+    mLevels.clear();
 }
 
-void Bzip2File::writeBlock( FileHandle&  fh,
-                            const Block* b ) const
+void Bzip2File::readBlockInfo( IndexReader& in,
+                               unsigned )
 {
-    IndexedCompFile::writeBlock( fh, b );
+    mBits.push_back( in.byte() );
+    mLevels.push_back( in.byte() );
+}
 
-    const Bzip2Block* bb = dynamic_cast<const Bzip2Block*>( b );
-    uint8_t bits = ( bb->endbits << 4 ) + bb->bits;
-    fh.writeBE( bits );
-    fh.writeBE( bb->level );
+void Bzip2File::writeBlockInfo( IndexWriter& out,
+                                const Block& b ) const
+{
+    out.byte( mBits[b.index] );
+    out.byte( mLevels[b.index] );
 }
@@ -4,8 +4,9 @@
 #include "Buffer.h"
 #include "Debug.h"
 #include "CompressedFile.h"
+#include "ThreadPool.h"
 
-#include <list>
+#include <vector>
 
 class Bzip2File : public IndexedCompFile
 {
@@ -14,44 +15,100 @@ protected:
 
     void buildIndex( FileHandle& fh ) override;
 
+    // Build the index with the help of some threads
+    void buildIndex( FileHandle& fh,
+                     ThreadPool& pool );
+
     struct BlockBoundary
     {
         uint64_t magic;
-        char level;
+        char level;             // for an end of stream, the next stream's
         off_t coff;
         size_t bits;
 
-        BlockBoundary( uint64_t m,
-                       char     l,
-                       off_t    c,
-                       size_t   b ) :
+        BlockBoundary( uint64_t m = 0,
+                       char     l = 0,
+                       off_t    c = 0,
+                       size_t   b = 0 ) :
             magic( m ),
             level( l ),
             coff( c ),
             bits( b ) { }
+
+        bool operator==( const BlockBoundary& o ) const
+        {
+            return coff == o.coff && bits == o.bits;
+        }
     };
-    typedef std::list<BlockBoundary> BoundList;
+    typedef std::vector<BlockBoundary> BoundList;
 
-    struct Bzip2Block : public Block
+    // Whether the data between two boundaries decompresses, and to what size
+    struct BlockCheck
     {
-        size_t bits, endbits;
+        BlockBoundary start, end;
         char level;
+        bool ok;
+        size_t usize;
+
+        BlockCheck( const BlockBoundary& s = BlockBoundary(),
+                    const BlockBoundary& e = BlockBoundary(),
+                    char                 l = 0 ) :
+            start( s ),
+            end( e ),
+            level( l ),
+            ok( false ),
+            usize( 0 ) { }
+    };
 
-        Bzip2Block() { }
-
-        Bzip2Block( BlockBoundary& rStart,
-                    BlockBoundary& rEnd,
-                    off_t          rUoff,
-                    size_t         rUsize,
-                    char           rLev ) :
-            Block( rUsize, rEnd.coff - rStart.coff, rUoff, rStart.coff ),
-            bits( rStart.bits ),
-            endbits( rEnd.bits ),
-            level( rLev ) { }
+    // Turns boundary candidates, fed in order, into blocks. A spurious
+    // candidate is dropped, and the block before it carries on past.
+    class BlockJoiner
+    {
+        Bzip2File& mFile;
+        const FileHandle& mFH;
+        char mLevel;
+        bool mStarted;
+        BlockBoundary mStart;
+        BlockCheck mCheck;
+
+    public:
+        BlockJoiner( Bzip2File&        file,
+                     const FileHandle& fh,
+                     char              level ) :
+            mFile( file ),
+            mFH( fh ),
+            mLevel( level ),
+            mStarted( false ) { }
+
+        // Check is of the candidate before b against b, if we have one
+        void add( const BlockBoundary& b,
+                  const BlockCheck*    check = 0 );
     };
 
-    void findBlockBoundaryCandidates( FileHandle& fh,
-                                      BoundList&  bl ) const;
+    class Indexer;
+
+    // Bit offsets of each block's start and end, end in the high nibble
+    std::vector<uint8_t> mBits;
+    std::vector<char> mLevels;
+
+    void addBlock( const BlockBoundary& start,
+                   const BlockBoundary& end,
+                   size_t               usize,
+                   char                 level );
+
+    // Read b's bits into buf, aligned and with a stream header
+    void createAlignedBlock( const FileHandle& fh,
+                             Buffer&           buf,
+                             const Block&      b ) const;
+
+    // Find candidates whose first full byte is in [begin, end)
+    void findBlockBoundaryCandidates( const FileHandle& fh,
+                                      off_t             begin,
+                                      off_t             end,
+                                      BoundList&        bl ) const;
+
+    void checkBlock( const FileHandle& fh,
+                     BlockCheck&       check ) const;
 
     void createAlignedBlock( const FileHandle& fh,
                              Buffer&           b,
@@ -61,16 +118,21 @@ protected:
                              off_t             end,
                              size_t            endbits ) const;
 
+    // Decompress, only to find the size
+    size_t decompressedSize( const Buffer& in ) const;
+
+    // Decompress a block we know the size of
     void decompress( const Buffer& in,
-                     Buffer& out ) const;
+                     uint8_t*      out,
+                     size_t        size ) const;
 
-    Block* newBlock() const override { return new Bzip2Block(); }
+    void clearIndex() override;
 
-    bool readBlock( FileHandle& fh,
-                    Block*      b ) override;
+    void readBlockInfo( IndexReader& in,
+                        unsigned     version ) override;
 
-    void writeBlock( FileHandle&  fh,
-                     const Block *b ) const override;
+    void writeBlockInfo( IndexWriter& out,
+                         const Block& b ) const override;
 
 public:
     static const char Magic[];
@@ -79,6 +141,8 @@ public:
     static const uint64_t BlockMagicMask = ( 1LL << ( BlockMagicBytes * 8 ) ) - 1;
     static const uint64_t EOSMagic = 0x177245385090;
 
+    static off_t gChunkSize;    // compressed bytes searched by each job
+
     static CompressedFile* open( const std::string& path,
                                  uint64_t           maxBlock )
     { return new Bzip2File( path, maxBlock ); }
@@ -89,8 +153,17 @@ public:
 
     std::string destName() const override;
 
+    const char * format() const override { return "bzip2"; }
+
+    IndexedCompFile * snapshot() const override { return copy( *this ); }
+
+    size_t indexSize() const override;
+
     void decompressBlock( const FileHandle& fh,
                           const Block&      b,
-                          Buffer&           ubuf ) const override;
+                          uint8_t*          ubuf ) const override;
+
+    Decoder * decoder( const FileHandle& fh,
+                       const Block&      b ) const override;
 
 };
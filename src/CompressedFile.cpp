@@ -1,12 +1,23 @@
 #include "CompressedFile.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <stdexcept>
 
 #include "PathUtils.h"
 
 #include <inttypes.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
 const size_t CompressedFile::ChunkSize = 4096;
+std::atomic<uint32_t> CompressedFile::gNextID( 0 );
+size_t IndexedCompFile::gIndexThreads = 0;
+ThreadPool *IndexedCompFile::gIndexPool = 0;
+bool IndexedCompFile::gDeferIndex = false;
 
 void CompressedFile::throwFormat( const std::string& s ) const
 {
@@ -18,6 +29,39 @@ std::string CompressedFile::destName() const
     return PathUtils::basename( path() );
 }
 
+namespace {
+
+class WholeDecoder : public CompressedFile::Decoder
+{
+    Buffer mBuf;
+    size_t mPos;
+
+public:
+    WholeDecoder( const CompressedFile& file,
+                  const FileHandle&     fh,
+                  const Block&          b ) :
+        mBuf( b.usize ),
+        mPos( 0 ) { file.decompressBlock( fh, b, &mBuf[0] ); }
+
+    void read( uint8_t* buf,
+               size_t   size ) override
+    {
+        if ( size > mBuf.size() - mPos ) {
+            throw std::runtime_error( "read past end of block" );
+        }
+        memcpy( buf, &mBuf[mPos], size );
+        mPos += size;
+    }
+};
+
+}
+
+CompressedFile::Decoder * CompressedFile::decoder( const FileHandle& fh,
+                                                   const Block&      b ) const
+{
+    return new WholeDecoder( *this, fh, b );
+}
+
 void CompressedFile::checkSizes( uint64_t maxBlock ) const
 {
     BlockIterator iter;
@@ -28,8 +72,8 @@ void CompressedFile::checkSizes( uint64_t maxBlock ) const
     }
     for ( ; !iter.end(); ++iter ) {
         if ( iter->usize > maxBlock ) {
-            fprintf( stderr, "WARNING: %s has blocks too large to cache, "
-                     "operations on it will be slow!\n", path().c_str() );
+            fprintf( stderr, "WARNING: %s has blocks too large to cache whole, "
+                     "random access to them will be slow\n", path().c_str() );
             break;
         }
     }
@@ -49,6 +93,7 @@ void IndexedCompFile::initialize( uint64_t maxBlock )
 {
     FileHandle fh( path(), O_RDONLY );
     checkFileType( fh );
+    mSource = IndexDir::Fingerprint( fh );
 
     // Try reading the index
     bool index = false;
@@ -61,119 +106,294 @@ void IndexedCompFile::initialize( uint64_t maxBlock )
         }
         if ( idxr.open() && readIndex( idxr ) ) {
             index = true;
+            if ( !IndexDir::gDir.empty() ) {
+                IndexDir::used( idxr.path() );
+            }
         }
     }
 
+    if ( !index && gDeferIndex ) {
+        mPending = true;
+        mMaxBlock = maxBlock;
+        return;
+    }
     if ( !index ) {
         buildIndex( fh );
-        FileHandle idxw( indexPath(), O_WRONLY | O_CREAT | O_TRUNC, 0664 );
-        writeIndex( idxw );
+        saveIndex();
     }
+    mIndex.finish();
 
     checkSizes( maxBlock );
 }
 
+void IndexedCompFile::buildPendingIndex( Progress* progress )
+{
+    FileHandle fh( path(), O_RDONLY );
+    checkFileType( fh );                // some formats index from after the header
+    mSource = IndexDir::Fingerprint( fh );
+    mProgress = progress;
+    try {
+        buildIndex( fh );
+    } catch ( ... ) {
+        mProgress = 0;
+        throw;
+    }
+    mProgress = 0;
+
+    saveIndex();
+    mIndex.finish();
+    mPending = false;
+
+    checkSizes( mMaxBlock );
+}
+
 std::string IndexedCompFile::indexPath() const
 {
-    return path() + ".blockIdx";
+    return IndexDir::gDir.empty() ? path() + ".blockIdx" : IndexDir::path( mSource );
 }
 
 namespace {
-struct BlockOffsetOrdering
+
+/**
+ * Index files start with a header, followed by a table of blocks and then
+ * whatever else the format needs, like gzip windows. The header records a
+ * fingerprint of the source it was made from, and a checksum of itself and
+ * the blocks.
+ * Formats check anything else themselves, so it can be read piecemeal.
+ *
+ * The original format was just the blocks, with fixed-size big-endian
+ * fields.
+ */
+const uint8_t IndexMagic[8] = { 'L', 'Z', 'O', 'P', 'F', 'S', 'I', 'X' };
+const unsigned IndexVersion = 3;
+
+struct IndexHeader
 {
-    bool operator()( const Block* b,
-                     off_t        off )
+    unsigned version = IndexVersion;
+    IndexDir::Fingerprint source;
+    uint64_t blocks = 0, blockBytes = 0, extraBytes = 0;
+    uint32_t sum = 0;
+
+    static const size_t Size = sizeof( IndexMagic ) + 4 + 6 * 8 + 4;
+
+    // Everything but the checksum
+    void write( IndexWriter& out ) const
     {
-        return ( b->uoff + b->usize - 1 ) < (uint64_t)off;
+        out.bytes( IndexMagic, sizeof( IndexMagic ) );
+        out.fixed( version, 4 );
+        out.fixed( source.size, 8 );
+        out.fixed( source.mtime, 8 );
+        out.fixed( source.sample, 8 );
+        out.fixed( blocks, 8 );
+        out.fixed( blockBytes, 8 );
+        out.fixed( extraBytes, 8 );
     }
 
-    bool operator()( off_t        off,
-                     const Block* b )
+    // False if there's no header, so it's the original format. A version
+    // of zero means the header is cut short.
+    bool read( const FileHandle& fh,
+               off_t             fsize )
     {
-        return (uint64_t)off < b->uoff;
+        Buffer buf;
+        if ( fsize < off_t( sizeof( IndexMagic ) ) ) {
+            return false;
+        }
+        fh.pread( 0, buf, std::min( fsize, off_t( Size ) ) );
+        if ( !std::equal( IndexMagic, IndexMagic + sizeof( IndexMagic ), buf.begin() ) ) {
+            return false;
+        }
+        if ( buf.size() < Size ) {
+            version = 0;
+            return true;
+        }
+
+        IndexReader in( buf.data() + sizeof( IndexMagic ), Size - sizeof( IndexMagic ) );
+        version = in.fixed( 4 );
+        source.size = in.fixed( 8 );
+        source.mtime = in.fixed( 8 );
+        source.sample = in.fixed( 8 );
+        blocks = in.fixed( 8 );
+        blockBytes = in.fixed( 8 );
+        extraBytes = in.fixed( 8 );
+        sum = in.fixed( 4 );
+        return true;
     }
 
+    uint32_t checksum( const Buffer& table ) const;
 };
-}
 
-CompressedFile::BlockIterator IndexedCompFile::findBlock( off_t off ) const
+uint32_t checksum( uint32_t       crc,
+                   const uint8_t* buf,
+                   size_t         size )
 {
-    BlockList::const_iterator iter = std::lower_bound(
-        mBlocks.begin(), mBlocks.end(), off, BlockOffsetOrdering() );
-    if ( iter == mBlocks.end() ) {
-        throw std::runtime_error( "can't find block" );
+    // zlib takes a 32-bit length
+    while ( size ) {
+        uInt n = std::min( size, size_t( 1 ) << 30 );
+        crc = crc32( crc, buf, n );
+        buf += n;
+        size -= n;
     }
-    return BlockIterator( new Iterator( iter, mBlocks.end() ) );
+    return crc;
 }
 
-IndexedCompFile::~IndexedCompFile()
+uint32_t IndexHeader::checksum( const Buffer& table ) const
 {
-    BlockList::iterator iter;
-    for ( iter = mBlocks.begin(); iter != mBlocks.end(); ++iter ) {
-        delete *iter;
-    }
+    Buffer head;
+    IndexWriter out( head );
+    write( out );
+    return ::checksum( ::checksum( 0, head.data(), head.size() ),
+                       table.data(), table.size() );
 }
 
-off_t IndexedCompFile::uncompressedSize() const
-{
-    if ( mBlocks.empty() ) {
-        return 0;
-    }
-    const Block& b = *mBlocks.back();
-    return b.uoff + b.usize;
 }
 
 bool IndexedCompFile::readIndex( FileHandle& fh )
 {
-    uint64_t uoff = 0;
-    while ( true ) {
-        Block* b = 0;
-        try {
-            b = newBlock();
-            if ( !readBlock( fh, b ) ) {
-                delete b;
-// dumpBlocks();
-                return true;
-            }
-            b->uoff = uoff;
-            addBlock( b );
-            uoff += b->usize;
-        } catch ( ... ) {
-            delete b;
-            throw;
+    const off_t size = fh.size();
+    if ( size == 0 ) {
+        return false;           // we never finished writing it
+    }
+
+    IndexHeader hdr;
+    if ( !hdr.read( fh, size ) ) {
+        return readIndexV1( fh, size );
+    }
+
+    const char *problem = 0;
+    if ( hdr.version == 0 ) {
+        problem = "is damaged";
+    } else if ( hdr.version < IndexVersion ) {
+        problem = "is out of date";
+    } else if ( hdr.version > IndexVersion ) {
+        problem = "has an unknown version";
+    } else if ( !( hdr.source == mSource ) ) {
+        problem = "is out of date";
+    } else if ( uint64_t( size ) != IndexHeader::Size + hdr.blockBytes + hdr.extraBytes ) {
+        problem = "is damaged";
+    }
+    Buffer buf;
+    if ( !problem ) {
+        fh.pread( IndexHeader::Size, buf, hdr.blockBytes );
+        if ( hdr.checksum( buf ) != hdr.sum ) {
+            problem = "is damaged";
         }
     }
+    if ( problem ) {
+        fprintf( stderr, "Index for %s %s, rebuilding\n", path().c_str(), problem );
+        return false;
+    }
+
+    try {
+        IndexReader in( buf.data(), buf.size() );
+        uint64_t next = 0;      // where the last block ended
+        for ( uint64_t i = 0; i < hdr.blocks; ++i ) {
+            const uint32_t usize = in.varint(), csize = in.varint();
+            const uint64_t coff = next + in.svarint();
+            addBlock( usize, coff, csize );
+            readBlockInfo( in, IndexVersion );
+            next = coff + csize;
+        }
+
+        readExtra( fh, IndexHeader::Size + hdr.blockBytes, hdr.extraBytes );
+    } catch ( IndexReader::Exception& e ) {
+        fprintf( stderr, "Index for %s is damaged, rebuilding: %s\n", path().c_str(), e.what() );
+        clearIndex();
+        return false;
+    }
+    return true;
 }
 
-bool IndexedCompFile::readBlock( FileHandle& fh,
-                                 Block *     b )
+bool IndexedCompFile::readIndexV1( FileHandle& fh,
+                                   off_t       size )
 {
-    fh.readBE( b->usize );
-    if ( b->usize == 0 ) {
+    // There's nothing to tell if it's stale, but it must at least fit
+    try {
+        Buffer buf;
+        fh.pread( 0, buf, size );
+        IndexReader in( buf.data(), buf.size() );
+        while ( true ) {
+            const uint32_t usize = in.fixedBE( 4 );
+            if ( usize == 0 ) {
+                break;
+            }
+            const uint32_t csize = in.fixedBE( 4 );
+            const uint64_t coff = in.fixedBE( 8 );
+            if ( coff + csize > mSource.size ) {
+                throw IndexReader::Exception( "it's for a bigger file" );
+            }
+            addBlock( usize, coff, csize );     // uoff follows from the sizes
+            readBlockInfo( in, 1 );
+        }
+    } catch ( IndexReader::Exception& e ) {
+        fprintf( stderr, "Old index for %s is damaged or out of date, rebuilding: %s\n",
+                 path().c_str(), e.what() );
+        clearIndex();
         return false;
     }
-    fh.readBE( b->csize );
-    fh.readBE( b->coff );
-    // uoff will be calculated
     return true;
 }
 
 void IndexedCompFile::writeIndex( FileHandle& fh ) const
 {
-    for ( BlockList::const_iterator iter = mBlocks.begin();
-          iter != mBlocks.end(); ++iter )
-    {
-        writeBlock( fh, *iter );
+    Buffer blocks, extra;
+    IndexWriter bout( blocks ), eout( extra );
+    uint64_t next = 0;
+    for ( BlockIterator iter = mIndex.begin(); !iter.end(); ++iter ) {
+        bout.varint( iter->usize );
+        bout.varint( iter->csize );
+        bout.svarint( int64_t( iter->coff - next ) );
+        writeBlockInfo( bout, *iter );
+        next = iter->coff + iter->csize;
     }
-    uint32_t eof = 0;
-    fh.writeBE( eof );
-// fprintf(stderr, "Wrote index\n");
+    writeExtra( eout );
+
+    IndexHeader hdr;
+    hdr.source = mSource;
+    hdr.blocks = mIndex.size();
+    hdr.blockBytes = blocks.size();
+    hdr.extraBytes = extra.size();
+
+    Buffer head;
+    IndexWriter hout( head );
+    hdr.write( hout );
+    hout.fixed( hdr.checksum( blocks ), 4 );
+
+    fh.write( head );
+    fh.write( blocks );
+    fh.write( extra );
 }
 
-void IndexedCompFile::writeBlock( FileHandle&  fh,
-                                  const Block* b ) const
+void IndexedCompFile::saveIndex()
 {
-    fh.writeBE( b->usize );
-    fh.writeBE( b->csize );
-    fh.writeBE( b->coff );
+    // Readers must never see part of an index
+    const std::string dest = indexPath(), tmp = IndexDir::tempPath( dest );
+    FileHandle idx;
+    try {
+        idx.open( tmp, O_RDWR | O_CREAT | O_EXCL, 0664 );
+        writeIndex( idx );
+        if ( ::rename( tmp.c_str(), dest.c_str() ) == -1 ) {
+            throw FileHandle::Exception( "rename error for file " + dest, errno );
+        }
+    } catch ( FileHandle::Exception& e ) {
+        ::unlink( tmp.c_str() );
+        fprintf( stderr, "Can't save index for %s, keeping it in memory: %s\n",
+                 path().c_str(), e.what() );
+        return;
+    }
+    if ( !IndexDir::gDir.empty() ) {
+        IndexDir::trim( dest );
+    }
+
+    // Now formats can page bits of it in as they need them. Use what we
+    // wrote: by name it could already be trimmed, or replaced by another mount.
+    try {
+        IndexHeader hdr;
+        if ( !hdr.read( idx, idx.size() ) || hdr.version != IndexVersion ) {
+            throw IndexReader::Exception( "can't read back index header" );
+        }
+        readExtra( idx, IndexHeader::Size + hdr.blockBytes, hdr.extraBytes );
+    } catch ( std::runtime_error& e ) {
+        fprintf( stderr, "Can't page index for %s, keeping it in memory: %s\n",
+                 path().c_str(), e.what() );
+    }
 }
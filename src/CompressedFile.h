@@ -1,61 +1,37 @@
 #pragma once
 
 #include "Block.h"
+#include "BlockIndex.h"
 #include "Buffer.h"
 #include "FileHandle.h"
+#include "IndexDir.h"
+#include "IndexStream.h"
 
-#include <algorithm>
+#include <atomic>
+#include <stdexcept>
 #include <string>
 
+class ThreadPool;
+
 class CompressedFile
 {
 public:
     static const size_t ChunkSize;     // for input buffers
 
 
-    class BlockIteratorInner
-    {
-    public:
-        virtual void incr() = 0;
-
-        virtual bool end() const = 0;
-
-        virtual const Block& deref() const = 0;
+    typedef BlockIndex::Iterator BlockIterator;
 
-        virtual BlockIteratorInner * dup() const = 0;
 
-        virtual ~BlockIteratorInner() { }
-    };
-
-
-    class BlockIterator
+    // Decompresses a block a piece at a time, for blocks too big to handle
+    // all at once
+    class Decoder
     {
-        BlockIteratorInner *mInner;
-
     public:
-        BlockIterator( BlockIteratorInner *i ) :
-            mInner( i ) { }
-
-        virtual ~BlockIterator()
-        {
-            if ( mInner ) {
-                delete mInner;
-            }
-        }
-
-        BlockIterator& operator++() { mInner->incr(); return *this; }
-        const Block *operator->() const { return &**this; }
-        const Block& operator*() const { return mInner->deref(); }
+        virtual ~Decoder() { }
 
-        bool end() const { return mInner->end(); }
-
-        BlockIterator() :
-            mInner( 0 ) { }
-
-        BlockIterator( const BlockIterator& o ) :
-            mInner( o.mInner->dup() ) { }
-        BlockIterator &operator=( BlockIterator o )
-        { std::swap( mInner, o.mInner ); return *this; }
+        // Fill buf with the next size bytes of the block
+        virtual void read( uint8_t* buf,
+                           size_t   size ) = 0;
     };
 
 
@@ -73,6 +49,9 @@ public:
 
 protected:
     std::string mPath;
+    uint32_t mID;
+
+    static std::atomic<uint32_t> gNextID;
 
     virtual void throwFormat( const std::string& s ) const;
 
@@ -80,22 +59,47 @@ protected:
 
 public:
     CompressedFile( const std::string& path ) :
-        mPath( path ) { }
+        mPath( path ),
+        mID( gNextID++ ) { }
 
     virtual ~CompressedFile() { }
 
     virtual const std::string& path() const { return mPath; }
 
+    // Small and unique, for use as a key
+    uint32_t id() const { return mID; }
+
     virtual std::string destName() const;
 
+    // Short name of the compression format, like "gzip"
+    virtual const char * format() const = 0;
+
+    // Memory used by our index
+    virtual size_t indexSize() const = 0;
+
     virtual BlockIterator findBlock( off_t off ) const = 0;
 
+    // Fill ubuf with exactly b.usize bytes
     virtual void decompressBlock( const FileHandle& fh,
                                   const Block&      b,
-                                  Buffer&           ubuf ) const = 0;
+                                  uint8_t*          ubuf ) const = 0;
+
+    // A decoder for b, which must outlive it, as must fh. By default the
+    // whole block is decompressed up front.
+    virtual Decoder * decoder( const FileHandle& fh,
+                               const Block&      b ) const;
 
     virtual off_t uncompressedSize() const = 0;
 
+    // What to tell stat, which may just be a guess while we're indexing
+    virtual off_t apparentSize() const { return uncompressedSize(); }
+
+    // Whether the index is still being built, so our size may change
+    virtual bool indexing() const { return false; }
+
+    // Wait until the index covers [0, end), or is as complete as it'll get
+    virtual void waitForIndex( off_t ) const { }
+
     void dumpBlocks();
 
 };
@@ -104,36 +108,66 @@ public:
 class IndexedCompFile : public CompressedFile
 {
 public:
-    IndexedCompFile( const std::string& path ) :
-        CompressedFile( path ) { }
+    // Told each time the index being built grows. May throw to stop it.
+    struct Progress
+    {
+        virtual ~Progress() { }
 
-    virtual ~IndexedCompFile();
+        virtual void indexed( const IndexedCompFile& file ) = 0;
+    };
 
-protected:
-    typedef std::vector<Block*> BlockList;
-    BlockList mBlocks;
+    static size_t gIndexThreads;        // for building an index, zero for one per CPU
 
+    // Shared by every index build, so however many run at once there are
+    // only so many threads. Whoever makes it sets this, null to build
+    // serially.
+    static ThreadPool *gIndexPool;
+    static bool gDeferIndex;            // leave building indexes to buildPendingIndex
 
-    class Iterator : public BlockIteratorInner
-    {
-        BlockList::const_iterator mIter, mEnd;
+    IndexedCompFile( const std::string& path ) :
+        CompressedFile( path ),
+        mPending( false ),
+        mMaxBlock( 0 ),
+        mProgress( 0 ) { }
 
-    public:
-        Iterator( BlockList::const_iterator i,
-                  BlockList::const_iterator e ) :
-            mIter( i ),
-            mEnd( e ) { }
+    // Whether the index still needs to be built
+    bool indexPending() const { return mPending; }
 
-        void incr() override { ++mIter; }
-        const Block& deref() const override { return **mIter; }
+    // Build and save a deferred index, telling progress as it grows
+    void buildPendingIndex( Progress* progress = 0 );
 
-        bool end() const override { return mIter == mEnd; }
+    // A copy of the index so far, that can be read from
+    virtual IndexedCompFile * snapshot() const = 0;
 
-        BlockIteratorInner * dup() const override
-        { return new Iterator( mIter, mEnd ); }
-    };
+    // A cheap guess at our size before we're indexed, or zero
+    virtual off_t sizeHint() const { return 0; }
+
+protected:
+    BlockIndex mIndex;
+    bool mPending;
+    uint64_t mMaxBlock;
+    Progress *mProgress;
+    IndexDir::Fingerprint mSource;      // when we were last indexed
 
 
+    // For snapshot()
+    template <typename T>
+    static IndexedCompFile * copy( const T& file )
+    {
+        T *c = new T( file );
+        c->mProgress = 0;
+        c->mIndex.finish();
+        return c;
+    }
+
+    // Call whenever the index is consistent, with its last block complete
+    void progress() const
+    {
+        if ( mProgress ) {
+            mProgress->indexed( *this );
+        }
+    }
+
     virtual std::string indexPath() const;
 
     virtual void initialize( uint64_t maxBlock );
@@ -142,22 +176,47 @@ protected:
 
     virtual void buildIndex( FileHandle& fh ) = 0;
 
-    virtual bool readIndex( FileHandle& fh );   // True on success
+    // True on success, false if the index is stale or damaged
+    virtual bool readIndex( FileHandle& fh );
 
     virtual void writeIndex( FileHandle& fh ) const;
 
-    virtual Block* newBlock() const { return new Block(); }
+    // The original format, with no header. False if it's damaged or
+    // doesn't fit the file.
+    bool readIndexV1( FileHandle& fh,
+                      off_t       size );
+
+    // Forget an index we couldn't finish reading, so it can be built afresh
+    virtual void clearIndex() { mIndex = BlockIndex(); }
 
-    virtual bool readBlock( FileHandle& fh,
-                            Block*      b );                    // True unless EOF
+    // Write our index, and let formats page from it
+    void saveIndex();
 
-    virtual void writeBlock( FileHandle&  fh,
-                             const Block *b ) const;
+    // Anything a format keeps for each block, after the block is added. The
+    // old version also kept anything else here.
+    virtual void readBlockInfo( IndexReader& /* in */,
+                                unsigned /* version */ ) { }
 
-    void addBlock( Block* b ) { mBlocks.push_back( b ); }
+    virtual void writeBlockInfo( IndexWriter& /* out */,
+                                 const Block& /* b */ ) const { }
+
+    // Anything else, after all the blocks. It's up to the format to check
+    // it, and it may leave it in the file until it's needed.
+    virtual void readExtra( const FileHandle& /* fh */,
+                            uint64_t /* offset */,
+                            uint64_t /* size */ ) { }
+
+    virtual void writeExtra( IndexWriter& /* out */ ) const { }
+
+    void addBlock( uint32_t usize,
+                   uint64_t coff,
+                   uint32_t csize ) { mIndex.add( usize, coff, csize ); }
+
+public:
+    BlockIterator findBlock( off_t off ) const override { return mIndex.find( off ); }
 
-    BlockIterator findBlock( off_t off ) const override;
+    off_t uncompressedSize() const override { return mIndex.uncompressedSize(); }
 
-    off_t uncompressedSize() const override;
+    size_t indexSize() const override { return mIndex.memory(); }
 
 };
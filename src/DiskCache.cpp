@@ -0,0 +1,259 @@
+#include "DiskCache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+const char DiskCache::Magic[8] = { 'l', 'z', 'o', 'p', 'f', 's', 'L', '2' };
+size_t DiskCache::gMaxPending = 64 * 1024 * 1024;
+
+DiskCache::Source::Source( const FileHandle& fh )
+{
+    struct stat st;
+    fh.stat( st );
+    dev = st.st_dev;
+    ino = st.st_ino;
+    size = st.st_size;
+    mtime = uint64_t( st.st_mtim.tv_sec ) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+DiskCache::Header::Header( const Source& src,
+                           const Block&  b,
+                           uint32_t      c ) :
+    dev( src.dev ),
+    ino( src.ino ),
+    size( src.size ),
+    mtime( src.mtime ),
+    coff( b.coff ),
+    usize( b.usize ),
+    crc( c )
+{
+    memcpy( magic, Magic, sizeof( magic ) );
+}
+
+bool DiskCache::Header::matches( const Header& o ) const
+{
+    return memcmp( magic, o.magic, sizeof( magic ) ) == 0
+           && dev == o.dev && ino == o.ino && size == o.size && mtime == o.mtime
+           && coff == o.coff && usize == o.usize;
+}
+
+DiskCache::DiskCache( ThreadPool&        pool,
+                      const std::string& dir,
+                      uint64_t           maxSize ) :
+    mPool( pool ),
+    mDir( dir ),
+    mSize( 0 ),
+    mMaxSize( maxSize ),
+    mPending( 0 )
+{
+    scan();
+}
+
+DiskCache::~DiskCache()
+{
+    flush();
+}
+
+void DiskCache::flush()
+{
+    Lock lock( mCond );
+    while ( !mWriting.empty() ) {
+        mCond.wait();
+    }
+}
+
+void DiskCache::check( const std::string& dir )
+{
+    if ( ::mkdir( dir.c_str(), 0755 ) == -1 && errno != EEXIST ) {
+        throw FileHandle::Exception( "can't create cache directory " + dir, errno );
+    }
+    if ( ::access( dir.c_str(), R_OK | W_OK | X_OK ) == -1 ) {
+        throw FileHandle::Exception( "can't use cache directory " + dir, errno );
+    }
+}
+
+uint64_t DiskCache::key( const Source& src,
+                         off_t         coff )
+{
+    // FNV-1a over the identity and offset
+    const uint64_t fields[] = { src.dev, src.ino, src.size, src.mtime, uint64_t( coff ) };
+    const uint8_t *p = reinterpret_cast<const uint8_t*>( fields );
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for ( size_t i = 0; i < sizeof( fields ); ++i ) {
+        h = ( h ^ p[i] ) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+std::string DiskCache::path( uint64_t key ) const
+{
+    char name[17];
+    snprintf( name, sizeof( name ), "%016llx", (unsigned long long)key );
+    return mDir + "/" + name;
+}
+
+void DiskCache::scan()
+{
+    DIR *dir = opendir( mDir.c_str() );
+    if ( !dir ) {
+        throw FileHandle::Exception( "can't open cache directory " + mDir, errno );
+    }
+
+    // Oldest first, so the most recently used end up at the front
+    typedef std::pair<uint64_t, std::pair<uint64_t, uint64_t> > Found;
+    std::vector<Found> found;
+    while ( struct dirent *de = readdir( dir ) ) {
+        std::string name( de->d_name );
+        struct stat st;
+        if ( name.size() > 4 && name.compare( name.size() - 4, 4, ".tmp" ) == 0 ) {
+            unlinkat( dirfd( dir ), de->d_name, 0 );        // interrupted write
+        } else if ( name.size() == 16
+                    && name.find_first_not_of( "0123456789abcdef" ) == std::string::npos
+                    && fstatat( dirfd( dir ), de->d_name, &st, 0 ) == 0
+                    && S_ISREG( st.st_mode ) )
+        {
+            uint64_t mtime = uint64_t( st.st_mtim.tv_sec ) * 1000000000 + st.st_mtim.tv_nsec;
+            uint64_t key = strtoull( de->d_name, 0, 16 );
+            found.push_back( Found( mtime, std::make_pair( key, st.st_size ) ) );
+        }
+    }
+    closedir( dir );
+
+    std::sort( found.begin(), found.end() );
+    Lock lock( mCond );
+    for ( std::vector<Found>::iterator i = found.begin(); i != found.end(); ++i ) {
+        insert( i->second.first, i->second.second );
+    }
+}
+
+void DiskCache::insert( uint64_t key,
+                        uint64_t size )
+{
+    evict( size );
+    mLRU.push_front( key );
+    Entry& e = mEntries[key];
+    e.size = size;
+    e.pos = mLRU.begin();
+    mSize += size;
+}
+
+void DiskCache::remove( uint64_t key )
+{
+    EntryMap::iterator i = mEntries.find( key );
+    if ( i == mEntries.end() ) {
+        return;
+    }
+    ::unlink( path( key ).c_str() );
+    mSize -= i->second.size;
+    mLRU.erase( i->second.pos );
+    mEntries.erase( i );
+}
+
+void DiskCache::evict( uint64_t size )
+{
+    while ( !mLRU.empty() && mSize + size > mMaxSize ) {
+        remove( mLRU.back() );
+    }
+}
+
+bool DiskCache::read( const Source& src,
+                      const Block&  b,
+                      uint8_t*      buf )
+{
+    uint64_t k = key( src, b.coff );
+    {
+        Lock lock( mCond );
+        EntryMap::iterator i = mEntries.find( k );
+        if ( i == mEntries.end() ) {
+            return false;
+        }
+        mLRU.splice( mLRU.begin(), mLRU, i->second.pos );
+    }
+
+    bool ok = false;
+    std::string file = path( k );
+    try {
+        FileHandle fh( file, O_RDONLY );
+        Header h;
+        fh.pread( 0, &h, sizeof( h ) );
+        if ( h.matches( Header( src, b, h.crc ) ) && b.usize ) {
+            fh.pread( sizeof( h ), buf, b.usize );
+            ok = crc32( 0, buf, b.usize ) == h.crc;
+        }
+    } catch ( std::runtime_error& e ) {
+        // Missing or truncated, treat it as a miss
+    }
+
+    Lock lock( mCond );
+    if ( ok ) {
+        ::utimensat( AT_FDCWD, file.c_str(), 0, 0 );  // remember it's in use
+    } else {
+        remove( k );
+    }
+    return ok;
+}
+
+void DiskCache::write( const Source&            src,
+                       const Block&             b,
+                       const PooledBuffer::Ptr& buf )
+{
+    uint64_t k = key( src, b.coff );
+    size_t bytes = b.usize;
+    {
+        Lock lock( mCond );
+        if ( mEntries.count( k ) || mWriting.count( k )
+             || mPending + bytes > gMaxPending || sizeof( Header ) + bytes > mMaxSize )
+        {
+            return;
+        }
+        mWriting.insert( k );
+        mPending += bytes;
+    }
+    mPool.enqueue( new Writeback( *this, k, Header( src, b, 0 ), buf ),
+                   ThreadPool::Background );
+}
+
+void DiskCache::Writeback::operator()()
+{
+    header.crc = crc32( 0, buf->data(), header.usize );
+
+    // Write to a temporary name, so a crash never leaves a partial block
+    std::string dest = cache.path( key ), tmp = dest + ".tmp";
+    bool ok = false;
+    try {
+        FileHandle fh( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        fh.write( &header, sizeof( header ) );
+        fh.write( buf->data(), header.usize );
+        ok = ::rename( tmp.c_str(), dest.c_str() ) == 0;
+    } catch ( FileHandle::Exception& e ) {
+        // Out of space or similar, just don't cache it
+    }
+    if ( !ok ) {
+        ::unlink( tmp.c_str() );
+        return;
+    }
+
+    Lock lock( cache.mCond );
+    cache.insert( key, sizeof( header ) + header.usize );
+}
+
+void DiskCache::Writeback::release()
+{
+    buf = PooledBuffer::Ptr();      // before anyone waiting can go away
+    {
+        Lock lock( cache.mCond );
+        cache.mWriting.erase( key );
+        cache.mPending -= header.usize;
+        cache.mCond.broadcast();
+    }
+    delete this;
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <stdint.h>
+
+#include "Block.h"
+#include "BufferPool.h"
+#include "FileHandle.h"
+#include "ThreadPool.h"
+
+
+/**
+ * A second tier of cache, keeping decompressed blocks in a local directory
+ * so they survive a remount.
+ *
+ * Each block is one file, named after a hash of the source file's identity
+ * and the block's offset. Files start with a header repeating that identity,
+ * and a checksum of the contents, so stale or damaged files are never used.
+ * Blocks are written in the background, and the least-recently used files
+ * are removed to stay under the size limit.
+ */
+class DiskCache
+{
+public:
+    // What a source file looked like when a block was written. If any of
+    // this changes, the block is stale.
+    struct Source
+    {
+        uint64_t dev, ino, size, mtime;
+
+        Source( const FileHandle& fh );
+    };
+
+    // Most bytes of writes to have queued, further blocks are skipped
+    static size_t gMaxPending;
+
+    DiskCache( ThreadPool&        pool,
+               const std::string& dir,
+               uint64_t           maxSize );
+
+    // Waits for queued writes
+    ~DiskCache();
+
+    // Wait for queued writes. Must be done before destroying the pool our
+    // buffers came from.
+    void flush();
+
+    // Make sure we'll be able to use a directory, creating it if needed
+    static void check( const std::string& dir );
+
+    // Fill buf with the contents of b, if we have it
+    bool read( const Source& src,
+               const Block&  b,
+               uint8_t*      buf );
+
+    // Save a block in the background
+    void write( const Source&            src,
+                const Block&             b,
+                const PooledBuffer::Ptr& buf );
+
+protected:
+    struct Header
+    {
+        char magic[8];
+        uint64_t dev, ino, size, mtime;
+        uint64_t coff;
+        uint32_t usize;
+        uint32_t crc;
+
+        Header() { }
+
+        Header( const Source& src,
+                const Block&  b,
+                uint32_t      c );
+
+        bool matches( const Header& o ) const;
+    };
+
+    static const char Magic[8];
+
+    struct Writeback : public ThreadPool::Job
+    {
+        DiskCache& cache;
+        uint64_t key;
+        Header header;
+        PooledBuffer::Ptr buf;
+
+        Writeback( DiskCache&               c,
+                   uint64_t                 k,
+                   const Header&            h,
+                   const PooledBuffer::Ptr& b ) :
+            cache( c ),
+            key( k ),
+            header( h ),
+            buf( b ) { }
+
+        void operator()() override;
+
+        void release() override;
+    };
+    friend struct Writeback;
+
+    typedef std::list<uint64_t> LRUList;      // most recent first
+    struct Entry
+    {
+        uint64_t size;
+        LRUList::iterator pos;
+    };
+    typedef std::unordered_map<uint64_t, Entry> EntryMap;
+
+    ThreadPool& mPool;
+    std::string mDir;
+
+    ConditionVariable mCond;                // guards everything below
+    LRUList mLRU;
+    EntryMap mEntries;
+    uint64_t mSize, mMaxSize;
+    std::unordered_set<uint64_t> mWriting;
+    size_t mPending;                        // bytes of queued writes
+
+    static uint64_t key( const Source& src,
+                         off_t         coff );
+
+    std::string path( uint64_t key ) const;
+
+    // Find what's already in the directory
+    void scan();
+
+    // Call these with mCond held
+    void insert( uint64_t key,
+                 uint64_t size );
+
+    void remove( uint64_t key );
+
+    void evict( uint64_t size );
+};
@@ -41,6 +41,20 @@ void FileHandle::open( const std::string& path,
     mOwnFD = true;
 }
 
+void FileHandle::dup( const FileHandle& o )
+{
+    if ( mFD != -1 ) {
+        throwEx( "double open", 0 );
+    }
+
+    mPath = o.mPath;
+    mFD = ::dup( o.mFD );
+    if ( mFD == -1 ) {
+        THROW_EX( "dup" );
+    }
+    mOwnFD = true;
+}
+
 FileHandle& FileHandle::operator=( const FileHandle& o )
 {
     close();
@@ -66,8 +80,12 @@ FileHandle::~FileHandle()
 void FileHandle::read( void * buf,
                        size_t size )
 {
-    if ( tryRead( buf, size ) < size ) {
-        throw EOFException( mPath );
+    // Big reads may come back in pieces, tryRead throws at EOF
+    char *p = reinterpret_cast<char*>( buf );
+    while ( size ) {
+        size_t bytes = tryRead( p, size );
+        p += bytes;
+        size -= bytes;
     }
 }
 
@@ -75,15 +93,19 @@ void FileHandle::read( Buffer& buf,
                        size_t  size )
 {
     buf.resize( size );
-    read( &buf[0], size );
+    read( buf.data(), size );
 }
 
 void FileHandle::pread( off_t  off,
                         void * buf,
                         size_t size ) const
 {
-    if ( tryPRead( off, buf, size ) < size ) {
-        throw EOFException( mPath );
+    char *p = reinterpret_cast<char*>( buf );
+    while ( size ) {
+        size_t bytes = tryPRead( off, p, size );
+        p += bytes;
+        off += bytes;
+        size -= bytes;
     }
 }
 
@@ -92,7 +114,7 @@ void FileHandle::pread( off_t   off,
                         size_t  size ) const
 {
     buf.resize( size );
-    pread( off, &buf[0], size );
+    pread( off, buf.data(), size );
 }
 
 size_t FileHandle::tryPRead( off_t   off,
@@ -144,9 +166,14 @@ size_t FileHandle::tryRead( void * buf,
 void FileHandle::write( const void *buf,
                         size_t      size )
 {
-    ssize_t bytes = ::write( mFD, buf, size );
-    if ( ( bytes < 0 ) ||( size_t( bytes ) < size ) ) {
-        THROW_EX( "write" );
+    const char *p = reinterpret_cast<const char*>( buf );
+    while ( size ) {
+        ssize_t bytes = ::write( mFD, p, size );
+        if ( bytes <= 0 ) {
+            THROW_EX( "write" );
+        }
+        p += bytes;
+        size -= bytes;
     }
 }
 
@@ -165,6 +192,13 @@ off_t FileHandle::tell() const
     return const_cast<FileHandle*>( this )->seek( 0, SEEK_CUR );
 }
 
+void FileHandle::stat( struct stat& st ) const
+{
+    if ( ::fstat( mFD, &st ) == -1 ) {
+        THROW_EX( "fstat" );
+    }
+}
+
 off_t FileHandle::size() const
 {
     off_t cur = tell();
@@ -4,6 +4,7 @@
 #include <string>
 
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include "Buffer.h"
 
@@ -65,6 +66,14 @@ public:
 
     bool open() const { return mFD != -1; }
 
+    // Our own descriptor for the file o has open, even if it's since been
+    // renamed or removed
+    void dup( const FileHandle& o );
+
+    const std::string& path() const { return mPath; }
+
+    void stat( struct stat& st ) const;
+
     void read( void * buf,
                size_t size );
 
@@ -96,7 +105,7 @@ public:
     void write( const void *buf,
                 size_t      size );
 
-    void write( const Buffer& buf ) { write( &buf[0], buf.size() ); }
+    void write( const Buffer& buf ) { write( buf.data(), buf.size() ); }
 
     off_t seek( off_t offset,
                 int   whence = SEEK_CUR );
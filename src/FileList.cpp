@@ -2,6 +2,7 @@
 
 #include <iostream>
 
+#include "BackgroundIndexedFile.h"
 #include "LzopFile.h"
 #include "PixzFile.h"
 #include "GzipFile.h"
@@ -42,6 +43,12 @@ void FileList::add( const std::string& source )
             return;
         }
 
+        BackgroundIndexedFile *background = nullptr;
+        IndexedCompFile *indexed = dynamic_cast<IndexedCompFile*>( file );
+        if ( indexed && indexed->indexPending() ) {
+            file = background = new BackgroundIndexedFile( indexed );
+        }
+
         const auto destPath = std::string( "/" ) + file->destName();
         if ( mMap.find( destPath ) != mMap.end() ) {
             std::cerr
@@ -52,12 +59,22 @@ void FileList::add( const std::string& source )
             file = nullptr;
         } else {
             mMap[destPath] = file;
+            if ( background ) {
+                mIndexing.push_back( background );
+            }
         }
     } catch ( std::runtime_error& e ) {
         std::cerr << "Error reading file " << source.c_str() << ", skipping: " << e.what() << "\n";
     }
 }
 
+void FileList::index( ThreadPool& pool )
+{
+    for ( auto file : mIndexing ) {
+        file->index( pool );
+    }
+}
+
 FileList::~FileList()
 {
     for ( auto& nameAndObject : mMap ) {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "CompressedFile.h"
+#include "ThreadPool.h"
 
 #include <string>
 #include <unordered_map>
@@ -9,6 +10,9 @@
 #include <stdint.h>
 
 
+class BackgroundIndexedFile;
+
+
 class FileList
 {
 private:
@@ -37,6 +41,9 @@ public:
 
     void add( const std::string& source );
 
+    // Start building any indexes we've put off
+    void index( ThreadPool& pool );
+
     template <typename Op>
     void forNames( Op op )
     {
@@ -58,5 +65,6 @@ private:
      * archive basis like gzip, bzip2, ... but not zip
      */
     std::unordered_map<std::string, CompressedFile*> mMap;
+    std::vector<BackgroundIndexedFile*> mIndexing;     // also in mMap
     uint64_t mMaxBlockSize;
 };
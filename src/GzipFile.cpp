@@ -1,11 +1,17 @@
 #include "GzipFile.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <stdint.h>
 #include <string>
 
 #include "Debug.h"
 #include "FileHandle.h"
+#include "GzipImporter.h"
+#include "GzipIndexer.h"
 #include "GzipReader.h"
 #include "PathUtils.h"
 
@@ -13,12 +19,55 @@
 const size_t GzipFile::WindowSize = 1 << MAX_WBITS;
 uint64_t GzipFile::gMinDictBlockFactor = 32;
 
+namespace {
+// Kept for each block, in memory and in the index
+enum
+{
+    BlockBitsMask = 0x07,
+    BlockMemberFlag = 0x40,     // starts at a gzip header
+    BlockDictFlag = 0x80,
+};
+
+GzipBlockReader::Wrapper wrapper( uint8_t flags )
+{
+    return ( flags & BlockMemberFlag ) ? GzipBlockReader::Gzip : GzipBlockReader::Raw;
+}
+
+// BGZF members have fixed-size fields up to the extra field, which has a
+// 'BC' subfield with the size of the whole member less one. The footer's
+// ISIZE says how much it holds, at most 64 KiB.
+const size_t BgzfHeaderSize = 12, BgzfFooterSize = 8;
+const uint32_t BgzfMaxSize = 64 * 1024;
+
+bool bgzfSize( const uint8_t* extra,
+               size_t         len,
+               uint32_t&      bsize )
+{
+    for ( size_t i = 0; i + 4 <= len; ) {
+        const size_t slen = extra[i + 2] | ( extra[i + 3] << 8 );
+        if ( extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= len ) {
+            bsize = ( extra[i + 4] | ( extra[i + 5] << 8 ) ) + 1;
+            return true;
+        }
+        i += 4 + slen;
+    }
+    return false;
+}
+}
+
 void GzipFile::checkFileType( FileHandle& fh )
 {
     try {
         GzipHeaderReader rd( fh );
         gz_header hdr;
+        memset( &hdr, 0, sizeof( hdr ) );       // don't store name, comment etc.
+        uint8_t extra[256];
+        hdr.extra = extra;
+        hdr.extra_max = sizeof( extra );
         rd.header( hdr );
+        uint32_t bsize;
+        mBgzf = hdr.extra
+                && bgzfSize( extra, std::min( size_t( hdr.extra_len ), sizeof( extra ) ), bsize );
     } catch ( GzipHeaderReader::Exception& e ) {
         throwFormat( e.what() );
     } catch ( FileHandle::EOFException& e ) {
@@ -30,26 +79,71 @@ void GzipFile::checkFileType( FileHandle& fh )
 void GzipFile::setLastBlockSize( off_t uoff,
                                  off_t coff )
 {
-    if ( mBlocks.empty() ) {
+    if ( mIndex.empty() ) {
         return;
     }
-    Block* p = mBlocks.back();
-    p->usize = uoff - p->uoff;
-    p->csize = coff - p->coff;
+    Block p = mIndex.back();
+    mIndex.resizeLast( uoff - p.uoff, coff - p.coff );
 }
 
-Buffer& GzipFile::addBlock( off_t  uoff,
-                            off_t  coff,
-                            size_t bits )
+void GzipFile::addBlock( off_t  uoff,
+                         off_t  coff,
+                         size_t bits,
+                         bool   member )
 {
     setLastBlockSize( uoff, coff );
-    GzipBlock *b = new GzipBlock( uoff, coff, bits );
-    IndexedCompFile::addBlock( b );
-    return b->dict;
+    if ( !mIndex.empty() ) {
+        progress();
+    }
+    IndexedCompFile::addBlock( 0, coff, 0 );
+    mBits.push_back( bits | ( member ? BlockMemberFlag : 0 ) );
+}
+
+void GzipFile::addDict( const Buffer& window )
+{
+    mDictBlocks.push_back( mIndex.size() - 1 );
+    mDicts.add( window );
+}
+
+size_t GzipFile::dictIndex( const Block& b ) const
+{
+    std::vector<uint64_t>::const_iterator i =
+        std::lower_bound( mDictBlocks.begin(), mDictBlocks.end(), b.index );
+    if ( i == mDictBlocks.end() || *i != b.index ) {
+        return std::string::npos;
+    }
+    return i - mDictBlocks.begin();
+}
+
+GzipWindows::Ptr GzipFile::dict( const Block& b ) const
+{
+    static const GzipWindows::Ptr none = std::make_shared<Buffer>();
+    const size_t i = dictIndex( b );
+    return i == std::string::npos ? none : mDicts.get( i );
+}
+
+size_t GzipFile::indexSize() const
+{
+    return IndexedCompFile::indexSize() + mBits.capacity()
+           + mDictBlocks.capacity() * sizeof( uint64_t ) + mDicts.memory();
 }
 
 void GzipFile::buildIndex( FileHandle& fh )
 {
+    if ( mBgzf && buildBgzfIndex( fh ) ) {
+        return;
+    }
+    if ( importIndex( fh ) ) {
+        return;
+    }
+
+    // Scanning in parallel does more work, so it's only worth it for big
+    // files and several threads
+    if ( fh.size() >= 2 * GzipIndexer::gChunkSize && gIndexPool && gIndexPool->threads() > 1 ) {
+        buildIndex( fh, *gIndexPool );
+        return;
+    }
+
     DOUT << "Building Index ...";
 
     fh.seek( 0, SEEK_SET );
@@ -126,8 +220,11 @@ void GzipFile::buildIndex( FileHandle& fh )
                 if ( rd.opos() - lastIdx > off_t( minBlock ) ) {
                     // Add a dict block
                     DOUT << "Dict block\n";
-                    Buffer& dict = addBlock( rd.opos(), rd.ipos(), rd.ibits() );
-                    rd.copyWindow( dict );
+                    addBlock( rd.opos(), rd.ipos(), rd.ibits() );
+                    Buffer window;
+                    rd.copyWindow( window );
+                    GzipIndexer::prune( fh, rd.ipos(), rd.ibits(), window );
+                    addDict( window );
                     lastIdx = rd.opos();
                 }
             }
@@ -137,23 +234,176 @@ void GzipFile::buildIndex( FileHandle& fh )
     // dumpBlocks();
 }
 
+// Adds checkpoints from elsewhere, as they come
+struct GzipFile::Checkpoints : public GzipIndexer::Output
+{
+    GzipFile& file;
+    const FileHandle& fh;
+
+    Checkpoints( GzipFile&         f,
+                 const FileHandle& h ) :
+        file( f ),
+        fh( h ) { }
+
+    void add( GzipIndexer::Checkpoint& p ) override
+    {
+        file.addBlock( p.uoff, p.coff, p.bits, p.member );
+        if ( !p.window.empty() ) {
+            GzipIndexer::prune( fh, p.coff, p.bits, p.window );
+            file.addDict( p.window );
+        }
+    }
+};
+
+void GzipFile::buildIndex( FileHandle& fh,
+                           ThreadPool& pool )
+{
+    Checkpoints out( *this, fh );
+    off_t uend, cend;
+    GzipIndexer( fh, pool ).run( out, uend, cend );
+    setLastBlockSize( uend, cend );
+}
+
+bool GzipFile::buildBgzfIndex( const FileHandle& fh )
+{
+    // Find every member before adding any, in case one's not BGZF
+    const off_t size = fh.size();
+    std::vector<std::pair<off_t, uint32_t> > members;   // where each starts, what it holds
+    Buffer head, extra;
+    off_t coff = 0;
+    while ( coff < size ) {
+        if ( size - coff < off_t( BgzfHeaderSize + BgzfFooterSize ) ) {
+            break;
+        }
+        fh.pread( coff, head, BgzfHeaderSize );
+        const size_t xlen = head[10] | ( head[11] << 8 );
+        if ( head[0] != 0x1f || head[1] != 0x8b || head[2] != Z_DEFLATED || !( head[3] & 0x04 )
+             || size - coff < off_t( BgzfHeaderSize + xlen + BgzfFooterSize ) )
+        {
+            break;
+        }
+        fh.pread( coff + BgzfHeaderSize, extra, xlen );
+        uint32_t bsize;
+        if ( !bgzfSize( extra.data(), extra.size(), bsize )
+             || bsize < BgzfHeaderSize + xlen + BgzfFooterSize || size - coff < off_t( bsize ) )
+        {
+            break;
+        }
+        uint8_t footer[4];
+        fh.pread( coff + bsize - sizeof( footer ), footer, sizeof( footer ) );
+        const uint32_t isize = footer[0] | ( footer[1] << 8 ) | ( footer[2] << 16 ) | ( uint32_t( footer[3] ) << 24 );
+        if ( isize > BgzfMaxSize ) {
+            break;
+        }
+        members.push_back( std::make_pair( coff, isize ) );
+        coff += bsize;
+    }
+    if ( coff != size ) {
+        fprintf( stderr, "%s isn't all BGZF, scanning it instead\n", path().c_str() );
+        return false;
+    }
+
+    // Each member is a block, except empty ones like the EOF marker are
+    // left to the block before
+    off_t uoff = 0;
+    for ( size_t i = 0; i < members.size(); ++i ) {
+        if ( members[i].second ) {
+            addBlock( uoff, members[i].first, 0, true );
+            uoff += members[i].second;
+        }
+    }
+    if ( mIndex.empty() ) {
+        addBlock( 0, 0, 0, true );
+    }
+    setLastBlockSize( uoff, size );
+    return true;
+}
+
+bool GzipFile::importIndex( const FileHandle& fh )
+{
+    GzipImporter importer( fh );
+    if ( !importer.find() ) {
+        return false;
+    }
+
+    fprintf( stderr, "Importing %s index %s\n", importer.tool(), importer.path().c_str() );
+    Checkpoints out( *this, fh );
+    off_t uend, cend;
+    importer.run( out, uend, cend );
+    setLastBlockSize( uend, cend );
+    return true;
+}
+
 GzipFile::GzipFile( const std::string& path,
                     uint64_t           maxBlock ) :
-    IndexedCompFile( path )
+    IndexedCompFile( path ),
+    mBgzf( false )
 {
     initialize( maxBlock );
 }
 
+// The trailer has the size mod 2^32, of the last member only
+off_t GzipFile::sizeHint() const
+{
+    FileHandle fh( path(), O_RDONLY );
+    uint8_t isize[4];
+    const off_t size = fh.size();
+    if ( size < off_t( sizeof( isize ) ) ) {
+        return 0;
+    }
+    fh.pread( size - sizeof( isize ), isize, sizeof( isize ) );
+    return isize[0] | ( isize[1] << 8 ) | ( isize[2] << 16 ) | ( off_t( isize[3] ) << 24 );
+}
+
 void GzipFile::decompressBlock( const FileHandle& fh,
                                 const Block&      b,
-                                Buffer&           ubuf ) const
+                                uint8_t*          ubuf ) const
 {
-    const GzipBlock& gb = dynamic_cast<const GzipBlock&>( b );
-    ubuf.resize( gb.usize );
-    GzipBlockReader rd( fh, ubuf, b, gb.dict, gb.bits );
+    const uint8_t flags = mBits[b.index];
+    GzipBlockReader rd( fh, ubuf, b, *dict( b ), flags & BlockBitsMask, wrapper( flags ) );
     rd.read();
 }
 
+namespace {
+
+class GzipDecoder : public CompressedFile::Decoder
+{
+    const FileHandle& mFH;
+    Block mBlock;
+    GzipWindows::Ptr mDict;
+    uint8_t mFlags;
+    std::unique_ptr<GzipBlockReader> mReader;
+
+public:
+    GzipDecoder( const FileHandle& fh,
+                 const Block&      b,
+                 GzipWindows::Ptr  dict,
+                 uint8_t           flags ) :
+        mFH( fh ),
+        mBlock( b ),
+        mDict( dict ),
+        mFlags( flags ) { }
+
+    void read( uint8_t* buf,
+               size_t   size ) override
+    {
+        // The reader wants somewhere to write from the start
+        if ( !mReader ) {
+            mReader.reset( new GzipBlockReader( mFH, buf, mBlock, *mDict,
+                                                mFlags & BlockBitsMask, wrapper( mFlags ) ) );
+        }
+        mReader->read( buf, size );
+    }
+};
+
+}
+
+CompressedFile::Decoder * GzipFile::decoder( const FileHandle& fh,
+                                             const Block&      b ) const
+{
+    return new GzipDecoder( fh, b, dict( b ), mBits[b.index] );
+}
+
 std::string GzipFile::destName() const
 {
     using namespace PathUtils;
@@ -167,45 +417,53 @@ std::string GzipFile::destName() const
     return base;
 }
 
-namespace {
-enum
+void GzipFile::clearIndex()
 {
-    BlockBitsMask = 0x07,
-    BlockDictFlag = 0x80,
-};
+    IndexedCompFile::clearIndex();
+    mBits.clear();
+    mDictBlocks.clear();
+    mDicts = GzipWindows();
 }
 
-bool GzipFile::readBlock( FileHandle& fh,
-                          Block *     b )
+void GzipFile::readBlockInfo( IndexReader& in,
+                              unsigned     version )
 {
-    if ( !IndexedCompFile::readBlock( fh, b ) ) {
-        return false;
-    }
-
-    GzipBlock *gb = dynamic_cast<GzipBlock*>( b );
-    uint8_t flags;
-    fh.readBE( flags );
-    gb->bits = flags & BlockBitsMask;
+    uint8_t flags = in.byte();
+    mBits.push_back( flags & ( BlockBitsMask | BlockMemberFlag ) );
     if ( flags & BlockDictFlag ) {
-        fh.read( gb->dict, WindowSize );
+        if ( version == 1 ) {   // the window used to follow
+            const uint8_t *w = in.bytes( WindowSize );
+            addDict( Buffer( w, w + WindowSize ) );
+        } else {
+            mDictBlocks.push_back( mIndex.size() - 1 );
+        }
     }
-
-    return true;
 }
 
-void GzipFile::writeBlock( FileHandle&  fh,
-                           const Block* b ) const
+void GzipFile::writeBlockInfo( IndexWriter& out,
+                               const Block& b ) const
 {
-    IndexedCompFile::writeBlock( fh, b );
-
-    const GzipBlock* gb = dynamic_cast<const GzipBlock*>( b );
-    uint8_t flags = ( gb->bits & BlockBitsMask );
-    if ( !gb->dict.empty() ) {
+    uint8_t flags = mBits[b.index];
+    if ( dictIndex( b ) != std::string::npos ) {
         flags |= BlockDictFlag;
     }
+    out.byte( flags );
+}
 
-    fh.writeBE( flags );
-    if ( flags & BlockDictFlag ) {
-        fh.write( gb->dict );
+void GzipFile::readExtra( const FileHandle& fh,
+                          uint64_t          offset,
+                          uint64_t          size )
+{
+    // Keep what we have unless it all checks out
+    GzipWindows dicts;
+    dicts.page( fh, offset, size );
+    if ( dicts.size() != mDictBlocks.size() ) {
+        throw IndexReader::Exception( "wrong number of windows in index" );
     }
+    mDicts = dicts;
+}
+
+void GzipFile::writeExtra( IndexWriter& out ) const
+{
+    mDicts.write( out );
 }
@@ -3,42 +3,71 @@
 #include "Block.h"
 #include "Buffer.h"
 #include "CompressedFile.h"
+#include "GzipWindows.h"
+#include "ThreadPool.h"
 
 
 class GzipFile : public IndexedCompFile
 {
 protected:
-    struct GzipBlock : public Block
-    {
-        size_t bits;
-        Buffer dict;
+    // Bit offset of each block's start, and other flags
+    std::vector<uint8_t> mBits;
+
+    // Whether we start with a BGZF member, which says how big it is
+    bool mBgzf;
+
+    // The few blocks that need a dictionary, and their dictionaries
+    std::vector<uint64_t> mDictBlocks;
+    GzipWindows mDicts;
+
+    // Which dictionary b needs, or npos
+    size_t dictIndex( const Block& b ) const;
 
-        GzipBlock( off_t  rUoff,
-                   off_t  rCoff,
-                   size_t rBits ) :
-            Block( 0, 0, rUoff, rCoff ),
-            bits( rBits )
-            {}
-    };
+    GzipWindows::Ptr dict( const Block& b ) const;
 
     void setLastBlockSize( off_t uoff,
                            off_t coff );
 
-    Buffer& addBlock( off_t  uoff,
-                      off_t  coff,
-                      size_t bits );
+    // A member block starts at a gzip header, rather than raw deflate data
+    void addBlock( off_t  uoff,
+                   off_t  coff,
+                   size_t bits,
+                   bool   member = false );
+
+    // Give the last block a dictionary
+    void addDict( const Buffer& window );
 
     void checkFileType( FileHandle &fh ) override;
 
     void buildIndex( FileHandle& fh ) override;
 
-    Block* newBlock() const override { return new GzipBlock( 0, 0, 0 ); }
+    struct Checkpoints;
+
+    // Build the index with the help of some threads
+    void buildIndex( FileHandle& fh,
+                     ThreadPool& pool );
+
+    // Hop from header to header of BGZF members, without inflating them.
+    // False if they're not all BGZF.
+    bool buildBgzfIndex( const FileHandle& fh );
+
+    // Use an index made by another tool, if there is one
+    bool importIndex( const FileHandle& fh );
 
-    bool readBlock( FileHandle& fh,
-                    Block*      b ) override; // True unless EOF
+    void clearIndex() override;
 
-    void writeBlock( FileHandle&  fh,
-                     const Block *b ) const override;
+    void readBlockInfo( IndexReader& in,
+                        unsigned     version ) override;
+
+    void writeBlockInfo( IndexWriter& out,
+                         const Block& b ) const override;
+
+    // The windows, in order
+    void readExtra( const FileHandle& fh,
+                    uint64_t          offset,
+                    uint64_t          size ) override;
+
+    void writeExtra( IndexWriter& out ) const override;
 
 public:
     static const size_t WindowSize;
@@ -60,8 +89,19 @@ public:
 
     std::string destName() const override;
 
+    const char * format() const override { return "gzip"; }
+
+    IndexedCompFile * snapshot() const override { return copy( *this ); }
+
+    size_t indexSize() const override;
+
+    off_t sizeHint() const override;
+
     void decompressBlock( const FileHandle& fh,
                           const Block&      b,
-                          Buffer&           ubuf ) const override;
+                          uint8_t*          ubuf ) const override;
+
+    Decoder * decoder( const FileHandle& fh,
+                       const Block&      b ) const override;
 
 };
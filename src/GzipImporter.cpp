@@ -0,0 +1,327 @@
+#include "GzipImporter.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "GzipFile.h"
+#include "GzipReader.h"
+#include "IndexStream.h"
+#include "PathUtils.h"
+
+namespace {
+
+const char GztoolMagic[] = "gzipindx";         // 'X' at the end for v1, with lines
+const char IndexedGzipMagic[] = "GZIDX";
+
+uint64_t mtime( const FileHandle& fh )
+{
+    struct stat st;
+    fh.stat( st );
+    return uint64_t( st.st_mtim.tv_sec ) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+}
+
+GzipImporter::GzipImporter( const FileHandle& fh ) :
+    mFH( fh ),
+    mSize( fh.size() ),
+    mTool( 0 ),
+    mPacked( false ),
+    mEnd( 0 ) { }
+
+bool GzipImporter::open( const std::string& path )
+{
+    mIndex.close();
+    mPoints.clear();
+    try {
+        mIndex.open( path, O_RDONLY );
+    } catch ( FileHandle::Exception& e ) {
+        return false;
+    }
+    if ( mtime( mIndex ) < mtime( mFH ) ) {
+        fprintf( stderr, "Ignoring %s, it's older than %s\n", path.c_str(),
+                 mFH.path().c_str() );
+        mIndex.close();
+        return false;
+    }
+    return true;
+}
+
+bool GzipImporter::find()
+{
+    // Each tool's index may be named for the file with or without its .gz
+    std::string base = mFH.path();
+    std::vector<std::string> paths;
+    paths.push_back( base + ".gzi" );
+    paths.push_back( base + ".gzidx" );
+    if ( PathUtils::removeExtension( base, "gz" ) ) {
+        paths.push_back( base + ".gzi" );
+        paths.push_back( base + ".gzidx" );
+    }
+
+    for ( size_t i = 0; i < paths.size(); ++i ) {
+        if ( !open( paths[i] ) ) {
+            continue;
+        }
+        try {
+            if ( ( readGztool() || readBgzip() || readIndexedGzip() ) && check() ) {
+                tail();
+                return true;
+            }
+            fprintf( stderr, "Can't use %s, it's not an index for %s\n",
+                     paths[i].c_str(), mFH.path().c_str() );
+        } catch ( std::exception& e ) {
+            fprintf( stderr, "Can't use %s: %s\n", paths[i].c_str(), e.what() );
+        }
+    }
+    mIndex.close();
+    mPoints.clear();
+    return false;
+}
+
+// 8 zero bytes, the magic, then big-endian fields. Counts of points may be
+// zero if the index is still being written, so we stop at its end.
+bool GzipImporter::readGztool()
+{
+    const off_t size = mIndex.size();
+    Buffer buf;
+    if ( size < 32 ) {
+        return false;
+    }
+    mIndex.pread( 0, buf, 16 );
+    const size_t magic = sizeof( GztoolMagic ) - 1;
+    if ( std::count( buf.begin(), buf.begin() + 8, 0 ) != 8
+         || memcmp( &buf[8], GztoolMagic, magic - 1 ) != 0
+         || ( buf[15] != 'x' && buf[15] != 'X' ) )
+    {
+        return false;
+    }
+    const bool lines = buf[15] == 'X';
+
+    off_t pos = 16 + ( lines ? 4 : 0 );
+    mIndex.pread( pos, buf, 16 );
+    IndexReader counts( buf.data(), buf.size() );
+    const uint64_t a = counts.fixedBE( 8 ), b = counts.fixedBE( 8 );
+    const uint64_t count = std::max( a, b );
+    pos += 16;
+
+    const size_t fixed = 8 + 8 + 4 + 4;
+    while ( ( !count || mPoints.size() < count ) && size - pos >= off_t( fixed ) ) {
+        mIndex.pread( pos, buf, fixed );
+        IndexReader in( buf.data(), buf.size() );
+        Point p;
+        p.uoff = in.fixedBE( 8 );
+        p.coff = in.fixedBE( 8 );
+        p.bits = in.fixedBE( 4 );
+        p.wsize = in.fixedBE( 4 );
+        p.window = pos + fixed;
+        pos = p.window + p.wsize + ( lines ? 8 : 0 );
+        if ( pos > size ) {
+            break;              // cut short
+        }
+        mPoints.push_back( p );
+    }
+
+    mTool = "gztool";
+    mPacked = true;
+    return true;
+}
+
+// A little-endian count, then the compressed and uncompressed offset of each
+// member after the first
+bool GzipImporter::readBgzip()
+{
+    const off_t size = mIndex.size();
+    Buffer buf;
+    mIndex.pread( 0, buf, 8 );
+    const uint64_t count = IndexReader( buf.data(), buf.size() ).fixed( 8 );
+    if ( uint64_t( size ) != 8 + 16 * count ) {
+        return false;
+    }
+
+    mIndex.pread( 8, buf, size - 8 );
+    IndexReader in( buf.data(), buf.size() );
+    mPoints.reserve( count + 1 );
+    mPoints.push_back( Point() );
+    for ( uint64_t i = 0; i < count; ++i ) {
+        Point p;
+        p.coff = in.fixed( 8 );
+        p.uoff = in.fixed( 8 );
+        mPoints.push_back( p );
+    }
+    for ( size_t i = 0; i < mPoints.size(); ++i ) {
+        mPoints[i].member = true;
+    }
+
+    mTool = "bgzip";
+    mPacked = false;
+    return true;
+}
+
+// The magic, version and flags bytes, then native-endian fields. The table
+// of points is followed by their windows, all the same size. Version 0 has
+// a window for every point but the first, later ones flag which have one.
+bool GzipImporter::readIndexedGzip()
+{
+    const size_t magic = sizeof( IndexedGzipMagic ) - 1, head = magic + 2 + 8 + 8 + 4 + 4 + 4;
+    Buffer buf;
+    if ( mIndex.size() < off_t( head ) ) {
+        return false;
+    }
+    mIndex.pread( 0, buf, head );
+    if ( memcmp( buf.data(), IndexedGzipMagic, magic ) != 0 ) {
+        return false;
+    }
+    IndexReader in( buf.data() + magic, buf.size() - magic );
+    const unsigned version = in.byte();
+    in.byte();                  // flags
+    const uint64_t csize = in.fixed( 8 );
+    in.fixed( 8 );              // uncompressed size, we'll find it ourselves
+    in.fixed( 4 );              // spacing
+    const uint32_t wsize = in.fixed( 4 ), count = in.fixed( 4 );
+    if ( version > 1 ) {
+        throw std::runtime_error( "unknown indexed_gzip version" );
+    }
+    if ( csize != uint64_t( mSize ) ) {
+        return false;
+    }
+
+    const size_t each = 8 + 8 + 1 + ( version ? 1 : 0 );
+    mIndex.pread( head, buf, count * each );
+    IndexReader pin( buf.data(), buf.size() );
+    uint64_t window = head + count * each;
+    for ( uint32_t i = 0; i < count; ++i ) {
+        Point p;
+        p.coff = pin.fixed( 8 );
+        p.uoff = pin.fixed( 8 );
+        p.bits = pin.byte();
+        const bool data = version ? pin.byte() : i > 0;
+        if ( data ) {
+            p.window = window;
+            p.wsize = wsize;
+            window += wsize;
+        }
+        mPoints.push_back( p );
+    }
+    if ( window > uint64_t( mIndex.size() ) ) {
+        throw IndexReader::Exception( "truncated index" );
+    }
+
+    mTool = "indexed_gzip";
+    mPacked = false;
+    return true;
+}
+
+bool GzipImporter::check()
+{
+    // Skip points that start nothing, or start past the end
+    std::vector<Point> points;
+    points.reserve( mPoints.size() );
+    for ( size_t i = 0; i < mPoints.size(); ++i ) {
+        const Point& p = mPoints[i];
+        if ( p.coff >= mSize || ( !points.empty() && p.uoff == points.back().uoff ) ) {
+            continue;
+        }
+        const bool ordered = points.empty()
+                             ? p.uoff == 0
+                             : p.uoff > points.back().uoff && p.coff > points.back().coff;
+        if ( !ordered || p.bits > 7 || ( p.bits && p.coff == 0 ) ) {
+            return false;
+        }
+        points.push_back( p );
+    }
+    if ( points.empty() ) {
+        return false;
+    }
+
+    // A deflate block can't start with the gzip magic, the block type would
+    // be invalid
+    uint8_t magic[2];
+    for ( size_t i = 0; i < points.size(); ++i ) {
+        Point& p = points[i];
+        if ( !p.member && p.bits == 0 && p.coff + off_t( sizeof( magic ) ) <= mSize ) {
+            mFH.pread( p.coff, magic, sizeof( magic ) );
+            p.member = magic[0] == 0x1f && magic[1] == 0x8b;
+        }
+        if ( p.member ) {
+            p.wsize = 0;
+        }
+    }
+    mPoints.swap( points );
+    return true;
+}
+
+void GzipImporter::window( const Point& p,
+                           Buffer&      buf ) const
+{
+    buf.clear();
+    if ( !p.wsize ) {
+        return;
+    }
+
+    mIndex.pread( p.window, buf, p.wsize );
+    if ( mPacked ) {
+        uLongf size = GzipFile::WindowSize;
+        Buffer packed;
+        packed.swap( buf );
+        buf.resize( size );
+        if ( uncompress( buf.data(), &size, packed.data(), packed.size() ) != Z_OK ) {
+            throw std::runtime_error( "damaged window in " + mIndex.path() );
+        }
+        buf.resize( size );
+    }
+    if ( buf.size() > GzipFile::WindowSize ) {
+        buf.erase( buf.begin(), buf.end() - GzipFile::WindowSize );
+    }
+}
+
+void GzipImporter::tail()
+{
+    const Point& last = mPoints.back();
+    Buffer dict;
+    window( last, dict );
+    ScanningGzipReader rd( mFH, last.coff, last.bits,
+                           last.member ? ScanningGzipReader::Gzip : ScanningGzipReader::Raw,
+                           dict );
+    bool ok = false;
+    try {
+        int err = Z_OK;
+        while ( err == Z_OK && !ok ) {
+            err = rd.block();
+            if ( err == Z_STREAM_END ) {
+                rd.nextMember();
+                ok = rd.ipos() == mSize;
+                err = Z_OK;
+            }
+        }
+    } catch ( std::exception& e ) {
+        // ran out of file, or a bad header
+    }
+    if ( !ok ) {
+        throw std::runtime_error( "it doesn't match " + mFH.path() );
+    }
+
+    mEnd = last.uoff + rd.obytes();
+    if ( mEnd == last.uoff && mPoints.size() > 1 ) {
+        mPoints.pop_back();     // nothing after it
+    }
+}
+
+void GzipImporter::run( GzipIndexer::Output& out,
+                        off_t&               uend,
+                        off_t&               cend )
+{
+    for ( size_t i = 0; i < mPoints.size(); ++i ) {
+        const Point& p = mPoints[i];
+        GzipIndexer::Checkpoint point( p.uoff, p.coff, p.bits, p.member );
+        window( p, point.window );
+        out.add( point );
+    }
+    uend = mEnd;
+    cend = mSize;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Buffer.h"
+#include "FileHandle.h"
+#include "GzipIndexer.h"
+
+
+/**
+ * Reads the access points from a gzip index made by another tool, so we
+ * needn't decompress the whole file to build our own.
+ *
+ * We understand the index beside a file from:
+ *   bgzip -i       FILE.gz.gzi, the start of each BGZF member
+ *   gztool         FILE.gzi or FILE.gz.gzi, points with compressed windows
+ *   indexed_gzip   FILE.gzidx or FILE.gz.gzidx, points with raw windows
+ *
+ * The points are all read up front, and the file is decoded from the last
+ * one to its end, to check the index fits the file and find how big it is.
+ * Windows are read one at a time as each point is passed on.
+ */
+class GzipImporter
+{
+public:
+    GzipImporter( const FileHandle& fh );
+
+    // Look for an index we can use, false if there's none
+    bool find();
+
+    // The index we found, and which tool made it
+    const std::string& path() const { return mIndex.path(); }
+
+    const char * tool() const { return mTool; }
+
+    // Pass on each checkpoint in order, and where the file ends
+    void run( GzipIndexer::Output& out,
+              off_t&               uend,
+              off_t&               cend );
+
+protected:
+    struct Point
+    {
+        off_t uoff, coff;
+        uint8_t bits;
+        bool member;
+        uint64_t window;        // where it is in the index
+        uint32_t wsize;         // zero for none
+
+        Point( off_t    u = 0,
+               off_t    c = 0,
+               uint8_t  b = 0,
+               uint64_t w = 0,
+               uint32_t ws = 0 ) :
+            uoff( u ),
+            coff( c ),
+            bits( b ),
+            member( false ),
+            window( w ),
+            wsize( ws ) { }
+    };
+
+    const FileHandle& mFH;
+    off_t mSize;
+    FileHandle mIndex;
+    const char *mTool;
+    bool mPacked;               // windows are zlib streams
+    std::vector<Point> mPoints;
+    off_t mEnd;                 // uncompressed size
+
+    // Open an index, if it's there and no older than the file
+    bool open( const std::string& path );
+
+    // Each false if the index isn't in that format
+    bool readBgzip();
+
+    bool readGztool();
+
+    bool readIndexedGzip();
+
+    // Check the points make sense, and note which start at a header
+    bool check();
+
+    void window( const Point& p,
+                 Buffer&      buf ) const;
+
+    // Decode from the last point to the end, to find our size
+    void tail();
+};
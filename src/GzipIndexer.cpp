@@ -0,0 +1,506 @@
+#include "GzipIndexer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "GzipFile.h"
+#include "GzipReader.h"
+
+
+off_t GzipIndexer::gChunkSize = 8 * 1024 * 1024;
+
+namespace {
+
+const size_t npos = size_t( -1 );
+
+// 57 bits starting at bit, from a buffer padded by at least eight bytes
+uint64_t peekBits( const Buffer& buf,
+                   size_t        bit )
+{
+    uint64_t word = 0;
+    for ( size_t i = 0; i < sizeof( word ); ++i ) {
+        word |= uint64_t( buf[bit / 8 + i] ) << ( 8 * i );
+    }
+    return word >> ( bit % 8 );
+}
+
+// Could a non-final dynamic block start here? Checks the header fields zlib
+// would, and that the code length code is complete.
+bool plausibleBlock( const Buffer& buf,
+                     size_t        bit )
+{
+    uint64_t word = peekBits( buf, bit );
+    if ( ( word & 7 ) != 4 ) {          // BFINAL = 0, BTYPE = 2
+        return false;
+    }
+    if ( ( ( word >> 3 ) & 31 ) > 29 || ( ( word >> 8 ) & 31 ) > 29 ) {
+        return false;                   // too many length or distance codes
+    }
+    size_t codes = ( ( word >> 13 ) & 15 ) + 4;
+
+    word = peekBits( buf, bit + 17 );
+    unsigned kraft = 0;
+    for ( size_t i = 0; i < codes; ++i ) {
+        unsigned len = ( word >> ( 3 * i ) ) & 7;
+        if ( len ) {
+            kraft += 128 >> len;
+        }
+    }
+    return kraft == 128;
+}
+
+// Keeps just the first window of output, then stops
+class PrefixReader : public ScanningGzipReader
+{
+public:
+    PrefixReader( const FileHandle& fh,
+                  off_t             coff,
+                  size_t            bits,
+                  const Buffer&     dict ) :
+        ScanningGzipReader( fh, coff, bits, Raw, dict ) { }
+
+    // Leave the buffer full, so inflate stops
+    void writeOut() override { }
+
+    const Buffer& output() const { return mOutBuf; }
+};
+
+}
+
+void GzipIndexer::Job::operator()()
+{
+    {
+        Lock lock( indexer->mCond );
+        if ( indexer->mCancelled ) {
+            return;
+        }
+    }
+
+    try {
+        run();
+    } catch ( std::exception& e ) {
+        error = e.what();
+    }
+}
+
+void GzipIndexer::Job::release()
+{
+    Lock lock( indexer->mCond );
+    done = true;
+    --indexer->mRunning;
+    indexer->mCond.broadcast();
+}
+
+void GzipIndexer::ScanJob::run()
+{
+    GzipIndexer& idx = *indexer;
+    if ( begin == 0 ) {
+        // The start of the file is the one place we're sure of
+        start = Boundary( 0, 0, 0, true );
+        if ( !idx.scan( start, false, end, bounds, last, eof ) ) {
+            throw std::runtime_error( "gzip decode error" );
+        }
+        found = true;
+    } else {
+        found = idx.findStart( begin, end, start )
+                && idx.scan( start, true, end, bounds, last, eof );
+    }
+
+    if ( found ) {
+        idx.test( bounds );
+    } else {
+        bounds.clear();
+    }
+}
+
+void GzipIndexer::WindowJob::run()
+{
+    const FileHandle& fh = indexer->mFH;
+    const Buffer none;
+    for ( size_t w = 0; w < ( literal() ? 1 : 2 ); ++w ) {
+        ScanningGzipReader rd( fh, start.coff, start.bits,
+                               literal() ? ScanningGzipReader::Gzip : ScanningGzipReader::Raw,
+                               literal() ? none : positionWindow( w ) );
+        windows[w].resize( uoffs.size() );
+        for ( size_t i = 0; i < uoffs.size(); ++i ) {
+            while ( start.uoff + rd.obytes() < uoffs[i] ) {
+                int err = rd.block();
+                if ( err == Z_STREAM_END ) {
+                    rd.nextMember();
+                } else if ( err != Z_OK ) {
+                    throw std::runtime_error( "gzip decode error" );
+                }
+            }
+            rd.copyWindow( windows[w][i] );
+        }
+    }
+}
+
+GzipIndexer::GzipIndexer( const FileHandle& fh,
+                          ThreadPool&       pool ) :
+    mFH( fh ),
+    mPool( pool ),
+    mSize( fh.size() ),
+    mMinDictSpacing( GzipFile::gMinDictBlockFactor * GzipFile::WindowSize ),
+    mRunning( 0 ),
+    mCancelled( false ) { }
+
+GzipIndexer::~GzipIndexer()
+{
+    // Our jobs refer to us, so wait for them to finish
+    Lock lock( mCond );
+    mCancelled = true;
+    while ( mRunning ) {
+        mCond.wait();
+    }
+}
+
+const Buffer& GzipIndexer::positionWindow( size_t which )
+{
+    // A byte copied from position i gives ( i & 0xff ) from the first, and
+    // something different from the second. Literals are the same in both.
+    struct Windows
+    {
+        Buffer w[2];
+
+        Windows()
+        {
+            for ( size_t i = 0; i < GzipFile::WindowSize; ++i ) {
+                w[0].push_back( i & 0xff );
+                w[1].push_back( ( i + ( i >> 8 ) + 1 ) & 0xff );
+            }
+        }
+    };
+    static const Windows windows;
+    return windows.w[which];
+}
+
+void GzipIndexer::prune( const FileHandle& fh,
+                         off_t             coff,
+                         size_t            bits,
+                         Buffer&           window )
+{
+    // Only the first window of output can reach back before the checkpoint
+    const size_t size = GzipFile::WindowSize;
+    Buffer out[2];
+    for ( size_t w = 0; w < 2; ++w ) {
+        PrefixReader rd( fh, coff, bits, positionWindow( w ) );
+        int err;
+        do {
+            err = rd.block();
+        } while ( err == Z_OK && rd.obytes() < off_t( size ) );
+        if ( err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR ) {
+            throw std::runtime_error( "gzip decode error" );
+        }
+        out[w].assign( rd.output().begin(), rd.output().begin() + rd.obytes() );
+    }
+
+    std::vector<bool> used( size );
+    size_t first = size;
+    for ( size_t j = 0; j < out[0].size(); ++j ) {
+        const uint8_t a = out[0][j], b = out[1][j];
+        if ( a != b ) {
+            const size_t pos = ( ( ( b - a - 1 ) & 0xff ) << 8 ) | a;
+            used[pos] = true;
+            first = std::min( first, pos );
+        }
+    }
+
+    // Windows shorter than usual end where the output starts
+    const size_t skip = size - window.size();
+    for ( size_t i = std::max( first, skip ); i < size; ++i ) {
+        if ( !used[i] ) {
+            window[i - skip] = 0;
+        }
+    }
+    window.erase( window.begin(), window.begin() + ( std::max( first, skip ) - skip ) );
+}
+
+bool GzipIndexer::findStart( off_t     begin,
+                             off_t     end,
+                             Boundary& start ) const
+{
+    Buffer buf;
+    mFH.tryPRead( begin, buf, end - begin );
+    const size_t bits = buf.size() * 8;
+    buf.resize( buf.size() + 16 );
+
+    for ( size_t bit = 0; bit < bits; ++bit ) {
+        if ( !plausibleBlock( buf, bit ) ) {
+            continue;
+        }
+
+        // Make sure it decodes, and the next block does too
+        Boundary b( 0, begin + ( bit + 7 ) / 8, ( 8 - bit % 8 ) % 8 );
+        try {
+            ScanningGzipReader rd( mFH, b.coff, b.bits, ScanningGzipReader::Raw,
+                                   positionWindow( 0 ) );
+            int err = Z_OK;
+            for ( size_t i = 0; i < 2 && err == Z_OK; ++i ) {
+                err = rd.block();
+            }
+            if ( err == Z_OK || err == Z_STREAM_END ) {
+                start = b;
+                return true;
+            }
+        } catch ( std::exception& e ) {
+            // just keep going
+        }
+    }
+    return false;
+}
+
+bool GzipIndexer::scan( const Boundary& start,
+                        bool            include,
+                        off_t           limit,
+                        Boundaries&     bounds,
+                        Boundary&       last,
+                        bool&           eof ) const
+{
+    if ( include ) {
+        bounds.push_back( start );
+    }
+
+    const Buffer none;
+    ScanningGzipReader rd( mFH, start.coff, start.bits,
+                           start.member ? ScanningGzipReader::Gzip : ScanningGzipReader::Raw,
+                           start.member ? none : positionWindow( 0 ) );
+    eof = false;
+    while ( true ) {
+        int err = rd.block();
+        bool member = false;
+        if ( err == Z_STREAM_END ) {
+            rd.nextMember();
+            if ( rd.ipos() == mSize ) {
+                eof = true;
+                last = Boundary( start.uoff + rd.obytes(), rd.ipos() );
+                return true;
+            }
+            member = true;
+        } else if ( err != Z_OK ) {
+            return false;
+        }
+
+        // We can't start from the end of a member's last block, since a
+        // footer follows, so keep going to the next member
+        Boundary b( start.uoff + rd.obytes(), rd.ipos(), rd.ibits(), member );
+        if ( b.coff >= limit && ( member || !rd.lastBlock() ) ) {
+            last = b;
+            return true;
+        }
+        bounds.push_back( b );
+    }
+}
+
+void GzipIndexer::test( Boundaries& bounds ) const
+{
+    // Same as the serial scan: independent if we get a window's worth of
+    // output without one
+    const Buffer none;
+    for ( Boundaries::iterator b = bounds.begin(); b != bounds.end(); ++b ) {
+        ScanningGzipReader rd( mFH, b->coff, b->bits, ScanningGzipReader::Raw, none );
+        while ( true ) {
+            int err = rd.block();
+            if ( err != Z_OK && err != Z_STREAM_END ) {
+                b->kind = Dependent;
+                break;
+            }
+            if ( rd.obytes() > off_t( GzipFile::WindowSize ) || err == Z_STREAM_END ) {
+                b->kind = Independent;
+                break;
+            }
+            if ( rd.obytes() == 0 ) {
+                b->kind = Empty;
+                break;
+            }
+        }
+    }
+}
+
+void GzipIndexer::enqueue( Job* job )
+{
+    {
+        Lock lock( mCond );
+        ++mRunning;
+    }
+    mPool.enqueue( job );
+}
+
+void GzipIndexer::wait( Job& job )
+{
+    {
+        Lock lock( mCond );
+        while ( !job.done ) {
+            mCond.wait();
+        }
+    }
+    if ( !job.error.empty() ) {
+        throw std::runtime_error( job.error );
+    }
+}
+
+void GzipIndexer::resolve( std::vector<Checkpoint>& points )
+{
+    std::unique_ptr<WindowJob> job( std::move( mWindows.front() ) );
+    mWindows.pop_front();
+    wait( *job );
+
+    const size_t size = GzipFile::WindowSize;
+    Buffer next;
+    for ( size_t i = 0; i < job->uoffs.size(); ++i ) {
+        // Anything from before the chunk comes straight from its window
+        Buffer win( size );
+        size_t n = job->uoffs[i] - job->start.uoff;
+        size_t old = n < size ? size - n : 0;
+        std::copy( mWindow.begin() + size - old, mWindow.end(), win.begin() );
+
+        const Buffer& a = job->windows[0][i];
+        const Buffer& b = job->literal() ? a : job->windows[1][i];
+        for ( size_t j = old; j < size; ++j ) {
+            if ( a[j] == b[j] ) {
+                win[j] = a[j];
+            } else {
+                win[j] = mWindow[( ( ( b[j] - a[j] - 1 ) & 0xff ) << 8 ) | a[j]];
+            }
+        }
+
+        if ( job->points[i] == npos ) {
+            next.swap( win );
+        } else {
+            points[job->points[i]].window.swap( win );
+        }
+    }
+    mWindow.swap( next );
+}
+
+void GzipIndexer::flush( std::vector<Checkpoint>& points,
+                         size_t&                  done,
+                         Output&                  out ) const
+{
+    const size_t end = mWindows.empty() ? points.size() : mWindows.front()->first;
+    for ( ; done < end; ++done ) {
+        out.add( points[done] );
+    }
+}
+
+void GzipIndexer::run( Output& out,
+                       off_t&  uend,
+                       off_t&  cend )
+{
+    const size_t ahead = 2 * mPool.threads();
+    std::vector<Checkpoint> points;
+    size_t done = 0;            // passed on to out
+    off_t queued = 0;           // where the next scan starts
+    Boundary cur;               // the first boundary of the next chunk
+    off_t lastIdx = 0;
+    bool eof = false;
+
+    mWindow.assign( GzipFile::WindowSize, 0 );
+    while ( !eof ) {
+        while ( mScans.size() < ahead && queued < mSize ) {
+            off_t end = std::min( queued + gChunkSize, mSize );
+            mScans.emplace_back( new ScanJob( *this, queued, end ) );
+            enqueue( mScans.back().get() );
+            queued = end;
+        }
+        if ( mScans.empty() ) {
+            throw std::runtime_error( "gzip decode error" );
+        }
+
+        std::unique_ptr<ScanJob> job( std::move( mScans.front() ) );
+        mScans.pop_front();
+        wait( *job );
+
+        Boundaries bounds;
+        Boundary last, start = cur;
+        bool chunkEof = false;
+        if ( job->begin == 0 ) {
+            start = job->start;
+            bounds.swap( job->bounds );
+            last = job->last;
+            chunkEof = job->eof;
+        } else if ( cur.coff >= job->end ) {
+            continue;                   // no block starts in this chunk
+        } else if ( job->found && job->start.sameStart( cur ) ) {
+            bounds.swap( job->bounds );
+            last = job->last;
+            chunkEof = job->eof;
+            for ( Boundaries::iterator b = bounds.begin(); b != bounds.end(); ++b ) {
+                b->uoff += cur.uoff;
+            }
+            last.uoff += cur.uoff;
+        } else {
+            // We guessed wrong, or missed some blocks, so carry on from the
+            // end of the previous chunk
+            bool guess = job->found && job->start.coff > cur.coff;
+            off_t limit = guess ? job->start.coff : job->end;
+            if ( !scan( cur, true, limit, bounds, last, chunkEof ) ) {
+                throw std::runtime_error( "gzip decode error" );
+            }
+            test( bounds );
+
+            if ( guess && !chunkEof ) {
+                Boundary from = last;
+                if ( from.sameStart( job->start ) ) {
+                    for ( Boundaries::iterator b = job->bounds.begin();
+                          b != job->bounds.end(); ++b )
+                    {
+                        b->uoff += from.uoff;
+                        bounds.push_back( *b );
+                    }
+                    last = job->last;
+                    last.uoff += from.uoff;
+                    chunkEof = job->eof;
+                } else {
+                    size_t tested = bounds.size();
+                    if ( !scan( from, true, job->end, bounds, last, chunkEof ) ) {
+                        throw std::runtime_error( "gzip decode error" );
+                    }
+                    Boundaries rest( bounds.begin() + tested, bounds.end() );
+                    test( rest );
+                    std::copy( rest.begin(), rest.end(), bounds.begin() + tested );
+                }
+            }
+        }
+
+        // Pick access points like the serial scan does, asking for windows
+        // where they're needed
+        std::unique_ptr<WindowJob> wjob( new WindowJob( *this, start, points.size() ) );
+        for ( Boundaries::iterator b = bounds.begin(); b != bounds.end(); ++b ) {
+            if ( b->kind == Independent ) {
+                points.push_back( Checkpoint( b->uoff, b->coff, b->bits ) );
+                lastIdx = b->uoff;
+            } else if ( b->kind == Dependent && b->uoff - lastIdx > mMinDictSpacing ) {
+                wjob->uoffs.push_back( b->uoff );
+                wjob->points.push_back( points.size() );
+                points.push_back( Checkpoint( b->uoff, b->coff, b->bits ) );
+                lastIdx = b->uoff;
+            }
+        }
+
+        cur = last;
+        if ( chunkEof ) {
+            uend = last.uoff;
+            cend = last.coff;
+            eof = true;
+        } else {
+            wjob->uoffs.push_back( last.uoff );
+            wjob->points.push_back( npos );
+        }
+
+        if ( !wjob->uoffs.empty() ) {
+            mWindows.emplace_back( wjob.release() );
+            enqueue( mWindows.back().get() );
+        }
+        while ( mWindows.size() > ahead ) {
+            resolve( points );
+        }
+        flush( points, done, out );
+    }
+
+    while ( !mWindows.empty() ) {
+        resolve( points );
+    }
+    flush( points, done, out );
+}
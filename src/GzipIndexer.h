@@ -0,0 +1,217 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Buffer.h"
+#include "FileHandle.h"
+#include "ThreadPool.h"
+
+
+/**
+ * Finds a gzip file's access points with a thread pool, picking the same
+ * ones GzipFile's serial scan would.
+ *
+ * The file is split into chunks, and each chunk is searched for something
+ * that looks like the start of a dynamic deflate block. From there it's
+ * decoded against a made-up window, since where blocks end doesn't depend
+ * on what the window holds, and each block boundary is tested to see if
+ * it can be decoded without one. The chunks are joined up in order, checking
+ * each started where the previous one ended, and access points are picked
+ * from the boundaries.
+ *
+ * Points that need a window get it by decoding their chunk again against
+ * two windows, which together encode each byte's position. Comparing the
+ * two outputs tells literals apart from bytes copied out of the chunk's
+ * initial window, and where from. Once the previous chunk's window is
+ * known, the rest follows cheaply and in order.
+ */
+class GzipIndexer
+{
+public:
+    struct Checkpoint
+    {
+        off_t uoff, coff;
+        size_t bits;
+        bool member;            // at a gzip header, we never pick these
+        Buffer window;          // empty for an independent block
+
+        Checkpoint( off_t  u = 0,
+                    off_t  c = 0,
+                    size_t b = 0,
+                    bool   m = false ) :
+            uoff( u ),
+            coff( c ),
+            bits( b ),
+            member( m ) { }
+    };
+
+    // Takes the checkpoints as they're finished, in order
+    struct Output
+    {
+        virtual ~Output() { }
+
+        virtual void add( Checkpoint& point ) = 0;
+    };
+
+    static off_t gChunkSize;    // compressed bytes searched by each job
+
+protected:
+    enum Kind
+    {
+        Dependent,              // needs a window
+        Independent,
+        Empty,                  // starts with an empty block, never indexed
+    };
+
+    // A place where the serial scan would consider adding an access point
+    struct Boundary
+    {
+        off_t uoff, coff;
+        uint8_t bits;
+        bool member;            // a gzip member's header starts here
+        Kind kind;
+
+        Boundary( off_t   u = 0,
+                  off_t   c = 0,
+                  uint8_t b = 0,
+                  bool    m = false ) :
+            uoff( u ),
+            coff( c ),
+            bits( b ),
+            member( m ),
+            kind( Dependent ) { }
+
+        bool sameStart( const Boundary& o ) const
+        {
+            return coff == o.coff && bits == o.bits && member == o.member;
+        }
+    };
+    typedef std::vector<Boundary> Boundaries;
+
+    // Our jobs belong to us, and tell us when they're done
+    struct Job : public ThreadPool::Job
+    {
+        GzipIndexer *indexer;
+        bool done;
+        std::string error;
+
+        Job( GzipIndexer& idx ) :
+            indexer( &idx ),
+            done( false ) { }
+
+        void operator()() override;
+
+        void release() override;
+
+        virtual void run() = 0;
+    };
+
+    // Find and test the boundaries in a chunk
+    struct ScanJob : public Job
+    {
+        off_t begin, end;
+        bool found;
+        Boundary start;         // the first boundary, relative uoffs from here
+        Boundaries bounds;
+        Boundary last;          // first boundary past the end
+        bool eof;               // or we reached the end of the file instead
+
+        ScanJob( GzipIndexer& idx,
+                 off_t        b,
+                 off_t        e ) :
+            Job( idx ),
+            begin( b ),
+            end( e ),
+            found( false ),
+            eof( false ) { }
+
+        void run() override;
+    };
+
+    // Get the windows a chunk needs, in terms of the window before it
+    struct WindowJob : public Job
+    {
+        Boundary start;
+        size_t first;           // checkpoints before this don't need us
+        std::vector<off_t> uoffs;       // ascending
+        std::vector<size_t> points;     // which checkpoint, or npos
+        std::vector<Buffer> windows[2];
+
+        WindowJob( GzipIndexer&    idx,
+                   const Boundary& s,
+                   size_t          f ) :
+            Job( idx ),
+            start( s ),
+            first( f ) { }
+
+        bool literal() const { return start.member; }
+
+        void run() override;
+    };
+
+    const FileHandle& mFH;
+    ThreadPool& mPool;
+    off_t mSize;
+    off_t mMinDictSpacing;
+
+    std::deque<std::unique_ptr<ScanJob> > mScans;
+    std::deque<std::unique_ptr<WindowJob> > mWindows;
+    Buffer mWindow;             // before the oldest window job
+
+    ConditionVariable mCond;    // guards everything below
+    size_t mRunning;            // jobs queued or running
+    bool mCancelled;
+
+    // The windows that encode byte positions
+    static const Buffer& positionWindow( size_t which );
+
+    // A place to start decoding in [begin, end), or false
+    bool findStart( off_t     begin,
+                    off_t     end,
+                    Boundary& start ) const;
+
+    // Decode from start until a boundary at or past limit, collecting the
+    // ones before it. False on a decode error.
+    bool scan( const Boundary& start,
+               bool            include,
+               off_t           limit,
+               Boundaries&     bounds,
+               Boundary&       last,
+               bool&           eof ) const;
+
+    // Set each boundary's kind
+    void test( Boundaries& bounds ) const;
+
+    void enqueue( Job* job );
+
+    void wait( Job& job );
+
+    // Fill in the windows from the oldest window job
+    void resolve( std::vector<Checkpoint>& points );
+
+    // Pass on the checkpoints no window job is still working on
+    void flush( std::vector<Checkpoint>& points,
+                size_t&                  done,
+                Output&                  out ) const;
+
+public:
+    GzipIndexer( const FileHandle& fh,
+                 ThreadPool&       pool );
+
+    ~GzipIndexer();
+
+    // Zero the bytes of a checkpoint's window that decoding from it never
+    // copies, and drop those before the first one it does
+    static void prune( const FileHandle& fh,
+                       off_t             coff,
+                       size_t            bits,
+                       Buffer&           window );
+
+    // Find every checkpoint in order, and where the file ends
+    void run( Output& out,
+              off_t&  uend,
+              off_t&  cend );
+};
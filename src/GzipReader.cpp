@@ -1,5 +1,6 @@
 #include "GzipReader.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
@@ -36,7 +37,7 @@ void GzipReaderBase::setDict( const Buffer& dict )
 {
     initialize();
     if ( !dict.empty() ) {
-        CHECK_ZLIB( inflateSetDictionary( &mStream, &dict[0], dict.size() ) );
+        CHECK_ZLIB( inflateSetDictionary( mStream, &dict[0], dict.size() ) );
     }
 }
 
@@ -45,25 +46,25 @@ void GzipReaderBase::prime( uint8_t byte,
 {
     initialize();
     if ( bits != 0 ) {
-        CHECK_ZLIB( inflatePrime( &mStream, bits, byte >> ( 8 - bits ) ) );
+        CHECK_ZLIB( inflatePrime( mStream, bits, byte >> ( 8 - bits ) ) );
     }
 }
 
 int GzipReaderBase::step( int flush )
 {
     initialize();
-    if ( mStream.avail_in == 0 ) {
+    if ( mStream->avail_in == 0 ) {
         moreData( mInput );
-        mStream.avail_in = mInput.size();
-        mStream.next_in = &mInput[0];
+        mStream->avail_in = mInput.size();
+        mStream->next_in = &mInput[0];
     }
-    if ( mStream.avail_out == 0 ) {
+    if ( mStream->avail_out == 0 ) {
         writeOut();
     }
 
-    mOutBytes += mStream.avail_out;
-    int err = inflate( &mStream, flush );
-    mOutBytes -= mStream.avail_out;
+    mOutBytes += mStream->avail_out;
+    int err = inflate( mStream, flush );
+    mOutBytes -= mStream->avail_out;
     return err;
 }
 
@@ -82,29 +83,63 @@ void GzipReaderBase::initialize()
         return;
     }
 
-    CHECK_ZLIB( inflateInit2( &mStream, wrapper() ) );
+    CHECK_ZLIB( inflateReset2( mStream, wrapper() ) );
     resetOutBuf();
 
     mInitialized = true;
 }
 
+void GzipReaderBase::nextMember( off_t&   pos,
+                                 Wrapper& wrap )
+{
+    if ( wrap == Raw ) {
+        const size_t footerSize = 8;
+        if ( mStream->avail_in < footerSize ) {
+            pos += footerSize - mStream->avail_in;
+            mStream->avail_in = 0;
+        } else {
+            mStream->avail_in -= footerSize;
+            mStream->next_in += footerSize;
+        }
+    }
+    wrap = Gzip;
+    CHECK_ZLIB( inflateReset2( mStream, wrap ) );
+}
+
 size_t GzipReaderBase::chunkSize() const
 {
     return CompressedFile::ChunkSize;
 }
 
-GzipReaderBase::GzipReaderBase()
+Inflater::Inflater()
 {
-    mStream.zfree = Z_NULL;
-    mStream.zalloc = Z_NULL;
-    mStream.opaque = Z_NULL;
-    mStream.avail_in = 0;
+    stream.zfree = Z_NULL;
+    stream.zalloc = Z_NULL;
+    stream.opaque = Z_NULL;
+    stream.next_in = Z_NULL;
+    stream.avail_in = 0;
+    CHECK_ZLIB( inflateInit2( &stream, GzipReaderBase::Raw ) );
+}
+
+GzipReaderBase::GzipReaderBase() :
+    mInflater( InflaterCache::get() ),
+    mStream( &mInflater->stream )
+{
+    mStream->avail_in = 0;
+    mInput.swap( mInflater->input );
+}
+
+GzipReaderBase::~GzipReaderBase()
+{
+    mInput.swap( mInflater->input );
+    InflaterCache::put( mInflater );
 }
 
 void GzipReaderBase::swap( GzipReaderBase& o )
 {
     initialize();
     o.initialize();
+    std::swap( mInflater, o.mInflater );
     std::swap( mStream, o.mStream );
     std::swap( mInput, o.mInput );
     std::swap( mOutBytes, o.mOutBytes );
@@ -118,7 +153,7 @@ int GzipReaderBase::block()
         if ( ( err != Z_OK ) &&( err != Z_STREAM_END ) ) {
             return err;
         }
-        if ( mStream.data_type & 128 ) {
+        if ( mStream->data_type & 128 ) {
             break;
         }
     } while ( err != Z_STREAM_END );
@@ -132,25 +167,28 @@ void PositionedGzipReader::skipFooter()
         return;         // footer should've been processed
     }
     const size_t footerSize = 8;
-    if ( mStream.avail_in < footerSize ) {
-        mFH.seek( footerSize - mStream.avail_in, SEEK_CUR );
-        mStream.avail_in = 0;
+    if ( mStream->avail_in < footerSize ) {
+        mFH.seek( footerSize - mStream->avail_in, SEEK_CUR );
+        mStream->avail_in = 0;
     } else {
-        mStream.avail_in -= footerSize;
-        mStream.next_in += footerSize;
+        mStream->avail_in -= footerSize;
+        mStream->next_in += footerSize;
     }
 }
 
 } // namespace GzipReaderInternal
 
 GzipBlockReader::GzipBlockReader( const FileHandle& fh,
-                                  Buffer&           ubuf,
+                                  uint8_t*          ubuf,
                                   const Block&      b,
                                   const Buffer&     dict,
-                                  size_t            bits ) :
+                                  size_t            bits,
+                                  Wrapper           wrap ) :
     mOutBuf( ubuf ),
+    mOutSize( b.usize ),
     mCFH( fh ),
-    mPos( b.coff - ( bits ? 1 : 0 ) )
+    mPos( b.coff - ( bits ? 1 : 0 ) ),
+    mWrap( wrap )
 {
     setDict( dict );
     if ( bits ) {
@@ -161,6 +199,32 @@ GzipBlockReader::GzipBlockReader( const FileHandle& fh,
     }
 }
 
+ScanningGzipReader::ScanningGzipReader( const FileHandle& fh,
+                                        off_t             coff,
+                                        size_t            bits,
+                                        Wrapper           wrap,
+                                        const Buffer&     dict ) :
+    mCFH( fh ),
+    mPos( coff - ( bits ? 1 : 0 ) ),
+    mWrap( wrap ),
+    mOutBuf( GzipFile::WindowSize )
+{
+    setDict( dict );
+    if ( bits ) {
+        uint8_t byte;
+        mCFH.pread( mPos, &byte, sizeof( byte ) );
+        mPos += sizeof( byte );
+        prime( byte, bits );
+    }
+}
+
+void ScanningGzipReader::copyWindow( Buffer& buf ) const
+{
+    buf.resize( mOutBuf.size() );
+    std::rotate_copy( mOutBuf.begin(), mOutBuf.end() - mStream->avail_out,
+                      mOutBuf.end(), buf.begin() );
+}
+
 void SavingGzipReader::save()
 {
     if ( !mSave ) {
@@ -174,14 +238,14 @@ void SavingGzipReader::save()
     reset( Raw );
 
     mInput = mSave->mInput;
-    mStream.avail_in = mSave->mStream.avail_in;
-    mStream.next_in = &mInput[0] + mInput.size() - mStream.avail_in;
+    mStream->avail_in = mSave->mStream->avail_in;
+    mStream->next_in = &mInput[0] + mInput.size() - mStream->avail_in;
 
     mOutBuf.resize( windowSize() );
     resetOutBuf();
 
     size_t bits = mSave->ibits();
-    prime( mStream.next_in[-1], bits );
+    prime( mStream->next_in[-1], bits );
 
     mInitOutPos = mSave->opos();
     mOutBytes = 0;
@@ -199,9 +263,9 @@ void SavingGzipReader::restore()
 
 void SavingGzipReader::copyWindow( Buffer& buf )
 {
-    buf.resize( outBuf().size() );
-    std::rotate_copy( outBuf().begin(), outBuf().end() - mStream.avail_out,
-                      outBuf().end(), buf.begin() );
+    buf.resize( mOutBuf.size() );
+    std::rotate_copy( mOutBuf.begin(), mOutBuf.end() - mStream->avail_out,
+                      mOutBuf.end(), buf.begin() );
 }
 
 size_t
@@ -8,6 +8,7 @@
 #include "Buffer.h"
 #include "Debug.h"
 #include "FileHandle.h"
+#include "ThreadCache.h"
 
 
 /**
@@ -21,6 +22,7 @@
  *       GzipHeaderReader
  *       PositionedGzipReader
  *         SavingGzipReader
+ *     ScanningGzipReader
  * @endverbatim
  */
 
@@ -40,6 +42,23 @@ class SavingGzipReader;
 
 namespace GzipReaderInternal {
 
+/**
+ * An inflate stream and input buffer, reset and reused by each reader
+ * rather than set up from scratch. They live on the heap, since zlib
+ * keeps a pointer back to the stream.
+ */
+struct Inflater
+{
+    z_stream stream;
+    Buffer input;
+
+    Inflater();
+
+    ~Inflater() { inflateEnd( &stream ); }
+};
+
+typedef ThreadCache<Inflater> InflaterCache;
+
 /**
  * This is the base class for GzipBlockReader and DiscardingGzipReader
  * and should not be used directly.
@@ -74,14 +93,14 @@ protected:
 
     inline void resetOutBuf()
     {
-        mStream.next_out = &outBuf()[0];
-        mStream.avail_out = outBuf().size();
+        mStream->next_out = outData();
+        mStream->avail_out = outSize();
 
-        if ( mStream.next_out == nullptr ) {
+        if ( mStream->next_out == nullptr ) {
             std::cerr << "Output buffer location is null. Can't work with this!\n";
         }
 
-        if ( mStream.avail_out == 0 ) {
+        if ( mStream->avail_out == 0 ) {
             std::cerr << "Available outbut buffer is empty. Can't work with this!\n";
         }
     }
@@ -98,13 +117,20 @@ protected:
 
     void initialize();
 
+    // Skip past the footer of the member that just ended, ready for the
+    // next one. pos is where we'll next read from.
+    void nextMember( off_t&   pos,
+                     Wrapper& wrap );
+
     virtual void moreData( Buffer& buf ) = 0;
 
     virtual size_t chunkSize() const;
 
     inline virtual Wrapper wrapper() const { return Raw; }
 
-    virtual Buffer& outBuf() = 0;
+    virtual uint8_t* outData() = 0;
+
+    virtual size_t outSize() const = 0;
 
     inline virtual void writeOut()
     {
@@ -134,13 +160,8 @@ protected:
 public:
     GzipReaderBase();
 
-    inline virtual
-    ~GzipReaderBase()
-    {
-        if ( mInitialized ) {
-            inflateEnd( &mStream );
-        }
-    }
+    virtual
+    ~GzipReaderBase();
 
     void
     swap( GzipReaderBase& o );
@@ -151,8 +172,8 @@ public:
     inline virtual void
     reset( Wrapper w )
     {
-        dumpStream( mStream );
-        CHECK_ZLIB( inflateReset2( &mStream, w ) );
+        dumpStream( *mStream );
+        CHECK_ZLIB( inflateReset2( mStream, w ) );
     };
 
     virtual off_t
@@ -161,7 +182,14 @@ public:
     size_t
     ibits() const
     {
-        return mStream.data_type & 7;
+        return mStream->data_type & 7;
+    }
+
+    // Whether the block we just finished was the stream's last
+    bool
+    lastBlock() const
+    {
+        return mStream->data_type & 64;
     }
 
     off_t
@@ -171,7 +199,8 @@ public:
     }
 
 public:
-    z_stream mStream;     /**< libz struct holding the opened gzip stream */
+    Inflater *mInflater;
+    z_stream *mStream;    /**< libz struct holding the opened gzip stream */
     Buffer mInput;
     bool mInitialized = false;
     off_t mOutBytes = 0;
@@ -209,16 +238,22 @@ public:
         resetOutBuf();
     }
 
-    inline Buffer&
-    outBuf() override
+    inline uint8_t*
+    outData() override
+    {
+        return &mOutBuf[0];
+    }
+
+    inline size_t
+    outSize() const override
     {
-        return mOutBuf;
+        return mOutBuf.size();
     }
 
     inline off_t
     ipos() const override
     {
-        return mFH.tell() - mStream.avail_in;
+        return mFH.tell() - mStream->avail_in;
     }
 };
 
@@ -280,7 +315,7 @@ public:
     inline void header( gz_header& hdr )
     {
         initialize();
-        CHECK_ZLIB( inflateGetHeader( &mStream, &hdr ) );
+        CHECK_ZLIB( inflateGetHeader( mStream, &hdr ) );
         while ( !hdr.done ) {
             stepThrow();
         }
@@ -292,16 +327,24 @@ public:
 class GzipBlockReader : public GzipReaderInternal::GzipReaderBase
 {
 protected:
-    Buffer& mOutBuf;
+    uint8_t *mOutBuf;
+    size_t mOutSize;
     const FileHandle& mCFH;
     off_t mPos;
+    Wrapper mWrap;
+
+    Wrapper wrapper() const override { return mWrap; }
 
 public:
+    // Reads exactly b.usize bytes into ubuf, following on into any further
+    // gzip members. With a Gzip wrapper, the block starts at a member's
+    // header, and has no dict.
     GzipBlockReader( const FileHandle& fh,
-                     Buffer&           ubuf,
+                     uint8_t*          ubuf,
                      const Block&      b,
                      const Buffer&     dict,
-                     size_t            bits );
+                     size_t            bits,
+                     Wrapper           wrap = Raw );
 
     void moreData( Buffer& buf ) override
     {
@@ -312,12 +355,26 @@ public:
     inline void
     read()
     {
-        while ( mStream.avail_out ) {
-            stepThrow( Z_NO_FLUSH );
+        while ( mStream->avail_out ) {
+            if ( stepThrow( Z_NO_FLUSH ) == Z_STREAM_END && mStream->avail_out ) {
+                nextMember( mPos, mWrap );
+            }
         }
     }
 
-    Buffer& outBuf() override { return mOutBuf; }
+    // Continue into a different buffer
+    inline void
+    read( uint8_t* buf,
+          size_t   size )
+    {
+        mOutBuf = buf;
+        mOutSize = size;
+        resetOutBuf();
+        read();
+    }
+
+    uint8_t* outData() override { return mOutBuf; }
+    size_t outSize() const override { return mOutSize; }
     off_t ipos() const override { return mPos; }
 };
 
@@ -355,3 +412,44 @@ protected:
     size_t
     windowSize() const;
 };
+
+
+// Decodes from any block boundary with positioned reads, so several can work
+// on one file at once. Keeps the last window of output.
+class ScanningGzipReader : public GzipReaderInternal::GzipReaderBase
+{
+protected:
+    const FileHandle& mCFH;
+    off_t mPos;
+    Wrapper mWrap;
+    Buffer mOutBuf;
+
+    Wrapper wrapper() const override { return mWrap; }
+
+public:
+    // With a Gzip wrapper, coff is the start of a member's header. Otherwise
+    // it's a raw deflate block, following dict.
+    ScanningGzipReader( const FileHandle& fh,
+                        off_t             coff,
+                        size_t            bits,
+                        Wrapper           wrap,
+                        const Buffer&     dict );
+
+    void moreData( Buffer& buf ) override
+    {
+        mCFH.tryPRead( mPos, buf, chunkSize() );
+        mPos += buf.size();
+    }
+
+    void writeOut() override { resetOutBuf(); }
+
+    uint8_t* outData() override { return &mOutBuf[0]; }
+    size_t outSize() const override { return mOutBuf.size(); }
+    off_t ipos() const override { return mPos - mStream->avail_in; }
+
+    // Once a member ends, get ready for the next
+    void nextMember() { GzipReaderBase::nextMember( mPos, mWrap ); }
+
+    // The last window of output, oldest first
+    void copyWindow( Buffer& buf ) const;
+};
@@ -0,0 +1,159 @@
+#include "GzipWindows.h"
+
+#include <atomic>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "LRUMap.h"
+#include "ThreadPool.h"
+
+size_t GzipWindows::gCacheSize = 64 * 1024 * 1024;
+
+namespace {
+
+// Keys are our ID above the window's index
+typedef uint64_t Key;
+
+struct KeyHasher
+{
+    size_t operator()( Key k ) const { return k * 0x9E3779B97F4A7C15ULL; }
+};
+
+struct Cache
+{
+    Mutex mutex;
+    LRUMap<Key, GzipWindows::Ptr, KeyHasher> map;
+
+    Cache() :
+        map( GzipWindows::gCacheSize ) { }
+};
+
+// Created on first use, once options are parsed
+Cache& cache()
+{
+    static Cache *c = new Cache();
+    return *c;
+}
+
+std::atomic<uint64_t> gNextID( 1 );
+
+}
+
+GzipWindows::GzipWindows() :
+    mID( gNextID++ ) { }
+
+void GzipWindows::add( const Buffer& window )
+{
+    uLongf size = compressBound( window.size() );
+    std::shared_ptr<Buffer> packed = std::make_shared<Buffer>( size );
+    if ( compress2( packed->data(), &size, window.data(), window.size(),
+                    Z_BEST_COMPRESSION ) != Z_OK ) {
+        throw std::runtime_error( "can't compress gzip window" );
+    }
+    packed->resize( size );
+    packed->shrink_to_fit();
+    mWindows.push_back( packed );
+}
+
+GzipWindows::Ptr GzipWindows::stored( size_t i ) const
+{
+    if ( mWindows[i] ) {
+        return mWindows[i];
+    }
+
+    const Paged& p = mPaged[i];
+    std::shared_ptr<Buffer> w = std::make_shared<Buffer>();
+    mFile->pread( p.offset, *w, p.size );
+    if ( crc32( 0, w->data(), w->size() ) != p.crc ) {
+        throw std::runtime_error( "damaged window in " + mFile->path() );
+    }
+    return w;
+}
+
+GzipWindows::Ptr GzipWindows::get( size_t i ) const
+{
+    Cache& c = cache();
+    const Key key = ( mID << 32 ) | i;
+    {
+        Lock lock( c.mutex );
+        if ( Ptr *found = c.map.find( key ) ) {
+            return *found;
+        }
+    }
+
+    // Others may decompress it too, but that's rare and harmless
+    const Ptr packed = stored( i );
+    uLongf size = 1 << MAX_WBITS;
+    std::shared_ptr<Buffer> w = std::make_shared<Buffer>( size );
+    if ( uncompress( w->data(), &size, packed->data(), packed->size() ) != Z_OK ) {
+        throw std::runtime_error( "damaged gzip window" );
+    }
+    w->resize( size );
+
+    Lock lock( c.mutex );
+    if ( w->size() <= c.map.maxWeight() ) {
+        c.map.add( key, w, w->size() );
+    }
+    return w;
+}
+
+size_t GzipWindows::memory() const
+{
+    size_t size = mWindows.capacity() * sizeof( Ptr ) + mPaged.capacity() * sizeof( Paged );
+    for ( size_t i = 0; i < mWindows.size(); ++i ) {
+        if ( mWindows[i] ) {
+            size += mWindows[i]->capacity();
+        }
+    }
+    return size;
+}
+
+void GzipWindows::write( IndexWriter& out ) const
+{
+    Buffer table;
+    IndexWriter tout( table );
+    std::vector<Ptr> packed( size() );
+    for ( size_t i = 0; i < size(); ++i ) {
+        const Ptr& w = packed[i] = stored( i );
+        tout.varint( w->size() );
+        tout.fixed( crc32( 0, w->data(), w->size() ), 4 );
+    }
+    out.fixed( table.size(), 8 );
+    out.bytes( table );
+    for ( size_t i = 0; i < size(); ++i ) {
+        out.bytes( *packed[i] );
+    }
+}
+
+void GzipWindows::page( const FileHandle& fh,
+                        uint64_t          offset,
+                        uint64_t          size )
+{
+    Buffer head;
+    fh.pread( offset, head, 8 );
+    const uint64_t tsize = IndexReader( head.data(), head.size() ).fixed( 8 );
+    if ( tsize > size - 8 ) {
+        throw IndexReader::Exception( "truncated index" );
+    }
+
+    Buffer table;
+    fh.pread( offset + 8, table, tsize );
+    IndexReader in( table.data(), table.size() );
+    std::vector<Paged> paged;
+    uint64_t pos = offset + 8 + tsize;
+    while ( in.remain() ) {
+        const uint32_t wsize = in.varint(), crc = in.fixed( 4 );
+        paged.push_back( Paged( pos, wsize, crc ) );
+        pos += wsize;
+    }
+    if ( pos > offset + size ) {
+        throw IndexReader::Exception( "truncated index" );
+    }
+
+    std::shared_ptr<FileHandle> file = std::make_shared<FileHandle>();
+    file->dup( fh );
+    mPaged.swap( paged );
+    mFile = file;
+    mWindows.assign( mPaged.size(), Ptr() );
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <stdint.h>
+
+#include "Buffer.h"
+#include "FileHandle.h"
+#include "IndexStream.h"
+
+
+/**
+ * The windows that gzip access points need to start decoding.
+ *
+ * Windows are stored compressed, usually with most of their bytes zeroed
+ * since nothing refers to them, so they're far smaller than 32 KiB. They're
+ * decompressed when a block needs one, into a cache shared by all files.
+ *
+ * Windows are kept in memory while an index is built, or read from an old
+ * index file. Once an index file has them, they're paged in from it only
+ * when needed, so the memory they use stays bounded however large the
+ * archive.
+ *
+ * In the index file, a table of each window's size and checksum is followed
+ * by the windows themselves, so we can find them without reading them all.
+ */
+class GzipWindows
+{
+public:
+    typedef std::shared_ptr<const Buffer> Ptr;
+
+    static size_t gCacheSize;   // most bytes of decompressed windows to keep
+
+protected:
+    // Where a window is in the index file
+    struct Paged
+    {
+        uint64_t offset;
+        uint32_t size, crc;
+
+        Paged( uint64_t o = 0,
+               uint32_t s = 0,
+               uint32_t c = 0 ) :
+            offset( o ),
+            size( s ),
+            crc( c ) { }
+    };
+
+    std::vector<Ptr> mWindows;          // compressed, null if paged
+    std::vector<Paged> mPaged;
+    std::shared_ptr<FileHandle> mFile;  // to page from
+    uint64_t mID;                       // for the cache
+
+    // A compressed window, which may be paged in
+    Ptr stored( size_t i ) const;
+
+public:
+    GzipWindows();
+
+    size_t size() const { return mWindows.size(); }
+
+    void add( const Buffer& window );
+
+    // A window, ready to decode with
+    Ptr get( size_t i ) const;
+
+    // Memory used, not counting the cache
+    size_t memory() const;
+
+    void write( IndexWriter& out ) const;
+
+    // Page our windows from an index file, from the table at offset. Any
+    // we had must be the same ones.
+    void page( const FileHandle& fh,
+               uint64_t          offset,
+               uint64_t          size );
+};
@@ -0,0 +1,131 @@
+#include "IndexDir.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "PathUtils.h"
+
+std::string IndexDir::gDir;
+uint64_t IndexDir::gMaxSize = uint64_t( 1024 ) * 1024 * 1024;
+
+namespace {
+
+const char IndexSuffix[] = ".blockIdx";
+const char TempSuffix[] = ".tmp";
+
+const size_t SampleSize = 4096;
+
+// Temporary files this old were left by a writer that went away
+const time_t StaleTemp = 24 * 60 * 60;
+
+uint32_t sampleCRC( const FileHandle& fh,
+                    off_t             off,
+                    size_t            size )
+{
+    Buffer buf;
+    fh.pread( off, buf, size );
+    return crc32( 0, buf.data(), buf.size() );
+}
+
+}
+
+IndexDir::Fingerprint::Fingerprint( const FileHandle& fh )
+{
+    struct stat st;
+    fh.stat( st );
+    size = st.st_size;
+    mtime = uint64_t( st.st_mtim.tv_sec ) * 1000000000 + st.st_mtim.tv_nsec;
+
+    const size_t n = std::min( size, uint64_t( SampleSize ) );
+    sample = n ? uint64_t( sampleCRC( fh, 0, n ) ) << 32 | sampleCRC( fh, size - n, n ) : 0;
+}
+
+uint64_t IndexDir::Fingerprint::hash() const
+{
+    // FNV-1a, like the disk cache
+    const uint64_t fields[] = { size, mtime, sample };
+    const uint8_t *p = reinterpret_cast<const uint8_t*>( fields );
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for ( size_t i = 0; i < sizeof( fields ); ++i ) {
+        h = ( h ^ p[i] ) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+std::string IndexDir::path( const Fingerprint& source )
+{
+    char name[17];
+    snprintf( name, sizeof( name ), "%016llx", (unsigned long long) source.hash() );
+    return gDir + "/" + name + IndexSuffix;
+}
+
+std::string IndexDir::tempPath( const std::string& path )
+{
+    // Other hosts may be writing the same index
+    static std::atomic<unsigned> count( 0 );
+    char host[256] = "";
+    gethostname( host, sizeof( host ) - 1 );
+    char name[512];
+    snprintf( name, sizeof( name ), ".%s.%ld.%u%s", host, (long) getpid(), count++,
+              TempSuffix );
+    return path + name;
+}
+
+void IndexDir::used( const std::string& path )
+{
+    ::utimensat( AT_FDCWD, path.c_str(), 0, 0 );
+}
+
+void IndexDir::trim( const std::string& keep )
+{
+    DIR *dir = opendir( gDir.c_str() );
+    if ( !dir ) {
+        return;
+    }
+
+    // Oldest first
+    typedef std::pair<uint64_t, std::pair<std::string, uint64_t> > Found;
+    std::vector<Found> found;
+    uint64_t total = 0;
+    const std::string keepName = PathUtils::basename( keep );
+    const time_t now = time( 0 );
+    while ( struct dirent *de = readdir( dir ) ) {
+        std::string name( de->d_name );
+        struct stat st;
+        if ( name == keepName || fstatat( dirfd( dir ), de->d_name, &st, 0 ) != 0
+             || !S_ISREG( st.st_mode ) )
+        {
+            continue;
+        }
+        if ( PathUtils::endsWith( name, TempSuffix ) != std::string::npos ) {
+            if ( now - st.st_mtime > StaleTemp ) {
+                unlinkat( dirfd( dir ), de->d_name, 0 );
+            }
+        } else if ( PathUtils::endsWith( name, IndexSuffix ) != std::string::npos ) {
+            uint64_t mtime = uint64_t( st.st_mtim.tv_sec ) * 1000000000 + st.st_mtim.tv_nsec;
+            found.push_back( Found( mtime, std::make_pair( name, st.st_size ) ) );
+            total += st.st_size;
+        }
+    }
+
+    // Whoever's using what we remove can carry on, they have it open
+    std::sort( found.begin(), found.end() );
+    struct stat st;
+    if ( fstatat( dirfd( dir ), keepName.c_str(), &st, 0 ) == 0 ) {
+        total += st.st_size;
+    }
+    for ( size_t i = 0; i < found.size() && total > gMaxSize; ++i ) {
+        unlinkat( dirfd( dir ), found[i].second.first.c_str(), 0 );
+        total -= found[i].second.second;
+    }
+    closedir( dir );
+}
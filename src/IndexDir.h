@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+
+#include <stdint.h>
+
+#include "FileHandle.h"
+
+
+/**
+ * A directory of indexes, that every mount on a machine can share, or
+ * several machines on a network filesystem.
+ *
+ * Indexes are named after a fingerprint of their source, so an archive seen
+ * through different paths, or from different hosts, only needs indexing
+ * once. They're written under a temporary name and renamed into place, so
+ * nobody ever sees part of one. Using an index touches it, and when the
+ * directory grows too big the least recently used are removed.
+ */
+class IndexDir
+{
+public:
+    // Identifies a source by its size, mtime, and a hash of its first and
+    // last few KiB. That's cheap to get, and the same wherever it's seen.
+    struct Fingerprint
+    {
+        uint64_t size, mtime, sample;
+
+        Fingerprint() :
+            size( 0 ),
+            mtime( 0 ),
+            sample( 0 ) { }
+
+        Fingerprint( const FileHandle& fh );
+
+        bool operator==( const Fingerprint& o ) const
+        {
+            return size == o.size && mtime == o.mtime && sample == o.sample;
+        }
+
+        uint64_t hash() const;
+    };
+
+    static std::string gDir;    // empty to keep indexes beside their sources
+    static uint64_t gMaxSize;   // most bytes of indexes to keep in gDir
+
+    // Where to keep the index for source
+    static std::string path( const Fingerprint& source );
+
+    // A name to write an index to before it's renamed to path, that no
+    // other writer will use
+    static std::string tempPath( const std::string& path );
+
+    // Note that an index is in use, so it's kept longer
+    static void used( const std::string& path );
+
+    // Remove the least recently used indexes until we fit, except keep
+    static void trim( const std::string& keep );
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#include <stdint.h>
+
+#include "Buffer.h"
+
+
+/**
+ * Encodes an index file into memory, so it can be written in one go.
+ *
+ * Numbers that vary a lot are stored as varints, seven bits at a time with
+ * the low bits first. Fixed-width fields are little-endian.
+ */
+class IndexWriter
+{
+    Buffer& mBuf;
+
+public:
+    IndexWriter( Buffer& buf ) :
+        mBuf( buf ) { }
+
+    size_t size() const { return mBuf.size(); }
+
+    void byte( uint8_t b ) { mBuf.push_back( b ); }
+
+    void varint( uint64_t v )
+    {
+        for ( ; v >= 0x80; v >>= 7 ) {
+            mBuf.push_back( uint8_t( v ) | 0x80 );
+        }
+        mBuf.push_back( uint8_t( v ) );
+    }
+
+    // Small signed values stay small
+    void svarint( int64_t v ) { varint( ( uint64_t( v ) << 1 ) ^ uint64_t( v >> 63 ) ); }
+
+    void fixed( uint64_t v,
+                size_t   bytes )
+    {
+        for ( size_t i = 0; i < bytes; ++i, v >>= 8 ) {
+            mBuf.push_back( uint8_t( v ) );
+        }
+    }
+
+    void bytes( const uint8_t* p,
+                size_t         n ) { mBuf.insert( mBuf.end(), p, p + n ); }
+
+    void bytes( const Buffer& b ) { mBuf.insert( mBuf.end(), b.begin(), b.end() ); }
+};
+
+
+// Decodes an index file from memory, throwing if it runs out
+class IndexReader
+{
+    const uint8_t *mPos, *mEnd;
+
+    void need( size_t n ) const
+    {
+        if ( n > remain() ) {
+            throw Exception( "truncated index" );
+        }
+    }
+
+public:
+    struct Exception : public std::runtime_error
+    {
+        Exception( const std::string& s ) :
+            std::runtime_error( s ) { }
+    };
+
+    IndexReader( const uint8_t* p,
+                 size_t         size ) :
+        mPos( p ),
+        mEnd( p + size ) { }
+
+    size_t remain() const { return mEnd - mPos; }
+
+    const uint8_t * pos() const { return mPos; }
+
+    uint8_t byte()
+    {
+        need( 1 );
+        return *mPos++;
+    }
+
+    uint64_t varint()
+    {
+        uint64_t v = 0;
+        for ( unsigned shift = 0; shift < 64; shift += 7 ) {
+            uint8_t b = byte();
+            v |= uint64_t( b & 0x7f ) << shift;
+            if ( !( b & 0x80 ) ) {
+                return v;
+            }
+        }
+        throw Exception( "bad varint in index" );
+    }
+
+    int64_t svarint()
+    {
+        uint64_t v = varint();
+        return int64_t( v >> 1 ) ^ -int64_t( v & 1 );
+    }
+
+    uint64_t fixed( size_t bytes )
+    {
+        need( bytes );
+        uint64_t v = 0;
+        for ( size_t i = 0; i < bytes; ++i ) {
+            v |= uint64_t( mPos[i] ) << ( 8 * i );
+        }
+        mPos += bytes;
+        return v;
+    }
+
+    // For the old format
+    uint64_t fixedBE( size_t bytes )
+    {
+        need( bytes );
+        uint64_t v = 0;
+        for ( size_t i = 0; i < bytes; ++i ) {
+            v = ( v << 8 ) | mPos[i];
+        }
+        mPos += bytes;
+        return v;
+    }
+
+    const uint8_t * bytes( size_t n )
+    {
+        need( n );
+        const uint8_t *p = mPos;
+        mPos += n;
+        return p;
+    }
+};
@@ -1,15 +1,44 @@
 #pragma once
 
+#include <deque>
 #include <functional>
-#include <list>
+#include <stdexcept>
 #include <unordered_map>
+#include <vector>
 
+#include <stdint.h>
 
+
+struct LRUMapBase
+{
+    enum Policy
+    {
+        LRU,
+        TwoQ,
+    };
+};
+
+
+/**
+ * A weighted cache map.
+ *
+ * Entries live in one contiguous vector, linked into queues by index rather
+ * than by pointer, so there's no allocation per entry once the map is warm.
+ *
+ * Two eviction policies are supported:
+ *  - LRU: evict the least-recently used entry.
+ *  - TwoQ: new entries go into a FIFO probation queue, which may only use a
+ *    quarter of the weight. Keys evicted from probation are remembered in a
+ *    ghost list, and if they're added again they go straight to the
+ *    protected LRU queue. A single pass over lots of data therefore only
+ *    churns the probation queue, and can't flush the blocks that are really
+ *    being reused.
+ */
 template <
     typename Key,
     typename Value,
     typename Hash = std::hash<Key> >
-class LRUMap
+class LRUMap : public LRUMapBase
 {
 public:
     typedef size_t Weight;
@@ -36,50 +65,222 @@ public:
     };
 
 private:
-    typedef std::list<Entry> LRUList;     // most-recent at front
-    typedef typename LRUList::iterator LRUIterator;
-    typedef std::unordered_map<Key, LRUIterator, Hash> IterMap;
+    typedef uint32_t Index;
+    static const Index Nil = ~Index( 0 );
+
+    enum Queue
+    {
+        Probation,
+        Protected,
+        QueueCount,
+        Free = QueueCount,
+    };
+
+    struct Node
+    {
+        Entry entry;
+        Index prev, next;
+        uint8_t queue;
+
+        Node( const Entry& e ) :
+            entry( e ),
+            prev( Nil ),
+            next( Nil ),
+            queue( Free ) { }
+    };
+
+    struct List         // most-recent at head
+    {
+        Index head, tail;
+        Weight weight;
+
+        List() :
+            head( Nil ),
+            tail( Nil ),
+            weight( 0 ) { }
+    };
+
+    typedef std::vector<Node> NodeList;
+    typedef std::unordered_map<Key, Index, Hash> IndexMap;
+
+    // Ghosts are evicted keys, with the sequence number at eviction so that
+    // stale queue entries can be told apart from re-evicted ones.
+    typedef std::unordered_map<Key, uint64_t, Hash> GhostMap;
+    struct Ghost
+    {
+        Key key;
+        Weight weight;
+        uint64_t seq;
+
+        Ghost( const Key& k,
+               Weight     w,
+               uint64_t   s ) :
+            key( k ),
+            weight( w ),
+            seq( s ) { }
+    };
+    typedef std::deque<Ghost> GhostQueue;
 
 public:
-    typedef LRUIterator Iterator;
+    class Iterator
+    {
+        NodeList *mNodes;
+        size_t mPos;
+
+        void skipFree()
+        {
+            while ( mPos < mNodes->size() && ( *mNodes )[mPos].queue == Free ) {
+                ++mPos;
+            }
+        }
+
+    public:
+        Iterator() :
+            mNodes( 0 ),
+            mPos( 0 ) { }
+
+        Iterator( NodeList *n,
+                  size_t    p ) :
+            mNodes( n ),
+            mPos( p ) { skipFree(); }
+
+        Entry& operator*() const { return ( *mNodes )[mPos].entry; }
+        Entry *operator->() const { return &**this; }
+        Iterator& operator++() { ++mPos; skipFree(); return *this; }
+
+        bool operator==( const Iterator& o ) const { return mPos == o.mPos; }
+        bool operator!=( const Iterator& o ) const { return mPos != o.mPos; }
+    };
 
 private:
-    LRUList mLRU;
-    IterMap mMap;
+    NodeList mNodes;
+    Index mFree;                // free nodes, linked through next
+    List mQueues[QueueCount];
+    IndexMap mMap;
     Weight mWeight, mMaxWeight;
+    Policy mPolicy;
+
+    GhostMap mGhosts;
+    GhostQueue mGhostQueue;
+    Weight mGhostWeight;
+    uint64_t mGhostSeq;
+
+    void unlink( Index i )
+    {
+        Node& n = mNodes[i];
+        List& l = mQueues[n.queue];
+        ( n.prev == Nil ? l.head : mNodes[n.prev].next ) = n.next;
+        ( n.next == Nil ? l.tail : mNodes[n.next].prev ) = n.prev;
+        l.weight -= n.entry.weight;
+        n.queue = Free;
+    }
+
+    void pushHead( Index i,
+                   Queue q )
+    {
+        Node& n = mNodes[i];
+        List& l = mQueues[q];
+        n.queue = q;
+        n.prev = Nil;
+        n.next = l.head;
+        ( l.head == Nil ? l.tail : mNodes[l.head].prev ) = i;
+        l.head = i;
+        l.weight += n.entry.weight;
+    }
+
+    void release( Index i )
+    {
+        Node& n = mNodes[i];
+        mWeight -= n.entry.weight;
+        mMap.erase( n.entry.key );
+        unlink( i );
+        n.entry.value = Value();        // don't hold on to the contents
+        n.next = mFree;
+        mFree = i;
+    }
+
+    void addGhost( const Entry& e )
+    {
+        mGhosts[e.key] = ++mGhostSeq;
+        mGhostQueue.push_back( Ghost( e.key, e.weight, mGhostSeq ) );
+        mGhostWeight += e.weight;
+        trimGhosts();
+    }
+
+    // Remember about as much as half the cache worth of evicted keys
+    void trimGhosts()
+    {
+        while ( !mGhostQueue.empty() && mGhostWeight > mMaxWeight / 2 ) {
+            const Ghost& g = mGhostQueue.front();
+            typename GhostMap::iterator giter = mGhosts.find( g.key );
+            if ( giter != mGhosts.end() && giter->second == g.seq ) {
+                mGhosts.erase( giter );
+            }
+            mGhostWeight -= g.weight;
+            mGhostQueue.pop_front();
+        }
+    }
+
+    // Which node should go next
+    Index victim() const
+    {
+        const List& prob = mQueues[Probation];
+        const List& prot = mQueues[Protected];
+        if ( prot.tail == Nil || ( prob.tail != Nil && prob.weight > mMaxWeight / 4 ) ) {
+            return prob.tail;
+        }
+        return prot.tail;
+    }
 
     void makeRoom( Weight newWeight )
     {
-        for ( LRUIterator uiter = --mLRU.end(); mWeight > newWeight; --uiter ) {
-            Weight w = uiter->weight;
-            mMap.erase( uiter->key );
-            mLRU.erase( uiter );
-            mWeight -= w;
+        while ( mWeight > newWeight ) {
+            Index i = victim();
+            if ( mPolicy == TwoQ && mNodes[i].queue == Probation ) {
+                addGhost( mNodes[i].entry );
+            }
+            release( i );
         }
     }
 
-    void markNew( const LRUIterator& iter )
+    void markNew( Index i )
     {
-        mLRU.splice( mLRU.begin(), mLRU, iter );
+        // Under 2Q, hits in probation are usually just the same reader coming
+        // back for more of the block, so they don't count as reuse
+        if ( mNodes[i].queue == Protected ) {
+            unlink( i );
+            pushHead( i, Protected );
+        }
     }
 
 public:
-    LRUMap( Weight maxWeight ) :
+    LRUMap( Weight maxWeight,
+            Policy policy = LRU ) :
+        mFree( Nil ),
         mWeight(),
-        mMaxWeight( maxWeight ) { }
+        mMaxWeight( maxWeight ),
+        mPolicy( policy ),
+        mGhostWeight( 0 ),
+        mGhostSeq( 0 ) { }
 
     Weight weight() const { return mWeight; }
 
     Weight maxWeight() const { return mMaxWeight; }
 
-    void maxWeight( Weight w ) { makeRoom( w ); mMaxWeight = w; }
+    void maxWeight( Weight w ) { makeRoom( w ); mMaxWeight = w; trimGhosts(); }
 
-    // Doesn't change LRU-time
-    Iterator begin() { return mLRU.begin(); }
+    Policy policy() const { return mPolicy; }
 
-    Iterator end() { return mLRU.end(); }
+    // Only affects entries added from now on
+    void policy( Policy p ) { mPolicy = p; }
 
-    // Add a new item, ejecting old items to make room if necessary
+    // Doesn't change LRU-time. Not in any particular order.
+    Iterator begin() { return Iterator( &mNodes, 0 ); }
+
+    Iterator end() { return Iterator( &mNodes, mNodes.size() ); }
+
+    // Add a new item, ejecting old items to make room if necessary.
+    // The returned entry is only valid until the next add.
     Entry& add( const Key&   k,
                 const Value& v,
                 Weight       w )
@@ -88,23 +289,49 @@ public:
             throw OverWeight();
         }
 
+        typename IndexMap::iterator miter = mMap.find( k );
+        if ( miter != mMap.end() ) {
+            release( miter->second );
+        }
+
+        // Check for a ghost before making room, which may forget it
+        Queue q = Protected;
+        if ( mPolicy == TwoQ ) {
+            typename GhostMap::iterator giter = mGhosts.find( k );
+            if ( giter == mGhosts.end() ) {
+                q = Probation;
+            } else {
+                mGhosts.erase( giter );       // seen again, so it's hot
+            }
+        }
         makeRoom( maxWeight() - w );
+
+        Index i;
+        if ( mFree != Nil ) {
+            i = mFree;
+            mFree = mNodes[i].next;
+            mNodes[i].entry = Entry( k, v, w );
+        } else {
+            i = mNodes.size();
+            mNodes.push_back( Node( Entry( k, v, w ) ) );
+        }
+
         mWeight += w;
-        mLRU.push_front( Entry( k, v, w ) );
-        mMap[k] = mLRU.begin();
-        return mLRU.front();
+        pushHead( i, q );
+        mMap[k] = i;
+        return mNodes[i].entry;
     }
 
     // Find an item, returning null-ptr if not found
     Value * find( const Key& k )
     {
-        typename IterMap::iterator miter = mMap.find( k );
+        typename IndexMap::iterator miter = mMap.find( k );
         if ( miter == mMap.end() ) {
             return 0;
         }
 
         markNew( miter->second );
-        return &miter->second->value;
+        return &mNodes[miter->second].entry.value;
     }
 
 };
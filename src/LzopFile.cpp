@@ -138,7 +138,8 @@ off_t LzopFile::findBlocks( FileHandle& fh,
             sums += csums;
         }
 
-        addBlock( new Block( usize, csize, uoff, coff + bheader + sums ) );
+        addBlock( usize, coff + bheader + sums, csize );
+        progress();
 
         coff += sums + csize + 2 * sizeof( uint32_t );
         uoff += usize;
@@ -163,22 +164,21 @@ LzopFile::LzopFile( const std::string& path,
 
 void LzopFile::decompressBlock( const FileHandle& fh,
                                 const Block&      b,
-                                Buffer&           ubuf ) const
+                                uint8_t*          ubuf ) const
 {
     if ( b.csize == b.usize ) {   // Uncompressed, just read it
         fh.pread( b.coff, ubuf, b.usize );
         return;
     }
 
-    Buffer cbuf;
+    static thread_local Buffer cbuf;
     fh.pread( b.coff, cbuf, b.csize );
 
-    ubuf.resize( b.usize );
     lzo_uint usize = b.usize;
 // fprintf(stderr, "Decompressing from %" PRIu64 "\n", uint64_t(b.coff));
-    int err = lzo1x_decompress_safe( &cbuf[0], cbuf.size(), &ubuf[0],
+    int err = lzo1x_decompress_safe( &cbuf[0], cbuf.size(), ubuf,
                                      &usize, 0 );
-    if ( err != LZO_E_OK ) {
+    if ( err != LZO_E_OK || usize != b.usize ) {
 // fprintf(stderr, "lzo err: %d\n", err);
         throw std::runtime_error( "decompression error" );
     }
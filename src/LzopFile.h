@@ -56,8 +56,12 @@ public:
 
     std::string destName() const override;
 
+    const char * format() const override { return "lzop"; }
+
+    IndexedCompFile * snapshot() const override { return copy( *this ); }
+
     void decompressBlock( const FileHandle& fh,
                           const Block&      b,
-                          Buffer&           ubuf ) const override;
+                          uint8_t*          ubuf ) const override;
 
 };
@@ -0,0 +1,165 @@
+#include "MagicScanner.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define MAGIC_SCANNER_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace {
+
+bool hasPair( const MagicScanner::Pairs& pairs,
+              const uint8_t*             p )
+{
+    const unsigned key = ( p[0] << 8 ) | p[1];
+    return ( pairs.table[key / 64] >> ( key % 64 ) ) & 1;
+}
+
+size_t findPortable( const MagicScanner::Pairs& pairs,
+                     const uint8_t*             buf,
+                     size_t                     pos,
+                     size_t                     end )
+{
+    for ( ; pos < end; ++pos ) {
+        if ( hasPair( pairs, buf + pos ) ) {
+            return pos;
+        }
+    }
+    return end;
+}
+
+// Check the positions a vector flagged, in order
+size_t findInMask( const MagicScanner::Pairs& pairs,
+                   const uint8_t*             buf,
+                   size_t                     pos,
+                   unsigned                   mask )
+{
+    for ( ; mask; mask &= mask - 1 ) {
+        size_t i = pos + __builtin_ctz( mask );
+        if ( hasPair( pairs, buf + i ) ) {
+            return i;
+        }
+    }
+    return size_t( -1 );
+}
+
+#ifdef MAGIC_SCANNER_X86
+
+__attribute__( ( target( "ssse3" ) ) )
+size_t findSSSE3( const MagicScanner::Pairs& pairs,
+                  const uint8_t*             buf,
+                  size_t                     pos,
+                  size_t                     end )
+{
+    typedef __m128i V;
+    const V fl = _mm_loadu_si128( reinterpret_cast<const V*>( pairs.firstLow ) ),
+            fh = _mm_loadu_si128( reinterpret_cast<const V*>( pairs.firstHigh ) ),
+            sl = _mm_loadu_si128( reinterpret_cast<const V*>( pairs.secondLow ) ),
+            sh = _mm_loadu_si128( reinterpret_cast<const V*>( pairs.secondHigh ) ),
+            nibble = _mm_set1_epi8( 0xf ), zero = _mm_setzero_si128();
+
+    for ( ; pos + sizeof( V ) <= end; pos += sizeof( V ) ) {
+        const V a = _mm_loadu_si128( reinterpret_cast<const V*>( buf + pos ) ),
+                b = _mm_loadu_si128( reinterpret_cast<const V*>( buf + pos + 1 ) );
+        const V first = _mm_and_si128(
+            _mm_shuffle_epi8( fl, _mm_and_si128( a, nibble ) ),
+            _mm_shuffle_epi8( fh, _mm_and_si128( _mm_srli_epi16( a, 4 ), nibble ) ) );
+        const V second = _mm_and_si128(
+            _mm_shuffle_epi8( sl, _mm_and_si128( b, nibble ) ),
+            _mm_shuffle_epi8( sh, _mm_and_si128( _mm_srli_epi16( b, 4 ), nibble ) ) );
+        const V miss = _mm_cmpeq_epi8( _mm_and_si128( first, second ), zero );
+        const unsigned mask = ~_mm_movemask_epi8( miss ) & 0xffff;
+        if ( mask ) {
+            size_t i = findInMask( pairs, buf, pos, mask );
+            if ( i != size_t( -1 ) ) {
+                return i;
+            }
+        }
+    }
+    return findPortable( pairs, buf, pos, end );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+size_t findAVX2( const MagicScanner::Pairs& pairs,
+                 const uint8_t*             buf,
+                 size_t                     pos,
+                 size_t                     end )
+{
+    typedef __m256i V;
+    const V fl = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128( reinterpret_cast<const __m128i*>( pairs.firstLow ) ) ),
+            fh = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128( reinterpret_cast<const __m128i*>( pairs.firstHigh ) ) ),
+            sl = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128( reinterpret_cast<const __m128i*>( pairs.secondLow ) ) ),
+            sh = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128( reinterpret_cast<const __m128i*>( pairs.secondHigh ) ) ),
+            nibble = _mm256_set1_epi8( 0xf ), zero = _mm256_setzero_si256();
+
+    for ( ; pos + sizeof( V ) <= end; pos += sizeof( V ) ) {
+        const V a = _mm256_loadu_si256( reinterpret_cast<const V*>( buf + pos ) ),
+                b = _mm256_loadu_si256( reinterpret_cast<const V*>( buf + pos + 1 ) );
+        const V first = _mm256_and_si256(
+            _mm256_shuffle_epi8( fl, _mm256_and_si256( a, nibble ) ),
+            _mm256_shuffle_epi8( fh, _mm256_and_si256( _mm256_srli_epi16( a, 4 ), nibble ) ) );
+        const V second = _mm256_and_si256(
+            _mm256_shuffle_epi8( sl, _mm256_and_si256( b, nibble ) ),
+            _mm256_shuffle_epi8( sh, _mm256_and_si256( _mm256_srli_epi16( b, 4 ), nibble ) ) );
+        const V miss = _mm256_cmpeq_epi8( _mm256_and_si256( first, second ), zero );
+        const unsigned mask = ~unsigned( _mm256_movemask_epi8( miss ) );
+        if ( mask ) {
+            size_t i = findInMask( pairs, buf, pos, mask );
+            if ( i != size_t( -1 ) ) {
+                return i;
+            }
+        }
+    }
+    return findSSSE3( pairs, buf, pos, end );
+}
+
+#endif
+
+}
+
+MagicScanner::MagicScanner( const uint64_t* magics,
+                            size_t          count,
+                            size_t          bytes ) :
+    mFind( findPortable ),
+    mName( "portable" )
+{
+    if ( count > MaxMagics || bytes < 3 || bytes > sizeof( uint64_t ) ) {
+        throw std::invalid_argument( "unsupported magics" );
+    }
+
+    memset( &mPairs, 0, sizeof( mPairs ) );
+    size_t bucket = 0;
+    for ( size_t m = 0; m < count; ++m ) {
+        for ( size_t bits = 0; bits < 8; ++bits ) {
+            // With bits of it in the byte before
+            const uint8_t f = magics[m] >> ( 8 * ( bytes - 1 ) - bits ),
+                          s = magics[m] >> ( 8 * ( bytes - 2 ) - bits );
+            const unsigned key = ( f << 8 ) | s;
+            mPairs.table[key / 64] |= uint64_t( 1 ) << ( key % 64 );
+
+            const uint8_t flag = 1 << ( bucket++ % 8 );
+            mPairs.firstLow[f & 0xf] |= flag;
+            mPairs.firstHigh[f >> 4] |= flag;
+            mPairs.secondLow[s & 0xf] |= flag;
+            mPairs.secondHigh[s >> 4] |= flag;
+        }
+    }
+
+#ifdef MAGIC_SCANNER_X86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx2" ) ) {
+        mFind = findAVX2;
+        mName = "avx2";
+    } else if ( __builtin_cpu_supports( "ssse3" ) ) {
+        mFind = findSSSE3;
+        mName = "ssse3";
+    }
+#endif
+}
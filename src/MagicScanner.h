@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+
+
+/**
+ * Finds places where some magic numbers might start, at any bit alignment.
+ *
+ * A magic that starts some bits into a byte has its next two whole bytes
+ * fixed, so we look for any of those byte pairs. Vector code sorts each byte
+ * into buckets by looking up its two nibbles, which narrows things down to
+ * the few places worth checking against a table of the pairs. Callers still
+ * check the whole magic at each position we return.
+ */
+class MagicScanner
+{
+public:
+    static const size_t MaxMagics = 2;     // more would mean more false hits
+
+    // The first two whole bytes of each magic, at each alignment
+    struct Pairs
+    {
+        uint64_t table[( 1 << 16 ) / 64];   // bit set for each pair
+
+        // Which buckets a byte may be in is the intersection of what its low
+        // and high nibbles say. Each pair has a bucket, the same for both bytes.
+        uint8_t firstLow[16], firstHigh[16];
+        uint8_t secondLow[16], secondHigh[16];
+    };
+
+protected:
+    typedef size_t (*FindFunc)( const Pairs&  pairs,
+                                const uint8_t *buf,
+                                size_t        pos,
+                                size_t        end );
+
+    Pairs mPairs;
+    FindFunc mFind;
+    const char *mName;
+
+public:
+    // Each magic is its first bytes, from the most significant
+    MagicScanner( const uint64_t* magics,
+                  size_t          count,
+                  size_t          bytes );
+
+    // The first position in [pos, end) where a magic may have its first whole
+    // byte, or end. Reads up to buf[end].
+    size_t find( const uint8_t* buf,
+                 size_t         pos,
+                 size_t         end ) const
+    { return mFind( mPairs, buf, pos, end ); }
+
+    // Which instructions we're using
+    const char * name() const { return mName; }
+};
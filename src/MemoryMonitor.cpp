@@ -0,0 +1,178 @@
+#include "MemoryMonitor.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "BlockCache.h"
+
+unsigned MemoryMonitor::gInterval = 1;
+double MemoryMonitor::gMaxPressure = 5.0;
+
+namespace {
+
+// A single number in a cgroup file. False if it's missing or "max".
+bool readNumber( const std::string& path,
+                 uint64_t&          n )
+{
+    std::ifstream in( path.c_str() );
+    return static_cast<bool>( in >> n );
+}
+
+// Total and available memory in /proc/meminfo
+void readMeminfo( uint64_t& total,
+                  uint64_t& avail )
+{
+    std::ifstream in( "/proc/meminfo" );
+    std::string key;
+    uint64_t kb;
+    while ( in >> key >> kb ) {
+        if ( key == "MemTotal:" ) {
+            total = kb * 1024;
+        } else if ( key == "MemAvailable:" ) {
+            avail = kb * 1024;
+        }
+        in.ignore( 256, '\n' );
+    }
+}
+
+// The "some avg10" figure of a pressure file, or negative if we can't tell
+double readPressure( const std::string& path )
+{
+    std::ifstream in( path.c_str() );
+    std::string line;
+    while ( std::getline( in, line ) ) {
+        std::istringstream fields( line );
+        std::string kind, avg;
+        fields >> kind >> avg;
+        if ( kind == "some" && avg.compare( 0, 6, "avg10=" ) == 0 ) {
+            return atof( avg.c_str() + 6 );
+        }
+    }
+    return -1;
+}
+
+} // anon namespace
+
+MemoryMonitor::MemoryMonitor( BlockCache& cache,
+                              size_t      floor,
+                              size_t      ceiling ) :
+    mCache( cache ),
+    mFloor( floor ),
+    mCeiling( std::max( floor, ceiling ) ),
+    mSize( floor ),
+    mCgroup( cgroup() ),
+    mStop( false )
+{
+    mCache.maxSize( mSize );
+    pthread_create( &mThread, 0, &threadFunc, this );
+}
+
+MemoryMonitor::~MemoryMonitor()
+{
+    {
+        Lock lock( mCond );
+        mStop = true;
+        mCond.signal();
+    }
+    pthread_join( mThread, 0 );
+}
+
+uint64_t MemoryMonitor::limit()
+{
+    uint64_t total = 0, avail = 0, max;
+    readMeminfo( total, avail );
+
+    std::string dir = cgroup();
+    if ( !dir.empty() && readNumber( dir + "/memory.max", max ) ) {
+        total = total ? std::min( total, max ) : max;
+    }
+    return total;
+}
+
+std::string MemoryMonitor::cgroup()
+{
+    // The unified hierarchy has a line like "0::/some/path"
+    std::ifstream in( "/proc/self/cgroup" );
+    std::string line;
+    while ( std::getline( in, line ) ) {
+        if ( line.compare( 0, 3, "0::" ) == 0 ) {
+            std::string dir = "/sys/fs/cgroup" + line.substr( 3 );
+            if ( std::ifstream( ( dir + "/memory.current" ).c_str() ) ) {
+                return dir;
+            }
+        }
+    }
+    return std::string();
+}
+
+void * MemoryMonitor::threadFunc( void* val )
+{
+    reinterpret_cast<MemoryMonitor*>( val )->run();
+    return 0;
+}
+
+void MemoryMonitor::run()
+{
+    Lock lock( mCond );
+    while ( !mStop ) {
+        adjust( sample() );
+
+        struct timespec until;
+        clock_gettime( CLOCK_REALTIME, &until );
+        until.tv_sec += gInterval;
+        mCond.wait( until );
+    }
+}
+
+MemoryMonitor::Sample MemoryMonitor::sample() const
+{
+    Sample s;
+    s.limit = s.free = 0;
+    readMeminfo( s.limit, s.free );
+
+    s.pressure = -1;
+    if ( !mCgroup.empty() ) {
+        uint64_t max, current;
+        if ( readNumber( mCgroup + "/memory.max", max )
+             && readNumber( mCgroup + "/memory.current", current ) )
+        {
+            uint64_t room = max > current ? max - current : 0;
+            s.free = s.limit ? std::min( s.free, room ) : room;
+            s.limit = s.limit ? std::min( s.limit, max ) : max;
+        }
+        s.pressure = readPressure( mCgroup + "/memory.pressure" );
+    }
+    if ( s.pressure < 0 ) {
+        s.pressure = readPressure( "/proc/pressure/memory" );
+    }
+    return s;
+}
+
+void MemoryMonitor::adjust( const Sample& s )
+{
+    // Work from what we're actually using, so an idle cache's budget
+    // doesn't creep up to the ceiling
+    size_t decoding = mCache.decoding();
+    uint64_t used = mCache.size() + decoding;
+    uint64_t reserve = s.limit / 16;
+
+    uint64_t budget;
+    if ( s.limit == 0 ) {
+        budget = mCeiling;      // no idea, so trust the configuration
+    } else if ( s.pressure > gMaxPressure ) {
+        budget = used - used / 4;
+    } else if ( s.free < reserve ) {
+        budget = used - std::min( used, reserve - s.free );
+    } else {
+        budget = used + ( s.free - reserve ) / 2;
+    }
+    budget = std::min<uint64_t>( std::max<uint64_t>( budget, mFloor ), mCeiling );
+
+    size_t size = std::max<uint64_t>( mFloor, budget > decoding ? budget - decoding : 0 );
+    if ( size != mSize ) {
+        mSize = size;
+        mCache.maxSize( size );
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ThreadPool.h"
+
+
+class BlockCache;
+
+
+/**
+ * Sizes a BlockCache to fit the memory that's actually available.
+ *
+ * A thread periodically looks at our cgroup's memory.max and memory.current,
+ * falling back to /proc/meminfo outside a cgroup, and at memory pressure
+ * stall information. The cache grows into half of any free memory, shrinks
+ * quickly when the system stalls on memory or free memory runs low, and
+ * always stays between a floor and a ceiling. Buffers being decoded count
+ * against the budget, since they'll soon be in the cache.
+ */
+class MemoryMonitor
+{
+public:
+    // Seconds between checks
+    static unsigned gInterval;
+
+    // Percentage of time stalled on memory above which we shrink
+    static double gMaxPressure;
+
+    MemoryMonitor( BlockCache& cache,
+                   size_t      floor,
+                   size_t      ceiling );
+
+    ~MemoryMonitor();
+
+    // The memory we may use, for picking a default ceiling. Zero if unknown.
+    static uint64_t limit();
+
+protected:
+    struct Sample
+    {
+        uint64_t limit;     // total memory we may use
+        uint64_t free;      // of that, how much is unused
+        double pressure;    // recent percent of time stalled, or negative
+    };
+
+    BlockCache& mCache;
+    size_t mFloor, mCeiling;
+    size_t mSize;           // what we last gave the cache
+    std::string mCgroup;    // our cgroup directory, or empty
+
+    ConditionVariable mCond;
+    bool mStop;
+    pthread_t mThread;
+
+    static void * threadFunc( void* val );
+
+    void run();
+
+    // Find the cgroup v2 directory for this process
+    static std::string cgroup();
+
+    Sample sample() const;
+
+    // Resize the cache for a new sample
+    void adjust( const Sample& s );
+};
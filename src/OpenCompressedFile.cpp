@@ -2,33 +2,75 @@
 
 #include "BlockCache.h"
 
+#include <algorithm>
 #include <cstring>
 
+size_t OpenCompressedFile::gMaxReadahead = 8;
+
+// Per-handle access pattern, and the prefetches we've got outstanding
+struct OpenCompressedFile::Readahead : public BlockCache::Callback
+{
+    Mutex mutex;
+    off_t prev;             // offset of the last read
+    off_t next;             // where a sequential reader continues
+    off_t ahead;            // blocks are requested up to here
+    size_t window;          // how many blocks to keep ahead
+
+    ConditionVariable cv;
+    size_t remain;
+    BlockCache::JobInfo info;
+
+    Readahead() :
+        prev( 0 ),
+        next( 0 ),
+        ahead( 0 ),
+        window( 0 ),
+        remain( 0 ),
+        info( *this, cv, remain ) { }
+
+    ~Readahead()
+    {
+        // Jobs still refer to the file handle, let them finish
+        Lock lock( cv );
+        while ( remain ) {
+            cv.wait();
+        }
+    }
+
+    // Nothing to do, we're just warming the cache
+    void operator()( const Block&, BlockCache::BufPtr& ) override { }
+};
+
 OpenCompressedFile::OpenCompressedFile( const CompressedFile *file,
                                         int                   openFlags ) :
     mFile( file ),
-    mFH( file->path(), openFlags ) { }
+    mFH( file->path(), openFlags ),
+    mReadahead( new Readahead() ) { }
+
+OpenCompressedFile::~OpenCompressedFile()
+{
+    delete mReadahead;
+}
 
 void OpenCompressedFile::decompressBlock( const Block& b,
-                                          Buffer&      ubuf ) const
+                                          uint8_t*     ubuf ) const
 {
     mFile->decompressBlock( mFH, b, ubuf );
 }
 
 namespace {
 
+// Runs concurrently for different blocks, so it mustn't touch shared state
+// other than its own slice of buf
 struct Callback : public BlockCache::Callback
 {
-    off_t& max;
     char *buf;
     size_t size;
     off_t offset;
 
-    Callback( off_t& m,
-              char * b,
+    Callback( char * b,
               size_t s,
               off_t  o ) :
-        max( m ),
         buf( b ),
         size( s ),
         offset( o ) { }
@@ -41,7 +83,33 @@ struct Callback : public BlockCache::Callback
         size_t bstart = omin - block.uoff,
                bsize = omax - omin;
         memcpy( buf + omin - offset, &( *ubuf )[bstart], bsize );
-        max = omax;
+    }
+
+};
+
+struct SliceCallback : public BlockCache::Callback
+{
+    Mutex mutex;
+    OpenCompressedFile::Slices& slices;
+    size_t size;
+    off_t offset;
+
+    SliceCallback( OpenCompressedFile::Slices& sl,
+                   size_t                      s,
+                   off_t                       o ) :
+        slices( sl ),
+        size( s ),
+        offset( o ) { }
+
+    void operator()( const Block&        block,
+                     BlockCache::BufPtr& ubuf ) override
+    {
+        off_t omin = std::max( offset, off_t( block.uoff ) ),
+              omax = std::min( offset + size, block.uoff + block.usize );
+        Lock lock( mutex );
+        slices.push_back( OpenCompressedFile::Slice( ubuf, omin,
+                                                     omin - block.uoff,
+                                                     omax - omin ) );
     }
 
 };
@@ -53,10 +121,88 @@ ssize_t OpenCompressedFile::read( BlockCache& cache,
                                   size_t      size,
                                   off_t       offset ) const
 {
-    off_t max = offset;
+    // Without a final size, the kernel may ask for more than there is
+    mFile->waitForIndex( offset + size );
+    if ( offset >= mFile->uncompressedSize() ) {
+        return 0;
+    }
+
     CompressedFile::BlockIterator biter = mFile->findBlock( offset );
-    Callback cb( max, buf, size, offset );
-    cache.getBlocks( *this, biter, offset + size, cb );
+    Callback cb( buf, size, offset );
+    cache.getBlocks( *this, biter, offset, offset + size, cb );
+
+    // findBlock succeeded, so we filled everything up to the end of the file
+    const off_t max = std::min( off_t( offset + size ), mFile->uncompressedSize() );
+    readahead( cache, offset, max );
 
     return max - offset;
 }
+
+ssize_t OpenCompressedFile::read( BlockCache& cache,
+                                  Slices&     slices,
+                                  size_t      size,
+                                  off_t       offset ) const
+{
+    mFile->waitForIndex( offset + size );
+    if ( offset >= mFile->uncompressedSize() ) {
+        return 0;
+    }
+
+    CompressedFile::BlockIterator biter = mFile->findBlock( offset );
+    SliceCallback cb( slices, size, offset );
+    cache.getBlocks( *this, biter, offset, offset + size, cb );
+    std::sort( slices.begin(), slices.end() );
+
+    const off_t max = std::min( off_t( offset + size ), mFile->uncompressedSize() );
+    readahead( cache, offset, max );
+
+    return max - offset;
+}
+
+void OpenCompressedFile::readahead( BlockCache& cache,
+                                    off_t       offset,
+                                    off_t       end ) const
+{
+    Readahead& ra = *mReadahead;
+    Lock lock( ra.mutex );
+
+    // Reads may arrive slightly out of order, so anything between the last
+    // read and the furthest we've read still counts as sequential. Anything
+    // else starts afresh, forgetting what we prefetched.
+    const bool sequential = offset >= ra.prev && offset <= ra.next;
+    ra.prev = offset;
+    ra.next = std::max( ra.next, end );
+    if ( !sequential ) {
+        ra.next = ra.ahead = end;
+        ra.window = 0;
+        return;
+    }
+
+    ra.window = std::min( ra.window ? ra.window * 2 : 1, gMaxReadahead );
+    if ( ra.window == 0 || end >= mFile->uncompressedSize() ) {
+        return;
+    }
+
+    // Find the end of the window, counting from the block after this read
+    CompressedFile::BlockIterator biter = mFile->findBlock( end );
+    off_t wend = end;
+    for ( size_t i = 0; i < ra.window && !biter.end(); ++i, ++biter ) {
+        if ( cache.segmented( biter ) ) {
+            // Just read a few segments into a huge block
+            off_t from = std::max( end, off_t( biter->uoff ) );
+            wend = std::min( off_t( biter->uoff + biter->usize ),
+                             off_t( from + ( ra.window - i ) * BlockCache::gSegmentSize ) );
+            break;
+        }
+        wend = biter->uoff + biter->usize;
+    }
+    if ( wend <= ra.ahead ) {
+        return;
+    }
+
+    // If the pool is too busy, we'll try for the rest on the next read
+    const off_t start = std::max( end, ra.ahead );
+    biter = mFile->findBlock( start );
+    cache.fetchBlocks( *this, biter, start, wend, ra.info, ThreadPool::Prefetch );
+    ra.ahead = biter.end() ? wend : std::min( wend, off_t( biter->uoff ) );
+}
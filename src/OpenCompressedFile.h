@@ -1,5 +1,8 @@
 #pragma once
 
+#include <vector>
+
+#include "BufferPool.h"
 #include "CompressedFile.h"
 #include "FileHandle.h"
 
@@ -8,17 +11,57 @@ class BlockCache;
 class OpenCompressedFile
 {
 protected:
+    struct Readahead;
+
     const CompressedFile *mFile;
     FileHandle mFH;
+    Readahead *mReadahead;
+
+    // Disable copying
+    OpenCompressedFile( const OpenCompressedFile& o ) = delete;
+
+    OpenCompressedFile& operator=( const OpenCompressedFile& o ) = delete;
+
+    // Track the access pattern, and start decompressing the blocks after
+    // [offset, end) if the reader looks sequential
+    void readahead( BlockCache& cache,
+                    off_t       offset,
+                    off_t       end ) const;
 
 public:
-    typedef std::string FileID;
+    typedef uint32_t FileID;
+
+    // Part of a cached block, kept alive for as long as we hold it
+    struct Slice
+    {
+        PooledBuffer::Ptr buf;
+        off_t uoff;             // where it goes in the file
+        size_t start, size;     // what part of buf to use
+
+        Slice( const PooledBuffer::Ptr& b,
+               off_t                    u,
+               size_t                   st,
+               size_t                   sz ) :
+            buf( b ),
+            uoff( u ),
+            start( st ),
+            size( sz ) { }
+
+        bool operator<( const Slice& o ) const { return uoff < o.uoff; }
+    };
+    typedef std::vector<Slice> Slices;
+
+    // Most blocks to read ahead of a sequential reader, zero to disable
+    static size_t gMaxReadahead;
 
     OpenCompressedFile( const CompressedFile *file,
                         int                   openFlags );
 
+    ~OpenCompressedFile();
+
+    // Fill ubuf with exactly b.usize bytes
     void decompressBlock( const Block& b,
-                          Buffer&      ubuf ) const;
+                          uint8_t*     ubuf ) const;
 
     ssize_t read( BlockCache& cache,
                   char *      buf,
@@ -26,5 +69,17 @@ public:
                   off_t       offset )
     const;
 
-    FileID id() const { return mFile->path(); }
+    // Like read, but reference the cached blocks rather than copying them.
+    // Slices are returned in file order.
+    ssize_t read( BlockCache& cache,
+                  Slices&     slices,
+                  size_t      size,
+                  off_t       offset )
+    const;
+
+    FileID id() const { return mFile->id(); }
+
+    const CompressedFile * file() const { return mFile; }
+
+    const FileHandle& handle() const { return mFH; }
 };
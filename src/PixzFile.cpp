@@ -2,6 +2,7 @@
 
 #include "PathUtils.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 
@@ -12,8 +13,7 @@ const uint64_t PixzFile::MemLimit = UINT64_MAX;
 
 PixzFile::PixzFile( const std::string& path,
                     uint64_t           maxBlock ) :
-    CompressedFile( path ),
-    mIndex( 0 )
+    CompressedFile( path )
 {
     try {
         FileHandle fh( this->path(), O_RDONLY );
@@ -31,7 +31,18 @@ PixzFile::PixzFile( const std::string& path,
             throwFormat( "bad header" );
         }
 
-        mIndex = readIndex( fh );
+        lzma_index *idx = readIndex( fh );
+        lzma_index_iter iter;
+        lzma_index_iter_init( &iter, idx );
+        while ( !lzma_index_iter_next( &iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK ) ) {
+            mIndex.add( iter.block.uncompressed_size,
+                        iter.block.compressed_file_offset,
+                        iter.block.total_size );
+            mChecks.push_back( iter.stream.flags->check );
+        }
+        lzma_index_end( idx, 0 );
+        mIndex.finish();
+        mChecks.shrink_to_fit();
     } catch ( FileHandle::EOFException& e ) {
         throwFormat( "EOF" );
     }
@@ -112,29 +123,12 @@ footer:
     }
 }
 
-PixzFile::~PixzFile()
-{
-    if ( mIndex ) {
-        lzma_index_end( mIndex, 0 );
-    }
-}
-
 void PixzFile::streamInit( lzma_stream& s ) const
 {
     // As suggested in docs for LZMA_STREAM_INIT
     memset( &s, 0, sizeof( lzma_stream ) );
 }
 
-CompressedFile::BlockIterator PixzFile::findBlock( off_t off ) const
-{
-    lzma_index_iter *liter = new lzma_index_iter();
-    lzma_index_iter_init( liter, mIndex );
-    if ( lzma_index_iter_locate( liter, off ) ) {
-        throw std::runtime_error( "can't find block" );
-    }
-    return BlockIterator( new Iterator( liter ) );
-}
-
 // Output should be already set up
 lzma_ret PixzFile::code( lzma_stream&      s,
                          const FileHandle& fh,
@@ -173,87 +167,113 @@ const
     }
 }
 
-void PixzFile::decompressBlock( const FileHandle& fh,
-                                const Block&      b,
-                                Buffer&           ubuf ) const
+// A stream and input buffer, kept initialized between blocks so liblzma
+// can reuse its allocations
+struct PixzFile::DecoderContext
 {
-// fprintf(stderr, "Decompressing from %" PRIu64 "\n", uint64_t(b.coff));
-    const PixzBlock& pb = dynamic_cast<const PixzBlock&>( b );
+    lzma_stream stream;
+    Buffer input;
+
+    DecoderContext() { memset( &stream, 0, sizeof( stream ) ); }
+
+    ~DecoderContext() { lzma_end( &stream ); }
+};
 
+PixzFile::BlockDecoder::BlockDecoder( const PixzFile&   file,
+                                      const FileHandle& fh,
+                                      const Block&      b ) :
+    mFH( fh ),
+    mContext( 0 ),
+    mPos( b.coff ),
+    mRemain( b.usize )
+{
     // Read the block header
-    lzma_block block;
-    memset( &block, 0, sizeof( block ) );
-    block.version = 0;
-    block.check = pb.check;
+    memset( &mBlock, 0, sizeof( mBlock ) );
+    mBlock.version = 0;
+    mBlock.check = lzma_check( file.mChecks[b.index] );
 
-    lzma_filter filters[LZMA_FILTERS_MAX + 1];
-    filters[LZMA_FILTERS_MAX].id = LZMA_VLI_UNKNOWN;
-    block.filters = filters;
+    mFilters[0].id = LZMA_VLI_UNKNOWN;
+    mFilters[LZMA_FILTERS_MAX].id = LZMA_VLI_UNKNOWN;
+    mBlock.filters = mFilters;
 
     Buffer header;
     fh.pread( b.coff, header, 1 );
-    block.header_size = lzma_block_header_size_decode( header[0] );
-    header.resize( block.header_size );
-    fh.pread( b.coff + 1, &header[1], block.header_size - 1 );
+    mBlock.header_size = lzma_block_header_size_decode( header[0] );
+    header.resize( mBlock.header_size );
+    fh.pread( b.coff + 1, &header[1], mBlock.header_size - 1 );
+    mPos += mBlock.header_size;
 
-    lzma_ret err = lzma_block_header_decode( &block, NULL, &header[0] );
+    lzma_ret err = lzma_block_header_decode( &mBlock, NULL, &header[0] );
     if ( err == LZMA_DATA_ERROR ) {
-        throwFormat( "corrupt block header" );
+        file.throwFormat( "corrupt block header" );
     } else if ( err == LZMA_OPTIONS_ERROR ) {
-        throwFormat( "unsupported options in block header" );
+        file.throwFormat( "unsupported options in block header" );
     } else if ( err != LZMA_OK ) {
         throw std::runtime_error( "unknown error in block header" );
     }
 
-
-    // Decode the block
-    lzma_stream s;
-    streamInit( s );
-    if ( lzma_block_decoder( &s, &block ) != LZMA_OK ) {
+    mContext = DecoderContextCache::get();
+    mContext->stream.next_in = 0;
+    mContext->stream.avail_in = 0;
+    if ( lzma_block_decoder( &mContext->stream, &mBlock ) != LZMA_OK ) {
+        delete mContext;
+        for ( size_t i = 0; mFilters[i].id != LZMA_VLI_UNKNOWN; ++i ) {
+            free( mFilters[i].options );
+        }
         throw std::runtime_error( "error initializing block decoder" );
     }
-
-    ubuf.resize( b.usize );
-    s.next_out = &ubuf[0];
-    s.avail_out = ubuf.size();
-    if ( code( s, fh, b.coff + block.header_size ) != LZMA_OK ) {
-        throw std::runtime_error( "error decoding block" );
-    }
 }
 
-off_t PixzFile::uncompressedSize() const
+PixzFile::BlockDecoder::~BlockDecoder()
 {
-    return lzma_index_uncompressed_size( mIndex );
+    DecoderContextCache::put( mContext );
+    for ( size_t i = 0; mFilters[i].id != LZMA_VLI_UNKNOWN; ++i ) {
+        free( mFilters[i].options );
+    }
 }
 
-void PixzFile::Iterator::makeBlock()
+void PixzFile::BlockDecoder::read( uint8_t* buf,
+                                   size_t   size )
 {
-    mBlock.coff = mIter->block.compressed_file_offset;
-    mBlock.uoff = mIter->block.uncompressed_file_offset;
-    mBlock.csize = mIter->block.total_size;
-    mBlock.usize = mIter->block.uncompressed_size;
-    mBlock.check = mIter->stream.flags->check;
+    if ( size > mRemain ) {
+        throw std::runtime_error( "read past end of block" );
+    }
+    mRemain -= size;
+
+    // Once we have everything, keep going to check the block's integrity
+    lzma_stream& s = mContext->stream;
+    Buffer& in = mContext->input;
+    s.next_out = buf;
+    s.avail_out = size;
+    while ( s.avail_out || !mRemain ) {
+        if ( s.avail_in == 0 ) {
+            s.avail_in = mFH.tryPRead( mPos, in, ChunkSize );
+            s.next_in = in.empty() ? 0 : &in[0];
+            mPos += in.size();
+        }
+        lzma_ret err = lzma_code( &s, LZMA_RUN );
+        if ( err == LZMA_STREAM_END ) {
+            break;
+        } else if ( err != LZMA_OK ) {
+            throw std::runtime_error( "error decoding block" );
+        }
+    }
+    if ( s.avail_out ) {
+        throw std::runtime_error( "error decoding block" );
+    }
 }
 
-void PixzFile::Iterator::incr()
+void PixzFile::decompressBlock( const FileHandle& fh,
+                                const Block&      b,
+                                uint8_t*          ubuf ) const
 {
-    if ( mEnd || lzma_index_iter_next(
-             mIter, LZMA_INDEX_ITER_NONEMPTY_BLOCK ) )
-    {
-        mEnd = true;
-    } else {
-        makeBlock();
-    }
+    BlockDecoder( *this, fh, b ).read( ubuf, b.usize );
 }
 
-CompressedFile::BlockIteratorInner *PixzFile::Iterator::dup() const
+CompressedFile::Decoder * PixzFile::decoder( const FileHandle& fh,
+                                             const Block&      b ) const
 {
-    if ( mEnd ) {
-        return new Iterator();
-    }
-
-    // Safe according to lzma_index_iter_init docs
-    return new Iterator( new lzma_index_iter( *mIter ) );
+    return new BlockDecoder( *this, fh, b );
 }
 
 std::string PixzFile::destName() const
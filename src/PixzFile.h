@@ -2,58 +2,48 @@
 
 #include <lzma.h>
 
+#include <vector>
+
 #include "CompressedFile.h"
+#include "ThreadCache.h"
 
 
 class PixzFile : public CompressedFile
 {
 protected:
-    struct PixzBlock : public Block
-    {
-        lzma_check check;
-    };
+    // Reused between blocks, only one per thread since the dictionary can
+    // be large
+    struct DecoderContext;
+    typedef ThreadCache<DecoderContext, 1> DecoderContextCache;
 
-    class Iterator : public BlockIteratorInner
+    // Decodes one block incrementally, checking it once it's all read
+    class BlockDecoder : public Decoder
     {
-        lzma_index_iter *mIter;
-        PixzBlock mBlock;
-        bool mEnd;
-
-        virtual void makeBlock();
-
-        // Disable copy
-        Iterator( const Iterator& o );
-
-        Iterator& operator=( const Iterator& o );
+        const FileHandle& mFH;
+        lzma_block mBlock;
+        lzma_filter mFilters[LZMA_FILTERS_MAX + 1];
+        DecoderContext *mContext;
+        off_t mPos;
+        uint64_t mRemain;
 
     public:
-        Iterator( lzma_index_iter *i ) :
-            mIter( i ),
-            mEnd( false ) { makeBlock(); }
-
-        Iterator() :
-            mIter( 0 ),
-            mEnd( true ) { }
+        BlockDecoder( const PixzFile&   file,
+                      const FileHandle& fh,
+                      const Block&      b );
 
-        virtual ~Iterator()
-        {
-            if ( mIter ) {
-                delete mIter;
-            }
-        }
+        ~BlockDecoder();
 
-        void incr() override;
-
-        const Block& deref() const override { return mBlock; }
-
-        bool end() const override { return mEnd; }
-
-        BlockIteratorInner * dup() const override;
+        void read( uint8_t* buf,
+                   size_t   size ) override;
     };
+    friend class BlockDecoder;
 
     static const uint64_t MemLimit;
 
-    lzma_index *mIndex;
+    // The lzma_index is converted to our own at open, with the check type
+    // of each block's stream alongside
+    BlockIndex mIndex;
+    std::vector<uint8_t> mChecks;
 
     lzma_ret code( lzma_stream&      s,
                    const FileHandle& fh,
@@ -71,16 +61,21 @@ public:
     PixzFile( const std::string& path,
               uint64_t           maxBlock );
 
-    virtual ~PixzFile();
-
     std::string destName() const override;
 
-    BlockIterator findBlock( off_t off ) const override;
+    const char * format() const override { return "xz"; }
+
+    size_t indexSize() const override { return mIndex.memory() + mChecks.capacity(); }
+
+    BlockIterator findBlock( off_t off ) const override { return mIndex.find( off ); }
 
     void decompressBlock( const FileHandle& fh,
                           const Block&      b,
-                          Buffer&           ubuf ) const override;
+                          uint8_t*          ubuf ) const override;
+
+    Decoder * decoder( const FileHandle& fh,
+                       const Block&      b ) const override;
 
-    off_t uncompressedSize() const override;
+    off_t uncompressedSize() const override { return mIndex.uncompressedSize(); }
 
 };
@@ -0,0 +1,231 @@
+#include "Stats.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+
+#include "BlockCache.h"
+#include "CompressedFile.h"
+#include "FileList.h"
+
+void Stats::Histogram::add( uint64_t ns )
+{
+    uint64_t us = ns / 1000;
+    unsigned b = 0;
+    while ( us && b < Buckets - 1 ) {
+        us >>= 1;
+        ++b;
+    }
+    count.add();
+    total.add( ns );
+    buckets[b].add();
+}
+
+Stats::Totals::Totals() :
+    hits( 0 ),
+    joins( 0 ),
+    misses( 0 ),
+    diskHits( 0 ),
+    blocks( 0 ),
+    bytes( 0 ),
+    decode( Histogram::Buckets + 2 ),
+    wait( Histogram::Buckets + 2 ) { }
+
+void Stats::Totals::add( const FileCounters& c )
+{
+    hits += c.hits.get();
+    joins += c.joins.get();
+    misses += c.misses.get();
+    diskHits += c.diskHits.get();
+    blocks += c.blocks.get();
+    bytes += c.bytes.get();
+    addHistogram( decode, c.decode );
+    addHistogram( wait, c.wait );
+}
+
+void Stats::Totals::merge( const Totals& o )
+{
+    hits += o.hits;
+    joins += o.joins;
+    misses += o.misses;
+    diskHits += o.diskHits;
+    blocks += o.blocks;
+    bytes += o.bytes;
+    for ( size_t i = 0; i < decode.size(); ++i ) {
+        decode[i] += o.decode[i];
+        wait[i] += o.wait[i];
+    }
+}
+
+Stats::ThreadStats::ThreadStats() :
+    last( 0 ),
+    lastCounters( 0 )
+{
+    Registry& reg = registry();
+    Lock lock( reg.mutex );
+    reg.threads.push_back( this );
+}
+
+Stats::ThreadStats::~ThreadStats()
+{
+    Registry& reg = registry();
+    Lock lock( reg.mutex );
+    for ( FileMap::iterator i = files.begin(); i != files.end(); ++i ) {
+        reg.exited[i->first].add( *i->second );
+        delete i->second;
+    }
+    reg.threads.erase( std::find( reg.threads.begin(), reg.threads.end(), this ) );
+}
+
+Stats::Registry& Stats::registry()
+{
+    // Never destroyed, threads may exit after static destructors have run
+    static Registry *reg = new Registry();
+    return *reg;
+}
+
+Stats::ThreadStats& Stats::self()
+{
+    static thread_local ThreadStats stats;
+    return stats;
+}
+
+Stats::FileCounters& Stats::file( const CompressedFile* f )
+{
+    // Readers tend to stick to one file, so skip the lookup if we can
+    ThreadStats& ts = self();
+    if ( ts.last == f ) {
+        return *ts.lastCounters;
+    }
+
+    FileMap::iterator i = ts.files.find( f );
+    if ( i == ts.files.end() ) {
+        // Only we change our map, but reports may be reading it
+        Lock lock( registry().mutex );
+        i = ts.files.insert( std::make_pair( f, new FileCounters() ) ).first;
+    }
+    ts.last = f;
+    ts.lastCounters = i->second;
+    return *i->second;
+}
+
+void Stats::addHistogram( std::vector<uint64_t>& to,
+                          const Histogram&       h )
+{
+    to[0] += h.count.get();
+    to[1] += h.total.get();
+    for ( unsigned b = 0; b < Histogram::Buckets; ++b ) {
+        to[b + 2] += h.buckets[b].get();
+    }
+}
+
+void Stats::writeHistogram( std::ostream&                os,
+                            const char*                  name,
+                            const std::vector<uint64_t>& h )
+{
+    os << "  " << name << ": " << h[0];
+    if ( h[0] ) {
+        os << ", mean " << h[1] / h[0] / 1000 << " us;";
+        for ( unsigned b = 0; b < Histogram::Buckets; ++b ) {
+            if ( h[b + 2] ) {
+                if ( b == Histogram::Buckets - 1 ) {
+                    os << " >=" << ( uint64_t( 1 ) << ( b - 1 ) );
+                } else {
+                    os << " <" << ( uint64_t( 1 ) << b );
+                }
+                os << "us:" << h[b + 2];
+            }
+        }
+    }
+    os << "\n";
+}
+
+void Stats::writeTotals( std::ostream& os,
+                         const Totals& t )
+{
+    uint64_t lookups = t.hits + t.joins + t.misses;
+    os << "  hits " << t.hits << ", joined " << t.joins << ", misses " << t.misses;
+    if ( lookups ) {
+        os << " (" << std::fixed << std::setprecision( 1 )
+           << 100.0 * t.hits / lookups << "% hit)";
+    }
+    os << ", from disk " << t.diskHits << "\n";
+    os << "  decoded " << t.blocks << " blocks, " << t.bytes << " bytes\n";
+    writeHistogram( os, "decode", t.decode );
+    writeHistogram( os, "queued", t.wait );
+}
+
+void Stats::report( std::ostream&     os,
+                    FileList&         files,
+                    const BlockCache& cache,
+                    ThreadPool&       pool )
+{
+    Registry& reg = registry();
+    std::map<std::string, Totals> byFile, byFormat;
+    std::map<std::string, size_t> indexSize;
+    std::map<std::string, off_t> indexing;      // how much is indexed so far
+    Totals all;
+    size_t index = 0;
+
+    std::vector<std::string> names;
+    files.forNames( [&names]( const std::string& n ) { names.push_back( n ); } );
+    {
+        Lock lock( reg.mutex );
+        for ( size_t i = 0; i < names.size(); ++i ) {
+            const CompressedFile *f = files.find( names[i] );
+            Totals& t = byFile[names[i]];
+            for ( size_t j = 0; j < reg.threads.size(); ++j ) {
+                FileMap::const_iterator c = reg.threads[j]->files.find( f );
+                if ( c != reg.threads[j]->files.end() ) {
+                    t.add( *c->second );
+                }
+            }
+            std::unordered_map<const CompressedFile*, Totals>::const_iterator e =
+                reg.exited.find( f );
+            if ( e != reg.exited.end() ) {
+                t.merge( e->second );
+            }
+            byFormat[f->format()].merge( t );
+            all.merge( t );
+            indexSize[names[i]] = f->indexSize();
+            if ( f->indexing() ) {
+                indexing[names[i]] = f->uncompressedSize();
+            }
+            index += indexSize[names[i]];
+        }
+    }
+
+    ThreadPool::Usage use = pool.usage();
+    double uptime = ( now() - reg.start ) / 1e9;
+    os << std::fixed << std::setprecision( 1 );
+    os << "uptime " << uptime << " s\n";
+    os << "cache: " << cache.size() << " of " << cache.maxSize() << " bytes, "
+       << cache.decoding() << " being decoded, " << cache.inFlight()
+       << " blocks in flight\n";
+    os << "pool: " << use.threads << " threads, " << use.idle << " idle, "
+       << ( uptime > 0 ? 100.0 * use.busy / 1e9 / uptime / use.threads : 0.0 )
+       << "% busy; queued " << use.queued[ThreadPool::Demand] << " demand, "
+       << use.queued[ThreadPool::Prefetch] << " prefetch, "
+       << use.queued[ThreadPool::Background] << " background\n";
+    os << "index: " << index << " bytes\n";
+
+    os << "\ntotal\n";
+    writeTotals( os, all );
+    for ( std::map<std::string, Totals>::const_iterator i = byFormat.begin();
+          i != byFormat.end(); ++i )
+    {
+        os << "\nformat " << i->first << "\n";
+        writeTotals( os, i->second );
+    }
+    for ( std::map<std::string, Totals>::const_iterator i = byFile.begin();
+          i != byFile.end(); ++i )
+    {
+        os << "\nfile " << i->first << "\n";
+        os << "  index " << indexSize[i->first] << " bytes";
+        if ( indexing.count( i->first ) ) {
+            os << ", still building, " << indexing[i->first] << " bytes covered";
+        }
+        os << "\n";
+        writeTotals( os, i->second );
+    }
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "ThreadPool.h"
+
+
+class BlockCache;
+class CompressedFile;
+class FileList;
+
+
+/**
+ * Counters of what we're doing, for reporting in a virtual file.
+ *
+ * Each thread keeps its own counters for each file it touches, so updating
+ * them needs no locks or shared cache lines. Reports add them all up, and
+ * the counters of threads that exit are folded into a common total.
+ */
+class Stats
+{
+public:
+    // Only ever written by one thread at a time, but read by others
+    class Counter
+    {
+        std::atomic<uint64_t> mValue;
+
+    public:
+        Counter() :
+            mValue( 0 ) { }
+
+        void add( uint64_t n = 1 )
+        {
+            mValue.store( mValue.load( std::memory_order_relaxed ) + n,
+                          std::memory_order_relaxed );
+        }
+
+        uint64_t get() const { return mValue.load( std::memory_order_relaxed ); }
+    };
+
+    // Durations in power-of-two buckets of microseconds
+    struct Histogram
+    {
+        static const unsigned Buckets = 24;     // the last is 2^22us, ~4s, and up
+
+        Counter count, total;                   // total in nanoseconds
+        Counter buckets[Buckets];
+
+        void add( uint64_t ns );
+    };
+
+    struct FileCounters
+    {
+        Counter hits;           // found in the cache
+        Counter joins;          // already being decompressed for someone
+        Counter misses;         // queued for decompression
+        Counter diskHits;       // loaded from the disk cache instead
+        Counter blocks, bytes;  // decompressed
+        Histogram decode;       // time to decompress a block
+        Histogram wait;         // time a job spent queued
+    };
+
+    // Monotonic nanoseconds
+    static uint64_t now()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return uint64_t( ts.tv_sec ) * 1000000000 + ts.tv_nsec;
+    }
+
+    // This thread's counters for a file
+    static FileCounters& file( const CompressedFile* f );
+
+    // Write a report of everything
+    static void report( std::ostream&     os,
+                        FileList&         files,
+                        const BlockCache& cache,
+                        ThreadPool&       pool );
+
+protected:
+    typedef std::unordered_map<const CompressedFile*, FileCounters*> FileMap;
+
+    struct Totals
+    {
+        uint64_t hits, joins, misses, diskHits, blocks, bytes;
+        std::vector<uint64_t> decode, wait;     // count, total, buckets
+
+        Totals();
+
+        void add( const FileCounters& c );
+
+        void merge( const Totals& o );
+    };
+
+    // One per thread, registered while the thread lives
+    struct ThreadStats
+    {
+        FileMap files;
+        const CompressedFile *last;
+        FileCounters *lastCounters;
+
+        ThreadStats();
+
+        ~ThreadStats();
+    };
+    friend struct ThreadStats;
+
+    struct Registry
+    {
+        Mutex mutex;        // for the list, and inserting into any FileMap
+        std::vector<ThreadStats*> threads;
+        std::unordered_map<const CompressedFile*, Totals> exited;
+        uint64_t start;
+
+        Registry() :
+            start( now() ) { }
+    };
+
+    static Registry& registry();
+
+    static ThreadStats& self();
+
+    static void addHistogram( std::vector<uint64_t>& to,
+                              const Histogram&       h );
+
+    static void writeHistogram( std::ostream&                os,
+                                const char*                  name,
+                                const std::vector<uint64_t>& h );
+
+    static void writeTotals( std::ostream& os,
+                             const Totals& t );
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// A few idle objects kept by each thread, for things that are costly to set
+// up. Objects may be returned on a different thread than they came from.
+template <typename T, size_t MaxIdle = 4>
+class ThreadCache
+{
+    std::vector<T*> mIdle;
+
+    static ThreadCache& self()
+    {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+public:
+    ~ThreadCache()
+    {
+        for ( size_t i = 0; i < mIdle.size(); ++i ) {
+            delete mIdle[i];
+        }
+    }
+
+    // An idle object if there is one, otherwise a new one
+    static T * get()
+    {
+        std::vector<T*>& idle = self().mIdle;
+        if ( idle.empty() ) {
+            return new T();
+        }
+        T *t = idle.back();
+        idle.pop_back();
+        return t;
+    }
+
+    static void put( T* t )
+    {
+        std::vector<T*>& idle = self().mIdle;
+        if ( idle.size() < MaxIdle ) {
+            idle.push_back( t );
+        } else {
+            delete t;
+        }
+    }
+};
@@ -5,7 +5,103 @@
 #include <signal.h>
 #include <unistd.h>
 
+#include "Stats.h"
+
+namespace {
+thread_local void *gCurrentWorker = 0;
+}
+
+size_t ThreadPool::gMaxPrefetch = 64;
+
+bool ThreadPool::WorkQueue::push( Job *job )
+{
+    int64_t b = mBottom.load( std::memory_order_relaxed );
+    int64_t t = mTop.load( std::memory_order_acquire );
+    if ( b - t >= Size ) {
+        return false;
+    }
+    mJobs[b % Size].store( job, std::memory_order_relaxed );
+    mBottom.store( b + 1, std::memory_order_release );
+    return true;
+}
+
+ThreadPool::Job* ThreadPool::WorkQueue::pop()
+{
+    // Publishing the decrement before looking at top is what keeps us from
+    // racing a thief for the same job, so both need to be seq_cst
+    int64_t b = mBottom.load( std::memory_order_relaxed ) - 1;
+    mBottom.store( b, std::memory_order_seq_cst );
+    int64_t t = mTop.load( std::memory_order_seq_cst );
+
+    Job *job = 0;
+    if ( t <= b ) {
+        job = mJobs[b % Size].load( std::memory_order_relaxed );
+        if ( t == b ) {
+            // Last one, race against thieves for it
+            if ( !mTop.compare_exchange_strong( t, t + 1,
+                                                std::memory_order_seq_cst,
+                                                std::memory_order_relaxed ) )
+            {
+                job = 0;
+            }
+            mBottom.store( b + 1, std::memory_order_relaxed );
+        }
+    } else {
+        mBottom.store( b + 1, std::memory_order_relaxed );
+    }
+    return job;
+}
+
+ThreadPool::Job* ThreadPool::WorkQueue::steal()
+{
+    int64_t t = mTop.load( std::memory_order_seq_cst );
+    int64_t b = mBottom.load( std::memory_order_seq_cst );
+    if ( t >= b ) {
+        return 0;
+    }
+
+    Job *job = mJobs[t % Size].load( std::memory_order_relaxed );
+    if ( !mTop.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed ) )
+    {
+        return 0;       // lost the race
+    }
+    return job;
+}
+
+bool ThreadPool::WorkQueue::empty() const
+{
+    return mBottom.load( std::memory_order_acquire )
+           <= mTop.load( std::memory_order_acquire );
+}
+
+size_t ThreadPool::WorkQueue::size() const
+{
+    int64_t n = mBottom.load( std::memory_order_acquire )
+                - mTop.load( std::memory_order_acquire );
+    return n > 0 ? n : 0;
+}
+
+void ThreadPool::JobList::push( Job *job )
+{
+    job->mPrev = tail;
+    job->mNext = 0;
+    ( tail ? tail->mNext : head ) = job;
+    tail = job;
+    ++size;
+}
+
+void ThreadPool::JobList::remove( Job *job )
+{
+    ( job->mPrev ? job->mPrev->mNext : head ) = job->mNext;
+    ( job->mNext ? job->mNext->mPrev : tail ) = job->mPrev;
+    job->mPrev = job->mNext = 0;
+    --size;
+}
+
 ThreadPool::ThreadPool( size_t threads ) :
+    mIdle( 0 ),
+    mBackground( 0 ),
     mCancelling( false )
 {
     Lock lock( mCond );
@@ -13,11 +109,16 @@ ThreadPool::ThreadPool( size_t threads ) :
     if ( threads == 0 ) {
         threads = systemCPUs();
     }
-    mThreads.resize( threads );
+    mThreads.reserve( threads );
+
+    // Always keep a thread free for demand reads. With only one, background
+    // jobs wait until they're promoted.
+    mMaxBackground = threads - 1;
+    for ( size_t i = 0; i < threads; ++i ) {
+        mThreads.push_back( new ThreadInfo( this, i ) );
+    }
     for ( size_t i = 0; i < threads; ++i ) {
-        mThreads.push_back( ThreadInfo( this, i ) );
-        ThreadInfo& info = mThreads.back();
-        pthread_create( &info.pthread, 0, &threadFunc, &info );
+        pthread_create( &mThreads[i]->pthread, 0, &threadFunc, mThreads[i] );
     }
 }
 
@@ -29,21 +130,22 @@ void *ThreadPool::threadFunc( void *val )
     pthread_sigmask( SIG_BLOCK, &allsig, NULL );
 
     ThreadInfo *info = reinterpret_cast<ThreadInfo*>( val );
+    gCurrentWorker = info;
 
     while ( true ) {
-        Job *job = info->pool->nextJob();
+        Job *job = info->pool->nextJob( *info );
+        if ( !job ) {
+            pthread_exit( 0 );               // we're being cancelled
+        }
+        uint64_t start = Stats::now();
         try {
-            if ( !job ) {
-                pthread_exit( 0 );               // we're being cancelled
-            }
             ( *job )();
         } catch ( ... ) {
-            if ( job ) {
-                delete job;
-            }
+            info->pool->finished( job );
             throw;
         }
-        delete job;
+        info->busy += Stats::now() - start;
+        info->pool->finished( job );
     }
 }
 
@@ -52,47 +154,235 @@ ThreadPool::~ThreadPool()
     {
         Lock lock( mCond );
         mCancelling = true;
+        mCond.broadcast();
+    }
 
-        // delete any jobs left in the queue
-        while ( !mJobs.empty() ) {
-            delete mJobs.front();
-            mJobs.pop();
-        }
+    for ( ThreadList::iterator i = mThreads.begin(); i < mThreads.end(); ++i ) {
+        pthread_join( ( *i )->pthread, 0 );
+    }
 
-        for ( size_t i = 0; i < mThreads.size(); ++i ) {
-            mJobs.push( 0 );           // request cancellation
+    // release any jobs left in the queues
+    for ( JobQ::iterator i = mJobs.begin(); i != mJobs.end(); ++i ) {
+        ( *i )->release();
+    }
+    for ( size_t p = Demand + 1; p < PriorityCount; ++p ) {
+        while ( Job *job = mLow[p].head ) {
+            mLow[p].remove( job );
+            job->release();
         }
-        mCond.broadcast();
     }
-
     for ( ThreadList::iterator i = mThreads.begin(); i < mThreads.end(); ++i ) {
-        pthread_join( i->pthread, 0 );
+        while ( Job *job = ( *i )->queue.pop() ) {
+            job->release();
+        }
+        delete *i;
     }
 }
 
-size_t ThreadPool::systemCPUs() const
+size_t ThreadPool::systemCPUs()
 {
     return sysconf( _SC_NPROCESSORS_ONLN );
 }
 
-ThreadPool::Job* ThreadPool::nextJob()
+ThreadPool::ThreadInfo* ThreadPool::self() const
 {
-    Lock lock( mCond );
-    while ( mJobs.empty() ) {
-        mCond.wait();
+    ThreadInfo *info = reinterpret_cast<ThreadInfo*>( gCurrentWorker );
+    return ( info && info->pool == this ) ? info : 0;
+}
+
+ThreadPool::Job* ThreadPool::takeShared( ThreadInfo& info )
+{
+    if ( mJobs.empty() ) {
+        return 0;
     }
+
+    // Take our fair share, so the others have something to steal
+    size_t take = 1 + ( mJobs.size() - 1 ) / mThreads.size();
     Job *job = mJobs.front();
-    mJobs.pop();
+    mJobs.pop_front();
+    for ( ; take > 1 && info.queue.push( mJobs.front() ); --take ) {
+        mJobs.pop_front();
+    }
+    if ( mIdle && !info.queue.empty() ) {
+        mCond.signal();
+    }
     return job;
 }
 
-void ThreadPool::enqueue( Job *job )
+ThreadPool::Job* ThreadPool::steal( ThreadInfo& info )
+{
+    for ( size_t i = 1; i < mThreads.size(); ++i ) {
+        ThreadInfo& victim = *mThreads[( info.num + i ) % mThreads.size()];
+        if ( Job *job = victim.queue.steal() ) {
+            return job;
+        }
+    }
+    return 0;
+}
+
+bool ThreadPool::anyStealable( ThreadInfo& info ) const
 {
+    for ( size_t i = 0; i < mThreads.size(); ++i ) {
+        if ( mThreads[i] != &info && !mThreads[i]->queue.empty() ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ThreadPool::Job* ThreadPool::takeLow()
+{
+    Job *job = mLow[Prefetch].head;
+    if ( !job && mBackground < mMaxBackground ) {
+        job = mLow[Background].head;
+    }
+    if ( job ) {
+        mLow[job->mPriority].remove( job );
+        job->mQueued = false;
+        if ( job->mPriority == Background ) {
+            ++mBackground;
+        }
+    }
+    return job;
+}
+
+ThreadPool::Job* ThreadPool::nextJob( ThreadInfo& info )
+{
+    while ( true ) {
+        if ( Job *job = info.queue.pop() ) {
+            return job;
+        }
+        if ( Job *job = steal( info ) ) {
+            return job;
+        }
+
+        Lock lock( mCond );
+        if ( Job *job = takeShared( info ) ) {
+            return job;
+        }
+        if ( Job *job = takeLow() ) {
+            return job;
+        }
+
+        // Anyone pushing to their deque after this check will see us idle
+        // and wake us
+        ++mIdle;
+        while ( !mCancelling && mJobs.empty() && !anyStealable( info )
+                && !mLow[Prefetch].size
+                && !( mLow[Background].size && mBackground < mMaxBackground ) )
+        {
+            mCond.wait();
+        }
+        --mIdle;
+        if ( mCancelling ) {
+            return 0;
+        }
+    }
+}
+
+void ThreadPool::finished( Job *job )
+{
+    // Read the priority first, the job may be recycled by release()
+    if ( job->mPriority == Background ) {
+        Lock lock( mCond );
+        --mBackground;
+        if ( mLow[Background].size && mIdle ) {
+            mCond.signal();
+        }
+    }
+    job->release();
+}
+
+bool ThreadPool::enqueue( Job     *job,
+                          Priority pri )
+{
+    return enqueue( &job, 1, pri );
+}
+
+bool ThreadPool::enqueue( Job* const* jobs,
+                          size_t      count,
+                          Priority    pri )
+{
+    // Refuse before queueing any, so none were accepted
     Lock lock( mCond );
     if ( mCancelling ) {
         throw std::runtime_error( "Can't add jobs while cancelling" );
     }
 
-    mJobs.push( job );
-    mCond.signal();
+    // From a worker, keep demand jobs local and let others steal them
+    ThreadInfo *info = pri == Demand ? self() : 0;
+    size_t local = 0;
+    if ( info ) {
+        for ( ; local < count; ++local ) {
+            jobs[local]->mPriority = Demand;
+            if ( !info->queue.push( jobs[local] ) ) {
+                break;
+            }
+        }
+    }
+
+    if ( pri == Demand ) {
+        for ( size_t i = local; i < count; ++i ) {
+            jobs[i]->mPriority = Demand;
+            mJobs.push_back( jobs[i] );
+        }
+    } else {
+        if ( pri == Prefetch && mLow[Prefetch].size + count > gMaxPrefetch ) {
+            return false;
+        }
+        for ( size_t i = 0; i < count; ++i ) {
+            jobs[i]->mPriority = pri;
+            jobs[i]->mQueued = true;
+            mLow[pri].push( jobs[i] );
+        }
+    }
+
+    if ( count >= mIdle ) {
+        mCond.broadcast();
+    } else {
+        for ( size_t i = 0; i < count; ++i ) {
+            mCond.signal();
+        }
+    }
+    return true;
+}
+
+void ThreadPool::promote( Job     *job,
+                          Priority pri )
+{
+    Lock lock( mCond );
+    if ( !job->mQueued || job->mPriority <= pri ) {
+        return;                 // already running, or important enough
+    }
+
+    mLow[job->mPriority].remove( job );
+    job->mPriority = pri;
+    if ( pri == Demand ) {
+        job->mQueued = false;
+        mJobs.push_front( job );        // someone's already waiting
+    } else {
+        mLow[pri].push( job );
+    }
+    if ( mIdle ) {
+        mCond.signal();
+    }
+}
+
+ThreadPool::Usage ThreadPool::usage()
+{
+    Usage u;
+    u.threads = mThreads.size();
+    u.busy = 0;
+
+    Lock lock( mCond );
+    u.idle = mIdle;
+    u.queued[Demand] = mJobs.size();
+    for ( ThreadList::iterator i = mThreads.begin(); i != mThreads.end(); ++i ) {
+        u.queued[Demand] += ( *i )->queue.size();
+        u.busy += ( *i )->busy;
+    }
+    for ( int p = Prefetch; p < PriorityCount; ++p ) {
+        u.queued[p] = mLow[p].size;
+    }
+    return u;
 }
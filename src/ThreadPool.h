@@ -1,8 +1,12 @@
 #pragma once
 
-#include <queue>
+#include <atomic>
+#include <deque>
+#include <vector>
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 
 class Mutex
@@ -44,53 +48,183 @@ public:
 
     void wait() { pthread_cond_wait( &mCond, &mMutex ); }
 
+    // Wait until signalled, or the realtime clock reaches a deadline
+    void wait( const struct timespec& until )
+    { pthread_cond_timedwait( &mCond, &mMutex, &until ); }
+
     void signal() { pthread_cond_signal( &mCond ); }
 
     void broadcast() { pthread_cond_broadcast( &mCond ); }
 };
 
 
+/**
+ * A work-stealing thread pool.
+ *
+ * Each worker has its own lock-free deque. Jobs enqueued from outside the
+ * pool go into a shared queue, from which a worker takes its share in one go.
+ * Idle workers steal from the other workers' deques before going to sleep.
+ */
 class ThreadPool
 {
 public:
+    enum Priority
+    {
+        Demand,         // someone is waiting for it
+        Prefetch,       // speculative, refused if too many are queued
+        Background,     // only runs on threads nobody else needs
+        PriorityCount,
+    };
+
     struct Job
     {
+        Job() :
+            mPrev( 0 ),
+            mNext( 0 ),
+            mPriority( Demand ),
+            mQueued( false ) { }
+
         virtual void operator()() = 0;
 
+        // Called once the job has run, or if it's dropped. Owners that pool
+        // their jobs can recycle them here.
+        virtual void release() { delete this; }
+
         virtual ~Job() { }
+
+    private:
+        friend class ThreadPool;
+
+        // Position in a low-priority queue
+        Job *mPrev, *mNext;
+        Priority mPriority;
+        bool mQueued;
+    };
+
+    // How many prefetch jobs may be queued at once
+    static size_t gMaxPrefetch;
+
+    // A snapshot of how busy we are
+    struct Usage
+    {
+        size_t threads, idle;
+        size_t queued[PriorityCount];
+        uint64_t busy;              // nanoseconds spent running jobs, by all
     };
 
 protected:
+    // Fixed-size Chase-Lev deque. Only the owner pushes and pops at the
+    // bottom, anyone may steal from the top.
+    class WorkQueue
+    {
+        static const int64_t Size = 256;
+
+        std::atomic<int64_t> mTop, mBottom;
+        std::atomic<Job*> mJobs[Size];
+
+    public:
+        WorkQueue() :
+            mTop( 0 ),
+            mBottom( 0 ) { }
+
+        bool push( Job* job );      // False if full
+
+        Job * pop();
+
+        Job * steal();
+
+        bool empty() const;
+
+        // Roughly how many jobs are waiting
+        size_t size() const;
+    };
+
     struct ThreadInfo
     {
         ThreadPool *pool;
         pthread_t pthread;
         size_t num;
+        WorkQueue queue;
+        std::atomic<uint64_t> busy;     // nanoseconds spent running jobs
 
         ThreadInfo( ThreadPool *p = 0,
                     size_t      n = 0 ) :
             pool( p ),
-            num( n ) { }
+            num( n ),
+            busy( 0 ) { }
     };
-    typedef std::vector<ThreadInfo> ThreadList;
+    typedef std::vector<ThreadInfo*> ThreadList;
     ThreadList mThreads;
-    ConditionVariable mCond;
+    ConditionVariable mCond;            // guards everything below
+
+    // Low-priority jobs wait in FIFO lists, so they can be promoted
+    struct JobList
+    {
+        Job *head, *tail;
+        size_t size;
 
-    typedef std::queue<Job*> JobQ;
-    JobQ mJobs;
+        JobList() :
+            head( 0 ),
+            tail( 0 ),
+            size( 0 ) { }
+
+        void push( Job* job );
+
+        void remove( Job* job );
+    };
+
+    typedef std::deque<Job*> JobQ;
+    JobQ mJobs;                         // demand jobs
+    JobList mLow[PriorityCount];        // indexed by priority, demand unused
+    size_t mIdle;
+    size_t mBackground, mMaxBackground; // background jobs running
     bool mCancelling;
 
-    size_t systemCPUs() const;
+    // The worker we're running on, if any
+    ThreadInfo * self() const;
+
+    // Take a share of the shared queue, keeping the extras locally. Call
+    // with mCond held.
+    Job * takeShared( ThreadInfo& info );
 
-    Job * nextJob();
+    Job * steal( ThreadInfo& info );
+
+    bool anyStealable( ThreadInfo& info ) const;
+
+    // Next low-priority job we may run, call with mCond held
+    Job * takeLow();
+
+    Job * nextJob( ThreadInfo& info );
+
+    void finished( Job* job );
 
     static void * threadFunc( void *val );
 
 public:
+    // Zero threads for one per CPU
     ThreadPool( size_t threads = 0 );
 
+    static size_t systemCPUs();
+
     ~ThreadPool();
 
-    void enqueue( Job* job );
+    size_t threads() const { return mThreads.size(); }
+
+    Usage usage();
+
+    // Returns false if the job was refused, and still belongs to the caller
+    bool enqueue( Job*     job,
+                  Priority pri = Demand );
+
+    // Enqueue several jobs, with a single lock and wakeup round. They're all
+    // accepted, or none are.
+    bool enqueue( Job* const* jobs,
+                  size_t      count,
+                  Priority    pri = Demand );
+
+    // Raise the priority of a job, if it's still queued. The caller must
+    // know the job hasn't been released.
+    void promote( Job*     job,
+                  Priority pri = Demand );
 
 };
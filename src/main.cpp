@@ -1,19 +1,28 @@
+#include <algorithm>
 #include <cstddef>
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <sstream>
 
-#define FUSE_USE_VERSION 26
+#include <sys/resource.h>
+
+#define FUSE_USE_VERSION 29
 #include <fuse.h>
 
 #include "BlockCache.h"
 #include "CompressedFile.h"
+#include "DiskCache.h"
 #include "FileList.h"
 #include "GzipFile.h"
+#include "IndexDir.h"
+#include "MemoryMonitor.h"
 #include "OpenCompressedFile.h"
 #include "PathUtils.h"
+#include "Stats.h"
 #include "ThreadPool.h"
 
 
@@ -21,23 +30,56 @@ namespace {
 
 typedef uint64_t FuseFH;
 
-const size_t CacheSize = 1024 * 1024 * 32;
+// A virtual file reporting what we're up to
+const char StatsDir[] = "/.lzopfs";
+const char StatsPath[] = "/.lzopfs/stats";
+
+// The cache resizes itself between these, unless they're equal
+size_t CacheFloor = 1024 * 1024 * 32;
+size_t CacheCeiling = 0;                // half of our memory limit
+LRUMapBase::Policy CachePolicy = LRUMapBase::TwoQ;
+std::string DiskCacheDir;
+uint64_t DiskCacheSize = uint64_t( 1024 ) * 1024 * 1024;
+
+// Most cached blocks to give memory files, each costs a descriptor
+const size_t MaxBlockFiles = 4096;
 
 struct FSData
 {
     FileList *files;
-    ThreadPool pool;
+    ThreadPool indexPool;                 // for the builds on pool
+    ThreadPool pool;                      // at least two, so background jobs get one
+    std::unique_ptr<DiskCache> disk;      // outlives the cache using it
     BlockCache cache;
+    std::unique_ptr<MemoryMonitor> monitor;
 
     FSData( FileList* f ) :
         files( f ),
-        pool(),
-        cache( pool )
+        indexPool( IndexedCompFile::gIndexThreads ),
+        pool( std::max( ThreadPool::systemCPUs(), size_t( 2 ) ) ),
+        disk(),
+        cache( pool, CacheCeiling ),
+        monitor()
     {
-        cache.maxSize( CacheSize );
+        cache.policy( CachePolicy );
+        if ( !DiskCacheDir.empty() ) {
+            disk.reset( new DiskCache( pool, DiskCacheDir, DiskCacheSize ) );
+            cache.diskCache( disk.get() );
+        }
+
+        // Started here since threads don't survive FUSE daemonizing
+        if ( CacheFloor < CacheCeiling ) {
+            monitor.reset( new MemoryMonitor( cache, CacheFloor, CacheCeiling ) );
+        }
+        IndexedCompFile::gIndexPool = &indexPool;
+        files->index( pool );
     }
 
-    ~FSData() { delete files; }
+    ~FSData()
+    {
+        delete files;
+        IndexedCompFile::gIndexPool = 0;
+    }
 };
 
 FSData * fsdata()
@@ -45,12 +87,38 @@ FSData * fsdata()
     return reinterpret_cast<FSData*>( fuse_get_context()->private_data );
 }
 
-extern "C" void * lf_init( struct fuse_conn_info * )
+// Blocks referenced by the last reply from this thread. FUSE has sent that
+// reply before it calls us again, so we let go of them then. Until then
+// they can't be evicted, so each FUSE thread may hold a read's worth of
+// blocks while it's idle, and FUSE keeps up to ten idle threads.
+thread_local OpenCompressedFile::Slices gPinned;
+
+void unpin()
 {
+    gPinned.clear();
+}
+
+extern "C" void * lf_init( struct fuse_conn_info *conn )
+{
+    // Let FUSE splice replies straight from memory files. They're only worth
+    // a descriptor each if it can, so leave plenty for the files we serve.
+    struct rlimit nofile;
+    if ( ( conn->capable & FUSE_CAP_SPLICE_WRITE )
+         && getrlimit( RLIMIT_NOFILE, &nofile ) == 0 )
+    {
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+        BufferPool::gMaxFiles = std::min( size_t( nofile.rlim_cur / 2 ), MaxBlockFiles );
+    }
+
     void *priv = fuse_get_context()->private_data;
     return new FSData( reinterpret_cast<FileList*>( priv ) );
 }
 
+extern "C" void lf_destroy( void * )
+{
+    unpin();
+}
+
 extern "C" int lf_getattr( const char * path,
                            struct stat *stbuf )
 {
@@ -60,10 +128,16 @@ extern "C" int lf_getattr( const char * path,
     if ( strcmp( path, "/" ) == 0 ) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 3;
+    } else if ( strcmp( path, StatsDir ) == 0 ) {
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+    } else if ( strcmp( path, StatsPath ) == 0 ) {
+        stbuf->st_mode = S_IFREG | 0444;        // size unknown, so direct_io
+        stbuf->st_nlink = 1;
     } else if ( ( file = fsdata()->files->find( path ) ) ) {
         stbuf->st_mode = S_IFREG | 0444;
         stbuf->st_nlink = 1;
-        stbuf->st_size = file->uncompressedSize();
+        stbuf->st_size = file->apparentSize();
     } else {
         return -ENOENT;
     }
@@ -92,19 +166,63 @@ extern "C" int lf_readdir( const char *           path,
                            off_t                  ,
                            struct fuse_file_info * )
 {
+    if ( strcmp( path, StatsDir ) == 0 ) {
+        filler( buf, ".", NULL, 0 );
+        filler( buf, "..", NULL, 0 );
+        filler( buf, strrchr( StatsPath, '/' ) + 1, NULL, 0 );
+        return 0;
+    }
     if ( strcmp( path, "/" ) != 0 ) {
         return -ENOENT;
     }
 
     filler( buf, ".", NULL, 0 );
     filler( buf, "..", NULL, 0 );
+    filler( buf, StatsDir + 1, NULL, 0 );
     fsdata()->files->forNames( DirFiller( buf, filler ) );
     return 0;
 }
 
+// Stats are a snapshot taken at open, held as the file handle
+bool isStats( const char *path )
+{
+    return strcmp( path, StatsPath ) == 0;
+}
+
+int openStats( struct fuse_file_info *fi )
+{
+    FSData *fs = fsdata();
+    std::ostringstream os;
+    Stats::report( os, *fs->files, fs->cache, fs->pool );
+    fi->fh = FuseFH( new std::string( os.str() ) );
+    fi->direct_io = 1;
+    return 0;
+}
+
+size_t readStats( struct fuse_file_info *fi,
+                  char *                 buf,
+                  size_t                 size,
+                  off_t                  offset )
+{
+    const std::string& report = *reinterpret_cast<std::string*>( fi->fh );
+    if ( offset >= off_t( report.size() ) ) {
+        return 0;
+    }
+    size = std::min( size, report.size() - offset );
+    memcpy( buf, report.data() + offset, size );
+    return size;
+}
+
 extern "C" int lf_open( const char *           path,
                         struct fuse_file_info *fi )
 {
+    if ( isStats( path ) ) {
+        if ( ( fi->flags & O_ACCMODE ) != O_RDONLY ) {
+            return -EACCES;
+        }
+        return openStats( fi );
+    }
+
     CompressedFile *file;
     if ( !( file = fsdata()->files->find( path ) ) ) {
         return -ENOENT;
@@ -115,26 +233,37 @@ extern "C" int lf_open( const char *           path,
 
     try {
         fi->fh = FuseFH( new OpenCompressedFile( file, fi->flags ) );
+        fi->direct_io = file->indexing();       // our size may be a guess
         return 0;
     } catch ( FileHandle::Exception& e ) {
         return e.error_code;
     }
 }
 
-extern "C" int lf_release( const char *           ,
+extern "C" int lf_release( const char *           path,
                            struct fuse_file_info *fi )
 {
+    if ( isStats( path ) ) {
+        delete reinterpret_cast<std::string*>( fi->fh );
+        fi->fh = 0;
+        return 0;
+    }
     delete reinterpret_cast<OpenCompressedFile*>( fi->fh );
     fi->fh = 0;
+    unpin();
     return 0;
 }
 
-extern "C" int lf_read( const char *           ,
+extern "C" int lf_read( const char *           path,
                         char *                 buf,
                         size_t                 size,
                         off_t                  offset,
                         struct fuse_file_info *fi )
 {
+    if ( isStats( path ) ) {
+        return readStats( fi, buf, size, offset );
+    }
+
     int ret = -1;
     try {
         ret = reinterpret_cast<OpenCompressedFile*>( fi->fh )->read(
@@ -146,17 +275,118 @@ extern "C" int lf_read( const char *           ,
     return ret;
 }
 
+extern "C" int lf_read_buf( const char *           path,
+                            struct fuse_bufvec **  bufp,
+                            size_t                 size,
+                            off_t                  offset,
+                            struct fuse_file_info *fi )
+{
+    unpin();
+    if ( isStats( path ) ) {
+        fuse_bufvec *bv = reinterpret_cast<fuse_bufvec*>( malloc( sizeof( fuse_bufvec ) ) );
+        char *mem = reinterpret_cast<char*>( malloc( size ? size : 1 ) );
+        if ( !bv || !mem ) {
+            free( bv );
+            free( mem );
+            return -ENOMEM;
+        }
+        memset( bv, 0, sizeof( fuse_bufvec ) );
+        bv->count = 1;
+        bv->buf[0].mem = mem;
+        bv->buf[0].size = readStats( fi, mem, size, offset );
+        *bufp = bv;
+        return 0;
+    }
+
+    OpenCompressedFile::Slices& slices = gPinned;
+
+    ssize_t ret = 0;
+    try {
+        ret = reinterpret_cast<OpenCompressedFile*>( fi->fh )->read(
+            fsdata()->cache, slices, size, offset );
+    } catch ( std::runtime_error& e ) {
+        fprintf( stderr, "%s: %s\n", typeid( e ).name(), e.what() );
+        exit( 1 );
+    }
+
+    // Point FUSE at the blocks themselves if they all have files, otherwise
+    // copy. FUSE frees any memory buffers, so we can't hand it ours.
+    bool shared = !slices.empty();
+    for ( size_t i = 0; i < slices.size(); ++i ) {
+        shared = shared && slices[i].buf->fd() != -1;
+    }
+
+    size_t count = shared ? slices.size() : 1;
+    fuse_bufvec *bv = reinterpret_cast<fuse_bufvec*>(
+        malloc( sizeof( fuse_bufvec ) + ( count - 1 ) * sizeof( fuse_buf ) ) );
+    if ( !bv ) {
+        return -ENOMEM;
+    }
+    memset( bv, 0, sizeof( fuse_bufvec ) + ( count - 1 ) * sizeof( fuse_buf ) );
+    bv->count = count;
+
+    if ( shared ) {
+        for ( size_t i = 0; i < slices.size(); ++i ) {
+            fuse_buf& b = bv->buf[i];
+            b.flags = fuse_buf_flags( FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK );
+            b.fd = slices[i].buf->fd();
+            b.pos = slices[i].start;
+            b.size = slices[i].size;
+        }
+    } else {
+        char *mem = reinterpret_cast<char*>( malloc( ret ? ret : 1 ) );
+        if ( !mem ) {
+            free( bv );
+            return -ENOMEM;
+        }
+        for ( size_t i = 0; i < slices.size(); ++i ) {
+            const OpenCompressedFile::Slice& s = slices[i];
+            memcpy( mem + s.uoff - offset, &( *s.buf )[s.start], s.size );
+        }
+        bv->buf[0].mem = mem;
+        bv->buf[0].size = ret;
+        slices.clear();
+    }
+
+    *bufp = bv;
+    return 0;
+}
+
 typedef std::vector<std::string> paths_t;
 struct OptData
 {
     const char *nextSource;
     paths_t* files;
 
-    unsigned gzipBlockFactor;
+    unsigned long gzipBlockFactor;
+    unsigned long readahead;
+    char *cachePolicy;
+    int hugePages;
+    char *diskCache;
+    unsigned long diskCacheSize;
+    unsigned long cacheSize;
+    unsigned long cacheMin;
+    unsigned long cacheMax;
+    int foregroundIndex;
+    unsigned long windowCache;
+    char *indexDir;
+    unsigned long indexDirSize;
 };
 
 static struct fuse_opt lf_opts[] = {
     { "--gzip-block-factor=%lu", offsetof( OptData, gzipBlockFactor ), 0 },
+    { "--readahead=%lu", offsetof( OptData, readahead ), 0 },
+    { "--cache-policy=%s", offsetof( OptData, cachePolicy ), 0 },
+    { "--hugepages", offsetof( OptData, hugePages ), 1 },
+    { "--disk-cache=%s", offsetof( OptData, diskCache ), 0 },
+    { "--disk-cache-size=%lu", offsetof( OptData, diskCacheSize ), 0 },
+    { "--cache-size=%lu", offsetof( OptData, cacheSize ), 0 },
+    { "--cache-min=%lu", offsetof( OptData, cacheMin ), 0 },
+    { "--cache-max=%lu", offsetof( OptData, cacheMax ), 0 },
+    { "--foreground-index", offsetof( OptData, foregroundIndex ), 1 },
+    { "--window-cache=%lu", offsetof( OptData, windowCache ), 0 },
+    { "--index-dir=%s", offsetof( OptData, indexDir ), 0 },
+    { "--index-dir-size=%lu", offsetof( OptData, indexDirSize ), 0 },
     {NULL, -1U, 0},
 };
 
@@ -210,7 +440,36 @@ int main( int   argc,
             << "\n"
             << "Options:\n"
             << "  -h|--help       Display this help message\n"
-            << "  -H|--fuse-help  Display FUSE options help (for advanced users)\n";
+            << "  -H|--fuse-help  Display FUSE options help (for advanced users)\n"
+            << "  --readahead=N   Decompress up to N blocks ahead of sequential readers\n"
+            << "                  (default: " << OpenCompressedFile::gMaxReadahead << ", 0 disables)\n"
+            << "  --cache-policy=lru|2q\n"
+            << "                  Evict least-recently used blocks, or use 2Q so that\n"
+            << "                  sequential scans don't flush reused blocks (default: 2q)\n"
+            << "  --cache-size=MB Use a fixed amount of memory for decompressed blocks\n"
+            << "  --cache-min=MB, --cache-max=MB\n"
+            << "                  Otherwise the cache grows and shrinks with the memory\n"
+            << "                  available, between these (default: "
+            << CacheFloor / 1024 / 1024 << ", and half of memory)\n"
+            << "  --hugepages     Back large cached blocks with transparent hugepages,\n"
+            << "                  rather than memory files the kernel can splice from\n"
+            << "  --disk-cache=DIR\n"
+            << "                  Also keep decompressed blocks in DIR, across mounts\n"
+            << "  --disk-cache-size=MB\n"
+            << "                  Most space to use in the disk cache (default: "
+            << DiskCacheSize / 1024 / 1024 << ")\n"
+            << "  --foreground-index\n"
+            << "                  Build missing indexes before mounting, rather than\n"
+            << "                  serving files while they're indexed in the background\n"
+            << "  --window-cache=MB\n"
+            << "                  Memory for gzip index windows, which are read from the\n"
+            << "                  index file as needed (default: "
+            << GzipWindows::gCacheSize / 1024 / 1024 << ")\n"
+            << "  --index-dir=DIR Keep indexes in DIR rather than beside their files, named\n"
+            << "                  so every mount can share them, even for copies\n"
+            << "  --index-dir-size=MB\n"
+            << "                  Most space to use in the index directory (default: "
+            << IndexDir::gMaxSize / 1024 / 1024 << ")\n";
 
         return 0;
     }
@@ -222,7 +481,9 @@ int main( int   argc,
     ops.open = lf_open;
     ops.release = lf_release;
     ops.read = lf_read;
+    ops.read_buf = lf_read_buf;
     ops.init = lf_init;
+    ops.destroy = lf_destroy;
 
     /* @todo might be better to just use the FUSE argument parsing?
      * @see https://github.com/libfuse/libfuse/wiki/Option-Parsing */
@@ -237,7 +498,9 @@ int main( int   argc,
         umask( 0 );
 
         paths_t files;
-        OptData optd = { 0, &files, 0 };
+        OptData optd = { 0, &files, 0, OpenCompressedFile::gMaxReadahead, 0, 0, 0,
+                         DiskCacheSize / 1024 / 1024, 0, CacheFloor / 1024 / 1024, 0, 0,
+                         GzipWindows::gCacheSize / 1024 / 1024, 0, IndexDir::gMaxSize / 1024 / 1024 };
         struct fuse_args fuseArgs = FUSE_ARGS_INIT( argc, argv );
         fuse_opt_parse( &fuseArgs, &optd, lf_opts, lf_opt_proc );
         if ( optd.nextSource ) {
@@ -247,10 +510,61 @@ int main( int   argc,
         if ( optd.gzipBlockFactor ) {
             GzipFile::gMinDictBlockFactor = optd.gzipBlockFactor;
         }
+        OpenCompressedFile::gMaxReadahead = optd.readahead;
+        BufferPool::gHugePages = optd.hugePages;
+        if ( optd.diskCache ) {
+            // FUSE changes directory when it daemonizes, so make it absolute
+            DiskCache::check( optd.diskCache );
+            DiskCacheDir = PathUtils::realpath( optd.diskCache );
+            free( optd.diskCache );
+        }
+        DiskCacheSize = uint64_t( optd.diskCacheSize ) * 1024 * 1024;
+        IndexedCompFile::gDeferIndex = !optd.foregroundIndex;
+        GzipWindows::gCacheSize = size_t( optd.windowCache ) * 1024 * 1024;
+        if ( optd.indexDir ) {
+            DiskCache::check( optd.indexDir );
+            IndexDir::gDir = PathUtils::realpath( optd.indexDir );
+            free( optd.indexDir );
+        }
+        IndexDir::gMaxSize = uint64_t( optd.indexDirSize ) * 1024 * 1024;
+
+        if ( optd.cachePolicy ) {
+            if ( strcmp( optd.cachePolicy, "lru" ) == 0 ) {
+                CachePolicy = LRUMapBase::LRU;
+            } else if ( strcmp( optd.cachePolicy, "2q" ) == 0 ) {
+                CachePolicy = LRUMapBase::TwoQ;
+            } else {
+                std::cerr << "Unknown cache policy " << optd.cachePolicy << "\n";
+                return 1;
+            }
+            free( optd.cachePolicy );
+        }
 
-        const auto flist = new FileList( CacheSize );
-        for ( const auto& filePath : files ) {
-            flist->add( filePath );
+        CacheFloor = optd.cacheMin * 1024 * 1024;
+        CacheCeiling = optd.cacheMax * 1024 * 1024;
+        if ( optd.cacheSize ) {
+            CacheFloor = CacheCeiling = optd.cacheSize * 1024 * 1024;
+        } else if ( !CacheCeiling ) {
+            CacheCeiling = MemoryMonitor::limit() / 2;
+        }
+        CacheCeiling = std::max( CacheFloor, CacheCeiling );
+
+        // Blocks must fit in a single shard of the cache at its largest. If
+        // it shrinks, bigger blocks are just not kept.
+        size_t maxBlock = CacheCeiling / BlockCache::shardsFor( CacheCeiling );
+        const auto flist = new FileList( maxBlock );
+        {
+            // Indexing now needs a pool of its own, its threads won't
+            // survive FUSE daemonizing
+            std::unique_ptr<ThreadPool> indexPool;
+            if ( !IndexedCompFile::gDeferIndex ) {
+                indexPool.reset( new ThreadPool( IndexedCompFile::gIndexThreads ) );
+                IndexedCompFile::gIndexPool = indexPool.get();
+            }
+            for ( const auto& filePath : files ) {
+                flist->add( filePath );
+            }
+            IndexedCompFile::gIndexPool = 0;
         }
 
         if ( flist->size() == 0 ) {